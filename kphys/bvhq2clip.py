@@ -0,0 +1,57 @@
+"""Convert BVHQ text animations into binary clip files."""
+import argparse
+
+import panda3d.core as p3d
+
+from kphys.core import BVHQ, ClipFile
+
+
+def convert(
+        input_path: str,
+        output_path: str,
+        compress: bool = False,
+        pos_tolerance: float = 0.001,
+        quat_tolerance: float = 0.001) -> bool:
+    """
+    Convert BVHQ file into the binary clip file, which can be loaded with ClipFile.
+
+    :param input_path: path to the .bvhq file
+    :param output_path: path to the output clip file
+    :param compress: compress keyframes before writing
+    :param pos_tolerance: max position error of the compressed clip
+    :param quat_tolerance: max rotation error of the compressed clip in radians
+    """
+    input_filename = p3d.Filename.from_os_specific(input_path)
+    output_filename = p3d.Filename.from_os_specific(output_path)
+
+    animation = BVHQ(input_filename.get_basename(), input_filename)
+    if not animation.is_valid():
+        return False
+
+    if compress:
+        animation.compress(pos_tolerance, quat_tolerance)
+    return ClipFile.write(animation, output_filename)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('input', nargs='+', help='.bvhq files')
+    parser.add_argument('-o', '--output', help='output file, only for a single input')
+    parser.add_argument('-c', '--compress', action='store_true', help='compress keyframes')
+    parser.add_argument('--pos-tolerance', type=float, default=0.001)
+    parser.add_argument('--quat-tolerance', type=float, default=0.001)
+    args = parser.parse_args()
+
+    if args.output and len(args.input) > 1:
+        parser.error('--output can be used only with a single input file')
+
+    for input_path in args.input:
+        output_path = args.output or input_path.rsplit('.', 1)[0] + '.kclip'
+        if convert(input_path, output_path, args.compress, args.pos_tolerance, args.quat_tolerance):
+            print(f'{input_path} -> {output_path}')
+        else:
+            print(f'{input_path}: failed')
+
+
+if __name__ == '__main__':
+    main()
@@ -1,9 +1,19 @@
+#include <algorithm>
+#include <math.h>
+
 #include "kphys/core/panda/animation.h"
 
+#define MAX_KEY_GAP 255  // limits the cost of the key reduction
+
 
 TypeHandle Animation::_type_handle;
 
 Animation::Animation(const std::string name): Namable(name) {
+    _clip_layout = new BoneLayout();
+    _num_frames = 0;
+    _frame_time = 0;
+    _is_compressed = false;
+    _update_clip_planes();
     _blend_in = true;
     _blend_out = true;
     _is_loop = true;
@@ -11,7 +21,14 @@ Animation::Animation(const std::string name): Namable(name) {
 }
 
 Animation::~Animation() {
-    _motion.clear();
+    _clip_flags.clear();
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        _clip_data[c].clear();
+    _tracks.clear();
+    _pos_key_frames.clear();
+    _pos_keys.clear();
+    _quat_key_frames.clear();
+    _quat_keys.clear();
 }
 
 unsigned long Animation::_get_frame_index(long frame) {
@@ -24,11 +41,424 @@ unsigned long Animation::_get_frame_index(long frame) {
 }
 
 unsigned long Animation::get_num_frames() {
-    return _motion.size();
+    return _num_frames;
+}
+
+unsigned int Animation::get_num_bones() {
+    return _clip_layout->get_num_bones();
+}
+
+/**
+   Get the bones of the clip.
+*/
+PointerTo<BoneLayout> Animation::get_bone_layout() {
+    return _clip_layout;
 }
 
+/**
+   Build a frame from the clip data. Frames aren't stored,
+   so a new frame is created on every call.
+*/
 PointerTo<Frame> Animation::get_frame(unsigned long i) {
-    return _motion[_get_frame_index(i)];
+    PointerTo<Frame> frame = new Frame();
+    unsigned long index = _get_frame_index(i);
+    unsigned int num_bones = get_num_bones();
+    for (unsigned int b = 0; b < num_bones; b++) {
+        unsigned short flags = _clip_flags[b];
+        float values[NUM_POSE_COMPONENTS];
+        _get_clip_values(index, b, values);
+        LVecBase3 pos(values[POSE_POS_X], values[POSE_POS_Y], values[POSE_POS_Z]);
+        LQuaternion quat(
+            values[POSE_QUAT_R], values[POSE_QUAT_I],
+            values[POSE_QUAT_J], values[POSE_QUAT_K]);
+
+        ConstPointerTo<TransformState> transform = NULL;
+        if (flags & TRANSFORM_POS && flags & TRANSFORM_QUAT)
+            // there is no make_pos_quat() method
+            transform = TransformState::make_pos_quat_scale(pos, quat, LVecBase3(1, 1, 1));
+        else if (flags & TRANSFORM_POS)
+            transform = TransformState::make_pos(pos);
+        else if (flags & TRANSFORM_QUAT)
+            transform = TransformState::make_quat(quat);
+
+        if (transform != NULL)
+            frame->set_transform(_clip_layout->get_bone_name(b), transform, flags);
+    }
+    return frame;
+}
+
+/**
+   Append a frame to the clip. Bones are taken from the first frame,
+   bones missing in the first frame are ignored. HPR is stored as quat.
+*/
+void Animation::add_frame(PointerTo<Frame> frame) {
+    nassertv(!_is_compressed);
+
+    unsigned int nt = frame->get_num_transforms();
+    if (_num_frames == 0) {
+        for (unsigned int i = 0; i < nt; i++) {
+            std::string name = frame->get_bone_name(i);
+            unsigned short frame_flags = frame->get_transform_flags(name);
+            unsigned short flags = 0;
+            if (frame_flags & TRANSFORM_POS)
+                flags |= TRANSFORM_POS;
+            if (frame_flags & (TRANSFORM_HPR | TRANSFORM_QUAT))
+                flags |= TRANSFORM_QUAT;
+            _add_clip_bone(name, flags);
+        }
+    }
+
+    unsigned long index = _add_clip_frame();
+    for (unsigned int i = 0; i < nt; i++) {
+        std::string name = frame->get_bone_name(i);
+        int b = _clip_layout->find_bone(name);
+        if (b < 0)
+            continue;
+
+        ConstPointerTo<TransformState> transform = frame->get_transform(name);
+        _set_clip_transform(index, b, transform->get_pos(), transform->get_quat());
+    }
+}
+
+/**
+   Mix frames i and j of the clip into the pose,
+   same as Frame::mix_into, but reads the clip arrays directly.
+   Existing pose transforms aren't overwritten.
+   Clip bones are resolved into the pose layout for this call only,
+   bind the layouts once and pass the binding when sampling every frame.
+*/
+void Animation::save_pose(Pose& pose, unsigned long i, unsigned long j, double factor) {
+    if (_num_frames == 0)
+        return;
+
+    BoneBinding binding(_clip_layout, pose.get_layout());
+    save_pose(pose, binding, i, j, factor);
+}
+
+/**
+   Mix frames i and j of the clip into the pose through the binding
+   of the clip layout to the pose layout. The clip isn't modified,
+   so the same clip can be sampled by several threads.
+*/
+void Animation::save_pose(
+        Pose& pose, BoneBinding& binding, unsigned long i, unsigned long j, double factor) {
+    if (_num_frames == 0)
+        return;
+    nassertv(binding.get_armature_layout() == pose.get_layout());
+    nassertv(binding.get_num_bones() == get_num_bones());
+
+    unsigned int num_bones = get_num_bones();
+    unsigned long frame_i = _get_frame_index(i);
+    unsigned long frame_j = _get_frame_index(j);
+    if (factor < 0.001)  // copy frame i
+        frame_j = frame_i;
+    else if (factor > 0.999)  // copy frame j
+        frame_i = frame_j;
+
+    for (unsigned int b = 0; b < num_bones; b++) {
+        int slot = binding.get_armature_slot(b);
+        if (slot < 0 || pose.has_transform(slot))
+            continue;
+
+        float values[NUM_POSE_COMPONENTS];
+        _get_clip_values(frame_i, b, values);
+
+        if (frame_i != frame_j) {
+            float values_j[NUM_POSE_COMPONENTS];
+            _get_clip_values(frame_j, b, values_j);
+
+            for (unsigned int c = POSE_POS_X; c <= POSE_POS_Z; c++)
+                values[c] -= factor * (values[c] - values_j[c]);
+
+            // negate quat if dot product is negative
+            float dot = 0;
+            for (unsigned int c = POSE_QUAT_R; c <= POSE_QUAT_K; c++)
+                dot += values[c] * values_j[c];
+            float sign = (dot < 0) ? -1.0f : 1.0f;
+            for (unsigned int c = POSE_QUAT_R; c <= POSE_QUAT_K; c++)
+                values[c] -= factor * (values[c] - sign * values_j[c]);
+        }
+
+        pose.set_transform(
+            slot,
+            LVecBase3(values[POSE_POS_X], values[POSE_POS_Y], values[POSE_POS_Z]),
+            LQuaternion(
+                values[POSE_QUAT_R], values[POSE_QUAT_I],
+                values[POSE_QUAT_J], values[POSE_QUAT_K]),
+            _clip_flags[b]);
+    }
+}
+
+static double get_error(const LVecBase3& a, const LVecBase3& b) {
+    return (a - b).length();
+}
+
+static double get_error(const LQuaternion& a, const LQuaternion& b) {
+    double dot = fabs(a.dot(b));
+    return 2.0 * acos(MIN(dot, 1.0));  // angle between rotations
+}
+
+static LVecBase3 interpolate(const LVecBase3& a, const LVecBase3& b, double factor) {
+    return mix3(a, b, factor);
+}
+
+static LQuaternion interpolate(const LQuaternion& a, const LQuaternion& b, double factor) {
+    LQuaternion quat = quat_nlerp(a, b, factor);
+    quat.normalize();
+    return quat;
+}
+
+/**
+   Greedy key reduction. A frame is dropped when interpolation between
+   the neighbour keys reproduces all the dropped frames within the tolerance.
+   Decoded values are used for interpolation, so the quantization error is included.
+   Returns false if the quantization error of a kept key exceeds the tolerance.
+*/
+template<class T>
+static bool reduce_keys(
+        const pvector<T>& values, const pvector<T>& decoded,
+        double tolerance, pvector<unsigned int>& keys) {
+    unsigned long num_frames = values.size();
+    unsigned long start = 0;
+    keys.push_back(0);
+    for (unsigned long end = 2; end < num_frames; end++) {
+        bool is_valid = end - start <= MAX_KEY_GAP;
+        for (unsigned long f = start + 1; is_valid && f < end; f++) {
+            double factor = (double) (f - start) / (end - start);
+            T value = interpolate(decoded[start], decoded[end], factor);
+            is_valid = get_error(value, values[f]) <= tolerance;
+        }
+        if (!is_valid) {
+            start = end - 1;
+            keys.push_back(start);
+        }
+    }
+    if (num_frames > 1)
+        keys.push_back(num_frames - 1);
+
+    for (unsigned int f: keys)
+        if (get_error(decoded[f], values[f]) > tolerance)
+            return false;
+    return true;
+}
+
+/**
+   Compress the clip: quaternions are packed with smallest three 48-bit
+   encoding, positions are stored as 16-bit fixed-point values in the
+   range of the bone, and keys restorable by interpolation are dropped.
+   Tolerances are the max position distance and the max rotation angle
+   in radians. The uncompressed data is released. The clip is kept
+   uncompressed if the 16-bit encoding can't meet the tolerances.
+*/
+void Animation::compress(double pos_tolerance, double quat_tolerance) {
+    if (_is_compressed || _num_frames == 0)
+        return;
+
+    unsigned int num_bones = get_num_bones();
+    _tracks.resize(num_bones);
+    pvector<LVecBase3> pos_values(_num_frames), pos_decoded(_num_frames);
+    pvector<LQuaternion> quat_values(_num_frames), quat_decoded(_num_frames);
+    pvector<unsigned short> pos_packed(_num_frames * 3), quat_packed(_num_frames * SMALLEST_THREE_SIZE);
+    pvector<unsigned int> keys;
+
+    for (unsigned int b = 0; b < num_bones; b++) {
+        ClipTrack& track = _tracks[b];
+        unsigned short flags = _clip_flags[b];
+
+        // positions range
+        for (unsigned int c = 0; c < 3; c++) {
+            float pos_min = 0, pos_max = 0;
+            for (unsigned long f = 0; f < _num_frames; f++) {
+                float value = _clip_planes[POSE_POS_X + c][f * num_bones + b];
+                pos_min = (f == 0) ? value : MIN(pos_min, value);
+                pos_max = (f == 0) ? value : MAX(pos_max, value);
+            }
+            track.pos_min[c] = pos_min;
+            track.pos_scale[c] = (pos_max - pos_min) / 0xffff;
+        }
+
+        // quantize all the frames
+        for (unsigned long f = 0; f < _num_frames; f++) {
+            unsigned long k = f * num_bones + b;
+            for (unsigned int c = 0; c < 3; c++) {
+                float value = _clip_planes[POSE_POS_X + c][k];
+                pos_values[f][c] = value;
+                pos_packed[f * 3 + c] = (track.pos_scale[c] > 0) ?
+                    (unsigned short) lrintf((value - track.pos_min[c]) / track.pos_scale[c]) : 0;
+                pos_decoded[f][c] = track.pos_min[c] + pos_packed[f * 3 + c] * track.pos_scale[c];
+            }
+
+            LQuaternion quat(
+                _clip_planes[POSE_QUAT_R][k], _clip_planes[POSE_QUAT_I][k],
+                _clip_planes[POSE_QUAT_J][k], _clip_planes[POSE_QUAT_K][k]);
+            quat.normalize();
+            quat_values[f] = quat;
+            quat_to_smallest_three(quat, &quat_packed[f * SMALLEST_THREE_SIZE]);
+            quat_decoded[f] = smallest_three_to_quat(&quat_packed[f * SMALLEST_THREE_SIZE]);
+        }
+
+        // keep the keys, which can't be interpolated
+        track.pos_key = _pos_key_frames.size();
+        track.num_pos_keys = 0;
+        if (flags & TRANSFORM_POS) {
+            keys.clear();
+            if (!reduce_keys(pos_values, pos_decoded, pos_tolerance, keys))
+                return _discard_tracks();
+            for (unsigned int f: keys) {
+                _pos_key_frames.push_back(f);
+                for (unsigned int c = 0; c < 3; c++)
+                    _pos_keys.push_back(pos_packed[f * 3 + c]);
+            }
+            track.num_pos_keys = keys.size();
+        }
+
+        track.quat_key = _quat_key_frames.size();
+        track.num_quat_keys = 0;
+        if (flags & TRANSFORM_QUAT) {
+            keys.clear();
+            if (!reduce_keys(quat_values, quat_decoded, quat_tolerance, keys))
+                return _discard_tracks();
+            for (unsigned int f: keys) {
+                _quat_key_frames.push_back(f);
+                for (unsigned int c = 0; c < SMALLEST_THREE_SIZE; c++)
+                    _quat_keys.push_back(quat_packed[f * SMALLEST_THREE_SIZE + c]);
+            }
+            track.num_quat_keys = keys.size();
+        }
+    }
+
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        pvector<float>().swap(_clip_data[c]);  // release memory
+    _is_compressed = true;
+    _update_clip_planes();
+}
+
+void Animation::_discard_tracks() {
+    _tracks.clear();
+    _pos_key_frames.clear();
+    _quat_key_frames.clear();
+    _pos_keys.clear();
+    _quat_keys.clear();
+}
+
+bool Animation::is_compressed() {
+    return _is_compressed;
+}
+
+/**
+   Returns the size of the clip data in bytes, memory mapped data isn't counted.
+*/
+size_t Animation::get_data_size() {
+    size_t size = _clip_flags.size() * sizeof(unsigned short);
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        size += _clip_data[c].size() * sizeof(float);
+    size += _tracks.size() * sizeof(ClipTrack);
+    size += (_pos_key_frames.size() + _quat_key_frames.size()) * sizeof(unsigned int);
+    size += (_pos_keys.size() + _quat_keys.size()) * sizeof(unsigned short);
+    return size;
+}
+
+/**
+   Read pos xyz and quat rijk of the bone at the frame.
+*/
+void Animation::_get_clip_values(unsigned long frame, unsigned int bone, float* values) {
+    if (_is_compressed)
+        return _sample_track(frame, bone, values);
+
+    unsigned long k = frame * get_num_bones() + bone;
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        values[c] = _clip_planes[c][k];
+}
+
+/**
+   Read the compressed bone track, keys are found with binary search.
+*/
+void Animation::_sample_track(unsigned long frame, unsigned int bone, float* values) {
+    const ClipTrack& track = _tracks[bone];
+
+    LVecBase3 pos(0, 0, 0);
+    if (track.num_pos_keys) {
+        const unsigned int* frames = &_pos_key_frames[track.pos_key];
+        unsigned int k = std::upper_bound(
+            frames, frames + track.num_pos_keys, (unsigned int) frame) - frames - 1;
+        pos = _decode_pos(track, track.pos_key + k);
+        if (frames[k] != frame && k + 1 < track.num_pos_keys) {
+            double factor = (double) (frame - frames[k]) / (frames[k + 1] - frames[k]);
+            pos = mix3(pos, _decode_pos(track, track.pos_key + k + 1), factor);
+        }
+    }
+
+    LQuaternion quat = LQuaternion::ident_quat();
+    if (track.num_quat_keys) {
+        const unsigned int* frames = &_quat_key_frames[track.quat_key];
+        unsigned int k = std::upper_bound(
+            frames, frames + track.num_quat_keys, (unsigned int) frame) - frames - 1;
+        const unsigned short* packed = &_quat_keys[(track.quat_key + k) * SMALLEST_THREE_SIZE];
+        quat = smallest_three_to_quat(packed);
+        if (frames[k] != frame && k + 1 < track.num_quat_keys) {
+            double factor = (double) (frame - frames[k]) / (frames[k + 1] - frames[k]);
+            quat = interpolate(
+                quat, smallest_three_to_quat(packed + SMALLEST_THREE_SIZE), factor);
+        }
+    }
+
+    for (unsigned int c = 0; c < 3; c++)
+        values[POSE_POS_X + c] = pos[c];
+    for (unsigned int c = 0; c < 4; c++)
+        values[POSE_QUAT_R + c] = quat[c];
+}
+
+LVecBase3 Animation::_decode_pos(const ClipTrack& track, unsigned int key) {
+    const unsigned short* packed = &_pos_keys[key * 3];
+    return LVecBase3(
+        track.pos_min[0] + packed[0] * track.pos_scale[0],
+        track.pos_min[1] + packed[1] * track.pos_scale[1],
+        track.pos_min[2] + packed[2] * track.pos_scale[2]);
+}
+
+/**
+   Add a bone to the clip, should be called before adding frames.
+*/
+unsigned int Animation::_add_clip_bone(std::string name, unsigned short flags) {
+    nassertr(_num_frames == 0, 0);
+    unsigned int b = _clip_layout->add_bone(name);
+    if (b == _clip_flags.size())
+        _clip_flags.push_back(flags);
+    else
+        _clip_flags[b] |= flags;
+    return b;
+}
+
+/**
+   Append a frame with identity transforms. Returns the frame index.
+*/
+unsigned long Animation::_add_clip_frame() {
+    nassertr(!_is_compressed, 0);
+    unsigned int num_bones = get_num_bones();
+    nassertr(_clip_data[0].size() == _num_frames * num_bones, 0);  // not a mapped clip
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        _clip_data[c].resize((_num_frames + 1) * num_bones, (c == POSE_QUAT_R) ? 1.0f : 0.0f);
+    _update_clip_planes();
+    return _num_frames++;
+}
+
+/**
+   Point clip planes to the own clip data.
+*/
+void Animation::_update_clip_planes() {
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        _clip_planes[c] = _clip_data[c].data();
+}
+
+void Animation::_set_clip_transform(
+        unsigned long frame, unsigned int bone,
+        const LVecBase3& pos, const LQuaternion& quat) {
+    nassertv(!_is_compressed);
+    unsigned long k = frame * get_num_bones() + bone;
+    for (unsigned int c = 0; c < 3; c++)
+        _clip_data[POSE_POS_X + c][k] = pos[c];
+    for (unsigned int c = 0; c < 4; c++)
+        _clip_data[POSE_QUAT_R + c][k] = quat[c];
 }
 
 /**
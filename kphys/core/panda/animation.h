@@ -5,7 +5,9 @@
 #include "pvector.h"
 #include "typedReferenceCount.h"
 
+#include "kphys/core/panda/bonebinding.h"
 #include "kphys/core/panda/frame.h"
+#include "kphys/core/panda/pose.h"
 
 
 class EXPORT_CLASS Animation: public TypedReferenceCount, public Namable {
@@ -13,7 +15,16 @@ PUBLISHED:
     Animation(const std::string name);
     ~Animation();
     unsigned long get_num_frames();
+    unsigned int get_num_bones();
+    PointerTo<BoneLayout> get_bone_layout();
     PointerTo<Frame> get_frame(unsigned long i);
+    void add_frame(PointerTo<Frame> frame);
+    void save_pose(Pose& pose, unsigned long i, unsigned long j, double factor);
+    void save_pose(
+        Pose& pose, BoneBinding& binding, unsigned long i, unsigned long j, double factor);
+    void compress(double pos_tolerance=0.001, double quat_tolerance=0.001);
+    bool is_compressed();
+    size_t get_data_size();
     double get_frame_time();
     void set_frame_time(double frame_time);
     bool can_blend_in();
@@ -25,18 +36,50 @@ PUBLISHED:
     void set_manual(bool manual);
 
 private:
+    friend class ClipFile;
+
+    struct ClipTrack {
+        unsigned int pos_key;  // first key in _pos_key_frames
+        unsigned int num_pos_keys;
+        unsigned int quat_key;  // first key in _quat_key_frames
+        unsigned int num_quat_keys;
+        float pos_min[3];  // fixed-point positions range
+        float pos_scale[3];
+    };
+
     unsigned long _get_frame_index(long frame);
+    void _get_clip_values(unsigned long frame, unsigned int bone, float* values);
+    void _sample_track(unsigned long frame, unsigned int bone, float* values);
+    LVecBase3 _decode_pos(const ClipTrack& track, unsigned int key);
+    void _discard_tracks();
     bool _blend_in;
     bool _blend_out;
     bool _is_loop;
     bool _is_manual;
+    bool _is_compressed;
+    pvector<ClipTrack> _tracks;  // compressed tracks per bone
+    pvector<unsigned int> _pos_key_frames;
+    pvector<unsigned short> _pos_keys;  // 3 fixed-point values per key
+    pvector<unsigned int> _quat_key_frames;
+    pvector<unsigned short> _quat_keys;  // smallest three, 3 values per key
 
     static TypeHandle _type_handle;
 
 protected:
-    pvector<PointerTo<Frame>> _motion;
+    PointerTo<BoneLayout> _clip_layout;  // bones of the clip
+    pvector<unsigned short> _clip_flags;  // TRANSFORM_POS | TRANSFORM_QUAT per bone
+    pvector<float> _clip_data[NUM_POSE_COMPONENTS];  // [frame * num_bones + bone]
+    const float* _clip_planes[NUM_POSE_COMPONENTS];  // clip data or memory mapped file
+    unsigned long _num_frames;
     double _frame_time;
 
+    unsigned int _add_clip_bone(std::string name, unsigned short flags);
+    unsigned long _add_clip_frame();
+    void _update_clip_planes();
+    void _set_clip_transform(
+        unsigned long frame, unsigned int bone,
+        const LVecBase3& pos, const LQuaternion& quat);
+
 public:
     static TypeHandle get_class_type() {
         return _type_handle;
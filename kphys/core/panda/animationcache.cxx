@@ -0,0 +1,206 @@
+#include <iterator>
+
+#include "lightMutexHolder.h"
+#include "virtualFileSystem.h"
+
+#include "kphys/core/panda/animationcache.h"
+#include "kphys/core/panda/bvhq.h"
+#include "kphys/core/panda/clipfile.h"
+#include "kphys/core/panda/config.h"
+
+
+/**
+ * Process-wide registry of loaded animations keyed by the file name
+ * and modification time, so the same clip is parsed only once.
+ * Animations which are not used anywhere else are evicted
+ * in least recently used order when the budget is exceeded.
+ */
+AnimationCache::AnimationCache()
+        : _resident_size(0)
+        , _budget(kphys_animation_cache_budget) {}
+
+/**
+ * The cache is created by init_libcore(), the local static keeps
+ * the creation thread safe if it's used before that.
+ */
+AnimationCache* AnimationCache::get_global_ptr() {
+    static AnimationCache* global_ptr = new AnimationCache();
+    return global_ptr;
+}
+
+/**
+ * Returns the shared animation, loads it if it isn't cached or the file was modified.
+ * Returns NULL if the file can't be loaded.
+ */
+PointerTo<Animation> AnimationCache::load(Filename filename, bool compress) {
+    time_t timestamp;
+    std::string key = _get_key(filename, compress, &timestamp);
+    if (key.empty())
+        return NULL;
+
+    {
+        LightMutexHolder holder(_lock);
+        KDICT<std::string, Entries::iterator>::iterator it = _index.find(key);
+        if (it != _index.end()) {
+            if (it->second->timestamp == timestamp) {
+                _entries.splice(_entries.begin(), _entries, it->second);
+                return it->second->animation;
+            }
+            _remove(it->second);
+        }
+    }
+
+    // don't block other threads while parsing
+    PointerTo<Animation> animation = load_animation_file(
+        filename.get_basename(), filename, compress);
+    if (animation == NULL)
+        return NULL;
+
+    LightMutexHolder holder(_lock);
+    KDICT<std::string, Entries::iterator>::iterator it = _index.find(key);
+    if (it != _index.end() && it->second->timestamp == timestamp) {
+        // loaded by another thread in the meantime
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return it->second->animation;
+    }
+    if (it != _index.end())
+        _remove(it->second);
+
+    CacheEntry entry;
+    entry.key = key;
+    entry.timestamp = timestamp;
+    entry.animation = animation;
+    entry.size = animation->get_data_size();
+    _entries.push_front(entry);
+    _index[key] = _entries.begin();
+    _resident_size += entry.size;
+    _evict();
+    return animation;
+}
+
+bool AnimationCache::has_animation(Filename filename, bool compress) {
+    std::string key = _get_key(filename, compress, NULL);
+    LightMutexHolder holder(_lock);
+    return _index.find(key) != _index.end();
+}
+
+/**
+ * Returns the resident size of the cached animation in bytes, 0 if it isn't cached.
+ */
+size_t AnimationCache::get_animation_size(Filename filename, bool compress) {
+    std::string key = _get_key(filename, compress, NULL);
+    LightMutexHolder holder(_lock);
+    KDICT<std::string, Entries::iterator>::iterator it = _index.find(key);
+    if (it == _index.end())
+        return 0;
+    return it->second->size;
+}
+
+unsigned int AnimationCache::get_num_animations() {
+    LightMutexHolder holder(_lock);
+    return _entries.size();
+}
+
+size_t AnimationCache::get_resident_size() {
+    LightMutexHolder holder(_lock);
+    return _resident_size;
+}
+
+size_t AnimationCache::get_budget() {
+    LightMutexHolder holder(_lock);
+    return _budget;
+}
+
+void AnimationCache::set_budget(size_t budget) {
+    LightMutexHolder holder(_lock);
+    _budget = budget;
+    _evict();
+}
+
+/**
+ * Remove unused animations until the cache fits into the budget.
+ */
+void AnimationCache::evict() {
+    LightMutexHolder holder(_lock);
+    _evict();
+}
+
+/**
+ * Remove all unused animations.
+ */
+void AnimationCache::clear() {
+    LightMutexHolder holder(_lock);
+    Entries::iterator it = _entries.begin();
+    while (it != _entries.end()) {
+        Entries::iterator next = std::next(it);
+        if (it->animation->get_ref_count() == 1)
+            _remove(it);
+        it = next;
+    }
+}
+
+void AnimationCache::ls() {
+    LightMutexHolder holder(_lock);
+    printf("AnimationCache (%zu / %zu bytes) {\n", _resident_size, _budget);
+    for (const CacheEntry& entry: _entries)
+        printf(
+            "    %s: %zu bytes, %d refs\n", entry.key.c_str(), entry.size,
+            entry.animation->get_ref_count() - 1);
+    printf("}\n");
+}
+
+/**
+ * Load BVHQ or binary clip file, chosen by the file extension, without caching.
+ */
+PointerTo<Animation> AnimationCache::load_animation_file(
+        const std::string name, Filename filename, bool compress) {
+    PointerTo<Animation> animation = NULL;
+    if (filename.get_extension() == "kclip") {
+        PointerTo<ClipFile> clip = new ClipFile(name, filename);
+        if (clip->is_valid())
+            animation = clip;
+    } else {
+        PointerTo<BVHQ> bvhq = new BVHQ(name, filename);
+        if (bvhq->is_valid())
+            animation = bvhq;
+    }
+
+    if (animation != NULL && compress && !animation->is_compressed())
+        animation->compress();
+    return animation;
+}
+
+/**
+ * Returns the key of the resolved file, empty string if the file doesn't exist.
+ */
+std::string AnimationCache::_get_key(Filename filename, bool compress, time_t* timestamp) {
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    PointerTo<VirtualFile> file = vfs->get_file(filename, true);
+    if (file == NULL)
+        return "";
+
+    if (timestamp != NULL)
+        *timestamp = file->get_timestamp();
+    std::string key = file->get_filename().get_fullpath();
+    if (compress)
+        key += ":compressed";
+    return key;
+}
+
+void AnimationCache::_remove(Entries::iterator it) {
+    _resident_size -= it->size;
+    _index.erase(it->key);
+    _entries.erase(it);
+}
+
+void AnimationCache::_evict() {
+    Entries::iterator it = _entries.end();
+    while (_resident_size > _budget && it != _entries.begin()) {
+        Entries::iterator prev = std::prev(it);
+        // the cache holds the only reference, nobody is using the animation
+        if (prev->animation->get_ref_count() == 1)
+            _remove(prev);
+        else
+            it = prev;
+    }
+}
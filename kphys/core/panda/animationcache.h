@@ -0,0 +1,52 @@
+#ifndef PANDA_ANIMATION_CACHE_H
+#define PANDA_ANIMATION_CACHE_H
+
+#include <time.h>
+
+#include "filename.h"
+#include "lightMutex.h"
+#include "plist.h"
+
+#include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/types.h"
+
+
+class EXPORT_CLASS AnimationCache {
+PUBLISHED:
+    static AnimationCache* get_global_ptr();
+    PointerTo<Animation> load(Filename filename, bool compress=false);
+    bool has_animation(Filename filename, bool compress=false);
+    size_t get_animation_size(Filename filename, bool compress=false);
+    unsigned int get_num_animations();
+    size_t get_resident_size();
+    size_t get_budget();
+    void set_budget(size_t budget);
+    void evict();
+    void clear();
+    void ls();
+
+    static PointerTo<Animation> load_animation_file(
+        const std::string name, Filename filename, bool compress=false);
+
+private:
+    struct CacheEntry {
+        std::string key;
+        time_t timestamp;  // modification time of the file
+        PointerTo<Animation> animation;
+        size_t size;  // resident bytes
+    };
+    typedef plist<CacheEntry> Entries;
+
+    AnimationCache();
+    std::string _get_key(Filename filename, bool compress, time_t* timestamp);
+    void _remove(Entries::iterator it);
+    void _evict();
+
+    LightMutex _lock;
+    Entries _entries;  // most recently used first
+    KDICT<std::string, Entries::iterator> _index;
+    size_t _resident_size;
+    size_t _budget;
+};
+
+#endif
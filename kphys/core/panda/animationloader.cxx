@@ -0,0 +1,67 @@
+#include "asyncTaskChain.h"
+#include "asyncTaskManager.h"
+#include "threadPriority.h"
+
+#include "kphys/core/panda/animationcache.h"
+#include "kphys/core/panda/animationloader.h"
+
+
+TypeHandle AnimationLoadTask::_type_handle;
+
+/**
+ * Task, which loads BVHQ or binary clip file, chosen by the file extension.
+ * The task is a future, the animation is available when it's done.
+ * Cached animations are shared through the AnimationCache and named by the file.
+ */
+AnimationLoadTask::AnimationLoadTask(
+        const std::string name, Filename filename,
+        bool compress, bool cached): AsyncTask(name)
+        , _filename(filename)
+        , _compress(compress)
+        , _cached(cached)
+        , _animation(NULL) {}
+
+AnimationLoadTask::~AnimationLoadTask() {
+    _animation = NULL;
+}
+
+Filename AnimationLoadTask::get_filename() {
+    return _filename;
+}
+
+/**
+ * Returns the loaded animation, NULL if it isn't loaded yet or loading failed.
+ */
+PointerTo<Animation> AnimationLoadTask::get_animation() {
+    if (!done())
+        return NULL;
+    return _animation;
+}
+
+/**
+ * Start loading the animation on the loader thread.
+ * The thread pool can be configured with the "kphys_animation_loader"
+ * task chain of the global task manager.
+ */
+PointerTo<AnimationLoadTask> AnimationLoadTask::load_async(
+        const std::string name, Filename filename, bool compress, bool cached) {
+    AsyncTaskManager* manager = AsyncTaskManager::get_global_ptr();
+    AsyncTaskChain* chain = manager->make_task_chain(ANIMATION_LOADER_CHAIN);
+    if (chain->get_num_threads() == 0) {  // new chain
+        chain->set_num_threads(1);
+        chain->set_thread_priority(TP_low);
+    }
+
+    PointerTo<AnimationLoadTask> task = new AnimationLoadTask(name, filename, compress, cached);
+    task->set_task_chain(ANIMATION_LOADER_CHAIN);
+    manager->add(task);
+    return task;
+}
+
+AsyncTask::DoneStatus AnimationLoadTask::do_task() {
+    if (_cached)
+        _animation = AnimationCache::get_global_ptr()->load(_filename, _compress);
+    else
+        _animation = AnimationCache::load_animation_file(get_name(), _filename, _compress);
+    return DS_done;
+}
@@ -0,0 +1,52 @@
+#ifndef PANDA_ANIMATION_LOADER_H
+#define PANDA_ANIMATION_LOADER_H
+
+#include "asyncTask.h"
+#include "filename.h"
+
+#include "kphys/core/panda/animation.h"
+
+#define ANIMATION_LOADER_CHAIN "kphys_animation_loader"
+
+
+class EXPORT_CLASS AnimationLoadTask: public AsyncTask {
+PUBLISHED:
+    AnimationLoadTask(
+        const std::string name, Filename filename,
+        bool compress=false, bool cached=false);
+    ~AnimationLoadTask();
+    Filename get_filename();
+    PointerTo<Animation> get_animation();
+    static PointerTo<AnimationLoadTask> load_async(
+        const std::string name, Filename filename,
+        bool compress=false, bool cached=false);
+
+protected:
+    virtual DoneStatus do_task();
+
+private:
+    Filename _filename;
+    bool _compress;
+    bool _cached;
+    PointerTo<Animation> _animation;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        AsyncTask::init_type();
+        register_type(_type_handle, "AnimationLoadTask", AsyncTask::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
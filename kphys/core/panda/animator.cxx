@@ -6,23 +6,19 @@
 
 TypeHandle AnimatorNode::_type_handle;
 
-AnimatorNode::AnimatorNode(const std::string name): PandaNode(name) {
-    _mframe = new Frame();
-    for (unsigned int s = 0; s < NUM_SLOTS; s++) {
-        _iframes[s] = new Frame();
-        _fframes[s] = new Frame();
-    }
-}
+AnimatorNode::AnimatorNode(const std::string name): PandaNode(name), _blend_tree(NULL) {}
 
 AnimatorNode::~AnimatorNode() {
-    _mframe->reset();
+    _mpose = NULL;
     for (unsigned int s = 0; s < NUM_SLOTS; s++) {
-        _iframes[s]->reset();
-        _fframes[s]->reset();
+        _iposes[s] = NULL;
+        _fposes[s] = NULL;
     }
     _animations.clear();
+    _loading_animations.clear();
     _channel_names.clear();
     _channels.clear();
+    _blend_tree = NULL;
 }
 
 unsigned int AnimatorNode::get_num_channels() {
@@ -57,13 +53,44 @@ PointerTo<Channel> AnimatorNode::get_channel(std::string name) {
    Put a reusable animation in the storage.
 */
 void AnimatorNode::put_animation(std::string name, PointerTo<Animation> animation) {
+    _loading_animations.erase(name);
     _animations[name] = animation;
 }
 
+/**
+   Put an animation, which is being loaded, in the storage.
+   It becomes available when the loading task is done.
+*/
+void AnimatorNode::put_animation(std::string name, PointerTo<AnimationLoadTask> task) {
+    _animations.erase(name);
+    _loading_animations[name] = task;
+}
+
+/**
+   Check if the animation is still being loaded.
+*/
+bool AnimatorNode::is_animation_loading(std::string name) {
+    get_animation(name);  // take the loaded animation
+    return _loading_animations.find(name) != _loading_animations.end();
+}
+
 /**
    Get a reusable animation from the storage.
+   Returns NULL if the animation is still being loaded.
 */
 PointerTo<Animation> AnimatorNode::get_animation(std::string name) {
+    KDICT<std::string, PointerTo<AnimationLoadTask>>::iterator it = _loading_animations.find(name);
+    if (it != _loading_animations.end()) {
+        if (!it->second->done())
+            return NULL;
+
+        PointerTo<Animation> animation = it->second->get_animation();
+        _loading_animations.erase(it);
+        if (animation == NULL)  // failed to load
+            return NULL;
+        _animations[name] = animation;
+    }
+
     if (_animations.find(name) == _animations.end())
         return NULL;
     return _animations[name];
@@ -85,7 +112,25 @@ NodePath AnimatorNode::find_armature() {
     return _armatures["armature"];
 }
 
+PointerTo<BlendTree> AnimatorNode::get_blend_tree() {
+    return _blend_tree;
+}
+
+/**
+   Evaluate the blend tree instead of the channels, NULL switches back to the channels.
+*/
+void AnimatorNode::set_blend_tree(PointerTo<BlendTree> blend_tree) {
+    _blend_tree = blend_tree;
+    if (_blend_tree != NULL && _mpose != NULL)
+        _blend_tree->setup(_mpose->get_layout());
+}
+
 void AnimatorNode::update(double dt) {
+    if (_blend_tree != NULL) {
+        _blend_tree->update(dt);
+        return;
+    }
+
     unsigned int csize = get_num_channels();
     for (unsigned int c = 0; c < csize; c++) {
         PointerTo<Channel> channel = get_channel(c);
@@ -93,26 +138,76 @@ void AnimatorNode::update(double dt) {
     }
 }
 
+/**
+   Allocate poses for the armature bone layout.
+*/
+void AnimatorNode::_setup_poses(PointerTo<BoneLayout> layout) {
+    _mpose = new Pose(layout);
+    for (unsigned int s = 0; s < NUM_SLOTS; s++) {
+        _iposes[s] = new Pose(layout);
+        _fposes[s] = new Pose(layout);
+    }
+
+    // masks are compiled once, not by the first evaluation
+    unsigned int csize = get_num_channels();
+    for (unsigned int c = 0; c < csize; c++)
+        get_channel(c)->get_compiled_mask(layout);
+    if (_blend_tree != NULL)
+        _blend_tree->setup(layout);
+}
+
+/**
+   Set up the poses and masks for the armature ahead of apply(),
+   done by PuppetMasterNode::build() before the threaded updates.
+*/
+void AnimatorNode::setup() {
+    NodePath armature = find_armature();
+    if (armature.is_empty())
+        return;
+
+    PointerTo<BoneLayout> layout = ((ArmatureNode*) armature.node())->get_bone_layout();
+    if (_mpose == NULL || _mpose->get_layout() != layout)
+        _setup_poses(layout);
+}
+
 void AnimatorNode::apply(bool blend, bool interpolate) {
     NodePath armature = find_armature();
     if (armature.is_empty())
         return;
 
+    ArmatureNode* armature_node = (ArmatureNode*) armature.node();
+    PointerTo<BoneLayout> layout = armature_node->get_bone_layout();
+    if (_mpose == NULL || _mpose->get_layout() != layout)
+        _setup_poses(layout);
+
+    // all layers and crossfades are evaluated into the final pose
+    if (_blend_tree != NULL) {
+        if (_blend_tree->evaluate(_mpose))
+            armature_node->apply(_mpose);
+        return;
+    }
+
+    unsigned int num_bones = layout->get_num_bones();
     for (unsigned int s = 0; s < NUM_SLOTS; s++) {
-        _fframes[s]->reset();
+        _fposes[s]->reset();
 
         if (s == SLOT_A && !blend)
             continue;
 
-        // merge all channels into the singe frame
+        // merge all channels into the singe pose
         unsigned int csize = get_num_channels();
         for (unsigned int c = 0; c < csize; c++) {
             PointerTo<Channel> channel = get_channel(c);
 
-            _iframes[s]->reset();
-            if (!channel->save_frame(*_iframes[s].p(), s, interpolate))
+            if (!channel->is_slot_sampled(s))
                 continue;
 
+            _iposes[s]->reset();
+            if (!channel->save_pose(*_iposes[s].p(), s, interpolate))
+                continue;
+            if (s == channel->get_output_slot())
+                channel->inertialize(*_iposes[s].p());
+
             double cfactor = channel->get_factor();
             if (s == SLOT_A)
                 cfactor = 1.0 - cfactor;
@@ -120,23 +215,24 @@ void AnimatorNode::apply(bool blend, bool interpolate) {
             if (!blend)
                 cfactor = 1.0;
 
-            // copy transforms
-            unsigned int bsize = _iframes[s]->get_num_transforms();
-            for (unsigned int b = 0; b < bsize; b++) {
-                std::string bone_name = _iframes[s]->get_bone_name(b);
-                if (!channel->is_bone_enabled(bone_name))
+            // copy transforms, the mask is NULL for the channels without filters
+            const uint32_t* mask = channel->get_compiled_mask(layout)->get_bits();
+            for (unsigned int b = 0; b < num_bones; b++) {
+                if (!_iposes[s]->has_transform(b))
+                    continue;
+                if (mask != NULL && !is_bone_in_mask(mask, b))
                     continue;
 
-                _iframes[s]->copy_transform_into(*_fframes[s].p(), bone_name, cfactor);
+                _iposes[s]->copy_transform_into(*_fposes[s].p(), b, cfactor);
             }
         }
     }
 
     if (blend) {
-        _mframe->reset();
-        _fframes[SLOT_A]->mix_into(*_mframe.p(), _fframes[SLOT_B]);
-        ((ArmatureNode*) armature.node())->apply(_mframe);
+        _mpose->reset();
+        _fposes[SLOT_A]->mix_into(*_mpose.p(), _fposes[SLOT_B]);
+        armature_node->apply(_mpose);
     } else {
-        ((ArmatureNode*) armature.node())->apply(_fframes[SLOT_B]);
+        armature_node->apply(_fposes[SLOT_B]);
     }
 }
@@ -6,8 +6,11 @@
 #include "nodePath.h"
 
 #include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/animationloader.h"
+#include "kphys/core/panda/blendtree.h"
 #include "kphys/core/panda/channel.h"
 #include "kphys/core/panda/frame.h"
+#include "kphys/core/panda/pose.h"
 #include "kphys/core/panda/types.h"
 
 
@@ -20,19 +23,28 @@ PUBLISHED:
     PointerTo<Channel> get_channel(unsigned int i);
     PointerTo<Channel> get_channel(std::string name);
     void put_animation(std::string name, PointerTo<Animation> animation);
+    void put_animation(std::string name, PointerTo<AnimationLoadTask> task);
+    bool is_animation_loading(std::string name);
     PointerTo<Animation> get_animation(std::string name);
     NodePath find_armature();
+    PointerTo<BlendTree> get_blend_tree();
+    void set_blend_tree(PointerTo<BlendTree> blend_tree);
     void update(double dt);
+    void setup();
     void apply(bool blend=true, bool interpolate=true);
 
 private:
-    PointerTo<Frame> _mframe;  // final mixed frame
-    PointerTo<Frame> _iframes[NUM_SLOTS];  // interpolated frames
-    PointerTo<Frame> _fframes[NUM_SLOTS];  // filtered frames
+    PointerTo<Pose> _mpose;  // final mixed pose
+    PointerTo<Pose> _iposes[NUM_SLOTS];  // interpolated poses
+    PointerTo<Pose> _fposes[NUM_SLOTS];  // filtered poses
     KDICT<std::string, PointerTo<Animation>> _animations;
+    KDICT<std::string, PointerTo<AnimationLoadTask>> _loading_animations;
     KDICT<std::string, NodePath> _armatures;
     pvector<std::string> _channel_names;
     KDICT<std::string, PointerTo<Channel>> _channels;
+    PointerTo<BlendTree> _blend_tree;  // replaces the channels if set
+
+    void _setup_poses(PointerTo<BoneLayout> layout);
 
     static TypeHandle _type_handle;
 
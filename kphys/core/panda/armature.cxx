@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "lightMutexHolder.h"
+
 #include "kphys/core/panda/armature.h"
 #include "kphys/core/panda/bone.h"
 #include "kphys/core/panda/wigglebone.h"
@@ -14,36 +18,34 @@ TypeHandle ArmatureNode::_type_handle;
 ArmatureNode::ArmatureNode(const std::string name): PandaNode(name)
         , _ik_engine(-1)
         , _is_raw_transform(false)
+        , _is_incremental(false)
+        , _is_direct_pose(false)
+        , _is_buffered(false)
+        , _is_deferred(false)
+        , _bone_format(BONE_FORMAT_MAT4)
+        , _is_half_float(false)
+        , _num_bones(0)
+        , _bone_tree_mode(BONE_TREE_DENSE)
+        , _shader_inputs_np(NodePath())
+        , _palette(NULL)
+        , _palette_offset(0)
+        , _palette_num_bones(0)
+        , _is_palette_block_owned(true)
+        , _is_bone_table_valid(false)
+        , _back_buffer(0)
+        , _front_buffer(2)
+        , _ready_buffer(1)
+        , _is_effectors_valid(0)
 #ifdef WITH_FABRIK
         , _ik_solver(NULL)
 #endif
 {
-    _bone_init_local = (LMatrix4Array*) malloc(sizeof(LMatrix4Array));
-    _bone_init_inv = (LMatrix4Array*) malloc(sizeof(LMatrix4Array));
-    _bone_transform = (LMatrix4Array*) malloc(sizeof(LMatrix4Array));
-
     _bone_init_inv_tex = new Texture();
-    _bone_init_inv_tex->setup_buffer_texture(
-        RGBA_MAT4_SIZE * MAX_BONES, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
-
     _bone_transform_tex = new Texture();
-    _bone_transform_tex->setup_buffer_texture(
-        RGBA_MAT4_SIZE * MAX_BONES, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
-
     _bone_prev_transform_tex = new Texture();
-    _bone_prev_transform_tex->setup_buffer_texture(
-        RGBA_MAT4_SIZE * MAX_BONES, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
-
     _bone_id_tree_tex = new Texture();
-    _bone_id_tree_tex->setup_buffer_texture(
-        MAX_BONES * MAX_BONES * FLOAT_SIZE, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
-
-    for (unsigned int i = 0; i < MAX_BONES; i++)
-        _frame_transform_indices[i] = -1;
+    _commands = new BoneCommandBuffer();
+    _resize_storage(0);
 }
 
 ArmatureNode::~ArmatureNode() {
@@ -51,43 +53,241 @@ ArmatureNode::~ArmatureNode() {
     if (_ik_solver != NULL)
         ik.solver.destroy(_ik_solver);
 #endif
+    clear_palette();
     _bones.clear();
-
-    free(_bone_init_local);
-    free(_bone_init_inv);
-    free(_bone_transform);
+    _bone_layout = NULL;
+    _layout_bones.clear();
+    _bindings.clear();
+    _direct_pose = NULL;
+    _frame_pose = NULL;
+    _bone_table.clear();
+    _bone_init_local.clear();
+    _bone_init_inv.clear();
+    _bone_id_tree.clear();
 }
 
 void ArmatureNode::set_raw_transform(bool is_enabled) {
     _is_raw_transform = is_enabled;
+    _invalidate_matrices();
+}
+
+/**
+ * Enable/disable incremental update of the bone matrices.
+ * In the incremental mode only bones with changed local transforms
+ * and their descendants are updated and textures are not uploaded
+ * if nothing was changed since the last update.
+ */
+void ArmatureNode::set_incremental(bool is_enabled) {
+    _is_incremental = is_enabled;
+    _invalidate_matrices();
+}
+
+bool ArmatureNode::is_incremental() {
+    return _is_incremental;
+}
+
+/**
+ * Enable/disable the direct pose mode. In the direct pose mode applied poses
+ * are not written into the bone nodes, bone matrices are built from the pose values
+ * on the next update without creating transform states.
+ * The pose is kept until another pose is applied, so every update
+ * and every node path gets the posed matrices.
+ * Bone nodes are not moved, IK, hitboxes and nodes attached to the bones
+ * see the node transforms, so the mode is meant for armatures without them.
+ * Bones written after the pose was applied keep the node transforms.
+ */
+void ArmatureNode::set_direct_pose(bool is_enabled) {
+    _is_direct_pose = is_enabled;
+    _direct_pose = NULL;
+    _invalidate_matrices();
+}
+
+bool ArmatureNode::is_direct_pose() {
+    return _is_direct_pose;
+}
+
+/**
+ * Buffered armature doesn't modify bones in apply(),
+ * the pose is handed over to sync_pose() called by the main thread,
+ * so the animation threads don't race with culling and matrix updates.
+ * IK, reset_ik() and wiggle bones are recorded like in the deferred mode,
+ * commit() applies them on top of the synced pose.
+ */
+void ArmatureNode::set_buffered(bool is_enabled) {
+    _is_buffered = is_enabled;
+}
+
+bool ArmatureNode::is_buffered() {
+    return _is_buffered;
+}
+
+/**
+ * Apply the latest pose published by apply() in the buffered mode.
+ * Returns false if there is no new pose since the last call.
+ */
+bool ArmatureNode::sync_pose() {
+    if (!(AtomicAdjust::get(_ready_buffer) & POSE_BUFFER_NEW))
+        return false;
+
+    // take the ready buffer, give back the applied one
+    _front_buffer = AtomicAdjust::set(_ready_buffer, _front_buffer) & POSE_BUFFER_INDEX;
+    PoseBuffer& buffer = _pose_buffers[_front_buffer];
+    _apply_pose(*buffer.pose, *buffer.binding, false);
+    return true;
+}
+
+/**
+ * Deferred armature records bone writes of apply(), IK and wiggle bones
+ * into the command buffer, which is applied by commit() on the main thread.
+ * IK and wiggle bones see the recorded pose.
+ */
+void ArmatureNode::set_deferred(bool is_enabled) {
+    _is_deferred = is_enabled;
+}
+
+bool ArmatureNode::is_deferred() {
+    return _is_deferred;
+}
+
+PointerTo<BoneCommandBuffer> ArmatureNode::get_commands() {
+    return _commands;
+}
+
+/**
+ * Apply the recorded bone writes, returns the number of modified bones.
+ */
+unsigned int ArmatureNode::commit() {
+    return _commands->commit();
+}
+
+/**
+ * Set the layout of the bone hierarchy texture,
+ * which is built by rebuild_bind_pose().
+ * BONE_TREE_DENSE - bone_id_tree_tex with a row of ancestor IDs
+ * from the root to the bone itself for every bone, -1 terminated.
+ * BONE_TREE_PARENTS - bone_parent_tex with a single parent ID
+ * for every bone, -1 for the root bones.
+ */
+void ArmatureNode::set_bone_tree_mode(unsigned int mode) {
+    _bone_tree_mode = mode;
+}
+
+unsigned int ArmatureNode::get_bone_tree_mode() {
+    return _bone_tree_mode;
+}
+
+/**
+ * Set the format of bone_transform_tex and bone_prev_transform_tex.
+ * BONE_FORMAT_MAT4 - 4 texels per bone, matrix rows.
+ * BONE_FORMAT_MAT3X4 - 3 texels per bone, first 3 columns of the affine matrix.
+ * BONE_FORMAT_DUAL_QUAT - 2 texels per bone, real (rotation) and
+ * dual (translation) quaternions in the IJKR order, scale is lost.
+ * Half float textures use 16-bit floats instead of 32-bit floats.
+ * In the raw transform mode first texels of the pos/quat/scale matrix are used.
+ * See samples/yuki.vert.glsl for the matching shader functions.
+ * Not allowed while the bone palette is used, palette has its own format.
+ */
+void ArmatureNode::set_bone_format(unsigned int format, bool is_half_float) {
+    nassertv(_palette == NULL);
+
+    _bone_format = format;
+    _is_half_float = is_half_float;
+    _setup_transform_textures();
+    _invalidate_matrices();
+}
+
+unsigned int ArmatureNode::get_bone_format() {
+    return _bone_format;
+}
+
+bool ArmatureNode::is_half_float() {
+    return _is_half_float;
+}
+
+/**
+ * Write bone transforms into the shared bone palette
+ * instead of the own transform textures.
+ * The armature allocates its own block, or uses the specified offset
+ * inside the block of BonePalette::allocate_instances(), which is kept
+ * by the caller and shared by the instances drawn together,
+ * the bone table should be built before.
+ */
+void ArmatureNode::set_palette(PointerTo<BonePalette> palette, int offset) {
+    clear_palette();
+    if (palette == NULL)
+        return;
+
+    _palette = palette;
+    _is_palette_block_owned = (offset < 0);
+    if (!_is_palette_block_owned) {
+        _palette_offset = offset;
+        _palette_num_bones = _num_bones;
+    }
+    _bone_format = palette->get_bone_format();
+    _is_half_float = palette->is_half_float();
+    _setup_transform_textures();
+    _invalidate_matrices();
+    _shader_inputs_np = NodePath();  // rebind textures
+}
+
+PointerTo<BonePalette> ArmatureNode::get_palette() {
+    return _palette;
+}
+
+/**
+ * Stop using the shared bone palette and return to the own transform textures.
+ */
+void ArmatureNode::clear_palette() {
+    if (_palette == NULL)
+        return;
+
+    if (_palette_num_bones && _is_palette_block_owned)
+        _palette->release(_palette_offset, _palette_num_bones);
+    _palette = NULL;
+    _palette_offset = 0;
+    _palette_num_bones = 0;
+    _is_palette_block_owned = true;
+    _setup_transform_textures();
+    _invalidate_matrices();
+    _shader_inputs_np = NodePath();  // rebind textures
+}
+
+/**
+ * Returns the first bone of the armature in the transform textures,
+ * which is non-zero when the bone palette is used.
+ */
+unsigned int ArmatureNode::get_bone_offset() {
+    return _palette_offset;
 }
 
 void ArmatureNode::cleanup() {
     NodePath armature = NodePath::any_path(this);
     armature.clear_shader_input("bone_init_inv_tex");
     armature.clear_shader_input("bone_id_tree_tex");
+    armature.clear_shader_input("bone_parent_tex");
     armature.clear_shader_input("bone_transform_tex");
     armature.clear_shader_input("bone_prev_transform_tex");
+    armature.clear_shader_input("num_bones");
+    armature.clear_shader_input("bone_offset");
+    _shader_inputs_np = NodePath();
 }
 
 void ArmatureNode::reset_ik() {
-    NodePath armature = NodePath::any_path(this);
-    NodePathCollection effectors = armature.find_all_matches("**/+EffectorNode");
+    _update_effectors();
 
     // save effectors
-    for (int i = 0; i < effectors.get_num_paths(); i++) {
-        NodePath np = effectors.get_path(i);
+    for (NodePath& np : _effectors)
         ((EffectorNode*) np.node())->sync_p2ik_local();
-    }
 
     // reset bones
-    for (int i = 0; i < effectors.get_num_paths(); i++) {
-        NodePath np = effectors.get_path(i);
+    for (const NodePath& effector : _effectors) {
+        NodePath np = effector;
         unsigned int chain_length = ((EffectorNode*) np.node())->get_chain_length();
         while (np && chain_length > 0) {
             if (is_bone(np)) {
                 unsigned int bone_id = ((BoneNode*) np.node())->get_bone_id();
-                np.set_mat(get_matrix(_bone_init_local, bone_id));
+                if (bone_id < _num_bones)
+                    set_bone_transform(np, TransformState::make_mat(_bone_init_local[bone_id]));
                 chain_length--;
             }
             np = np.get_parent();
@@ -95,9 +295,52 @@ void ArmatureNode::reset_ik() {
     }
 
     // restore effectors
-    for (int i = 0; i < effectors.get_num_paths(); i++) {
-        NodePath np = effectors.get_path(i);
+    for (NodePath& np : _effectors)
         ((EffectorNode*) np.node())->sync_ik2p_local();
+}
+
+/**
+ * Search for the effectors again before the next IK update.
+ * Effectors are tracked automatically when they are attached or removed,
+ * but not when a subtree with effectors is moved.
+ */
+void ArmatureNode::invalidate_effectors() {
+    AtomicAdjust::set(_is_effectors_valid, 0);
+}
+
+unsigned int ArmatureNode::get_num_effectors() {
+    _update_effectors();
+    return _effectors.size();
+}
+
+/**
+ * Rebuild the effector registry if it was invalidated.
+ * The flag is set before the search, so an effector attached
+ * in the meantime invalidates the registry again.
+ */
+void ArmatureNode::_update_effectors() {
+    if (AtomicAdjust::set(_is_effectors_valid, 1))
+        return;
+
+    _effectors.clear();
+    _effector_groups.clear();
+
+    NodePath armature = NodePath::any_path(this);
+    NodePathCollection nps = armature.find_all_matches("**/+EffectorNode");
+    for (int i = 0; i < nps.get_num_paths(); i++)
+        _effectors.push_back(nps.get_path(i));
+    std::stable_sort(
+        _effectors.begin(), _effectors.end(),
+        [](const NodePath& a, const NodePath& b) {
+            return ((EffectorNode*) a.node())->get_priority() <
+                ((EffectorNode*) b.node())->get_priority();
+        });
+
+    for (unsigned int i = 0; i < _effectors.size(); i++) {
+        unsigned int priority = ((EffectorNode*) _effectors[i].node())->get_priority();
+        if (_effector_groups.empty() || _effector_groups.back().priority != priority)
+            _effector_groups.push_back({priority, i, i});
+        _effector_groups.back().end = i + 1;
     }
 }
 
@@ -107,23 +350,66 @@ void ArmatureNode::rebuild_bind_pose() {
 }
 
 void ArmatureNode::rebuild_bind_pose(NodePath np) {
-    NodePath armature = NodePath::any_path(this);
-    _update_matrices(armature, LMatrix4::ident_mat(), 0);
+    rebuild_bone_table();
+    _update_matrices(0);
 
     PTA_uchar data = _bone_init_inv_tex->modify_ram_image();
-    memcpy(data.p(), _bone_init_inv->data, sizeof(_bone_init_inv->data));
+    memcpy(data.p(), _bone_init_inv.data(), _num_bones * MAT4_SIZE);
     np.set_shader_input("bone_init_inv_tex", _bone_init_inv_tex);
 
-    _update_id_tree(armature);
+    _update_id_tree();
+
+    // 4 IDs per texel, empty textures are not allowed
+    unsigned int num_ids = MAX(_bone_id_tree.size(), 1);
+    _bone_id_tree_tex->setup_buffer_texture(
+        (num_ids + RGBA_CHANNEL_COUNT - 1) / RGBA_CHANNEL_COUNT,
+        Texture::T_float, Texture::F_rgba32, GeomEnums::UH_static);
 
     data = _bone_id_tree_tex->modify_ram_image();
-    memcpy(data.p(), _bone_id_tree, sizeof(_bone_id_tree));
-    np.set_shader_input("bone_id_tree_tex", _bone_id_tree_tex);
+    memcpy(data.p(), _bone_id_tree.data(), _bone_id_tree.size() * FLOAT_SIZE);
+    if (_bone_tree_mode == BONE_TREE_PARENTS) {
+        np.clear_shader_input("bone_id_tree_tex");
+        np.set_shader_input("bone_parent_tex", _bone_id_tree_tex);
+    } else {
+        np.clear_shader_input("bone_parent_tex");
+        np.set_shader_input("bone_id_tree_tex", _bone_id_tree_tex);
+    }
+    np.set_shader_input("num_bones", (int) _num_bones);
+}
+
+/**
+ * Rebuild the flat table of bones used for the matrices update.
+ * Should be called after changing the bones hierarchy.
+ */
+void ArmatureNode::rebuild_bone_table() {
+    NodePath armature = NodePath::any_path(this);
+    _bone_table.clear();
+    _rebuild_bone_table(armature, -1);
+    _is_bone_table_valid = true;
+    _bone_layout = NULL;  // bones could be added or removed
+
+    unsigned int num_bones = 0;
+    for (BoneEntry& entry : _bone_table) {
+        if (entry.bone_id >= 0)
+            num_bones = MAX(num_bones, (unsigned int) entry.bone_id + 1);
+    }
+    // keep the bind pose if the skeleton size is the same
+    if (num_bones != _num_bones)
+        _resize_storage(num_bones);
+}
+
+/**
+ * Returns the size of the bone arrays, which is the max bone ID + 1.
+ */
+unsigned int ArmatureNode::get_num_bones() {
+    return _num_bones;
 }
 
 void ArmatureNode::rebuild_ik(unsigned int ik_engine, unsigned int max_iterations) {
     _ik_engine = ik_engine;
     _ik_max_iterations = max_iterations;
+    invalidate_effectors();
+    _update_effectors();
 
 #ifdef WITH_FABRIK
     if (_ik_engine == IK_ENGINE_IK) {
@@ -168,22 +454,12 @@ void ArmatureNode::rebuild_wiggle_bones(NodePath np) {
 }
 
 /**
- * Update IK for the all effectors.
+ * Update IK for the all effectors, one pass per used priority.
  */
 void ArmatureNode::update_ik() {
-    NodePath armature = NodePath::any_path(this);
-
-    unsigned int priority = 0, max_priority = 0;
-    NodePathCollection nps = armature.find_all_matches("**/+EffectorNode");
-    for (int i = 0; i < nps.get_num_paths(); i++) {
-        NodePath np = nps.get_path(i);
-        priority = ((EffectorNode*) np.node())->get_priority();
-        if (priority > max_priority)
-            max_priority = priority;
-    }
-
-    for (int priority = 0; priority <= max_priority; priority++)
-        update_ik(priority);
+    _update_effectors();
+    for (const EffectorGroup& group : _effector_groups)
+        update_ik(group.priority);
 }
 
 /**
@@ -205,64 +481,322 @@ void ArmatureNode::update_shader_inputs() {
 
 /**
  * Update shader inputs with world space bone matrices on specified node path.
+ * Matrices are written directly into the image of the current texture,
+ * then the textures swap their roles, so only the current one is uploaded
+ * and the previous one keeps its uploaded image. The swapped textures
+ * are bound again on the node path.
  */
 void ArmatureNode::update_shader_inputs(NodePath np) {
-    PTA_uchar data = _bone_prev_transform_tex->modify_ram_image();
-    memcpy(data.p(), _bone_transform->data, sizeof(_bone_transform->data));
-    np.set_shader_input("bone_prev_transform_tex", _bone_prev_transform_tex);
+    if (!_is_bone_table_valid)
+        rebuild_bone_table();
 
-    _update_matrices(np, LMatrix4::ident_mat(), 1);
+    if (_palette != NULL) {
+        // palette swaps its buffers and uploads them by itself
+        if (_update_matrices(1))
+            _palette->mark_modified(_palette_offset, _palette_num_bones);
+    } else {
+        // current matrices become previous
+        std::swap(_bone_transform_tex, _bone_prev_transform_tex);
+        if (!_update_matrices(1)) {
+            // nothing was written, both textures are up to date
+            std::swap(_bone_transform_tex, _bone_prev_transform_tex);
+        } else {
+            _shader_inputs_np = NodePath();  // textures swapped their roles
+        }
+    }
 
-    data = _bone_transform_tex->modify_ram_image();
-    memcpy(data.p(), _bone_transform->data, sizeof(_bone_transform->data));
-    np.set_shader_input("bone_transform_tex", _bone_transform_tex);
+    // palette textures are the same objects, so they are bound only once
+    if (_shader_inputs_np != np) {
+        if (_palette != NULL) {
+            np.set_shader_input("bone_transform_tex", _palette->get_transform_texture());
+            np.set_shader_input("bone_prev_transform_tex", _palette->get_prev_transform_texture());
+        } else {
+            np.set_shader_input("bone_transform_tex", _bone_transform_tex);
+            np.set_shader_input("bone_prev_transform_tex", _bone_prev_transform_tex);
+        }
+        np.set_shader_input("bone_offset", (int) _palette_offset);
+        _shader_inputs_np = np;
+    }
 }
 
 /**
- * Fill bone matrices array with world-space bone matrices
+ * Fill bone table with bones and rigid bodies in the parent-first order
  * by recursively walking through the node graph.
  */
-void ArmatureNode::_update_matrices(NodePath np, LMatrix4 parent_mat, bool is_current) {
-    LMatrix4 mat = parent_mat;
-
+void ArmatureNode::_rebuild_bone_table(NodePath np, int parent) {
     if (is_any_bone(np) || is_rigid_body(np)) {
-        mat = np.get_mat() * mat;  // get world-space matrix
+        BoneEntry entry;
+        entry.node = np.node();
+        entry.parent = parent;
+        if (is_any_bone(np))
+            entry.bone_id = ((BoneNode*) np.node())->get_bone_id();
+        else
+            entry.bone_id = -1;
+        entry.slot = -1;
+        entry.mat = LMatrix4::ident_mat();
+        entry.transform = NULL;
+        entry.is_dirty = true;
+        entry.is_pending = false;
+
+        parent = _bone_table.size();
+        _bone_table.push_back(entry);
     }
 
-    if (is_any_bone(np)) {
-        unsigned int bone_id = ((BoneNode*) np.node())->get_bone_id();
+    for (int i = 0; i < np.get_num_children(); i++) {
+        NodePath child_np = np.get_child(i);
+        if (is_armature(child_np))
+            continue;
+        _rebuild_bone_table(child_np, parent);
+    }
+}
+
+/**
+ * Allocate bone arrays and textures for the specified number of bones.
+ * Existing bind pose matrices are kept, new bones get identities
+ * until the next rebuild_bind_pose().
+ */
+void ArmatureNode::_resize_storage(unsigned int num_bones) {
+    _num_bones = num_bones;
+    _bone_init_local.resize(num_bones, LMatrix4::ident_mat());
+    _bone_init_inv.resize(num_bones, LMatrix4::ident_mat());
+    _bone_id_tree.clear();
+
+    // empty textures are not allowed
+    unsigned int tex_bones = MAX(num_bones, 1);
+
+    _bone_init_inv_tex->setup_buffer_texture(
+        RGBA_MAT4_SIZE * tex_bones, Texture::T_float,
+        Texture::F_rgba32, GeomEnums::UH_static);
+
+    _setup_transform_textures();
+}
+
+/**
+ * Allocate current and previous bone transform textures
+ * for the current number of bones and the bone format.
+ */
+void ArmatureNode::_setup_transform_textures() {
+    if (_palette != NULL) {
+        if (_palette_num_bones == _num_bones)
+            return;
+
+        // instance block is laid out by the caller for the final bone count
+        nassertv(_is_palette_block_owned);
+
+        if (_palette_num_bones)
+            _palette->release(_palette_offset, _palette_num_bones);
+        _palette_offset = _palette->allocate(_num_bones);
+        _palette_num_bones = _num_bones;
+        _shader_inputs_np = NodePath();  // offset was changed
+        return;
+    }
+
+    // empty textures are not allowed
+    unsigned int tex_bones = MAX(_num_bones, 1);
+    unsigned int bone_size = _get_bone_size();
+    unsigned int num_texels = tex_bones * bone_size / (RGBA_CHANNEL_COUNT * (
+        _is_half_float ? HALF_FLOAT_SIZE : FLOAT_SIZE));
+
+    Texture::ComponentType ctype = _is_half_float ? Texture::T_half_float : Texture::T_float;
+    Texture::Format format = _is_half_float ? Texture::F_rgba16 : Texture::F_rgba32;
+    _bone_transform_tex->setup_buffer_texture(
+        num_texels, ctype, format, GeomEnums::UH_static);
+    _bone_prev_transform_tex->setup_buffer_texture(
+        num_texels, ctype, format, GeomEnums::UH_static);
+
+    Texture* textures[2] = {_bone_transform_tex, _bone_prev_transform_tex};
+    for (Texture* texture : textures) {
+        PTA_uchar image = texture->modify_ram_image();
+        for (unsigned int j = 0; j < tex_bones; j++)
+            _write_bone(image.p(), j, LMatrix4::ident_mat());
+    }
+}
+
+/**
+ * Returns the size of a single bone in the transform textures in bytes.
+ */
+unsigned int ArmatureNode::_get_bone_size() {
+    return get_bone_size(_bone_format, _is_half_float);
+}
+
+/**
+ * Returns a pointer to the current or previous bone transforms
+ * in the own transform textures or in the bone palette.
+ * The current texture image is taken by modify_ram_image(), which marks
+ * it for the upload, the previous one should be only read.
+ */
+unsigned char* ArmatureNode::_get_transform_data(bool is_current) {
+    if (_palette != NULL)
+        return _palette->get_data(is_current) + _palette_offset * _get_bone_size();
+
+    if (is_current)
+        return _bone_transform_tex->modify_ram_image().p();
+    return (unsigned char*) _bone_prev_transform_tex->get_ram_image().p();
+}
+
+/**
+ * Write a bone matrix into the transform texture image using the bone format.
+ */
+void ArmatureNode::_write_bone(unsigned char* data, unsigned int bone_id, const LMatrix4& mat) {
+    float values[MAT4_WIDTH * MAT4_HEIGHT];
+    unsigned int num_values = _get_bone_size() / (_is_half_float ? HALF_FLOAT_SIZE : FLOAT_SIZE);
+
+    if (_is_raw_transform || _bone_format == BONE_FORMAT_MAT4) {  // rows
+        for (unsigned int i = 0; i < num_values; i++)
+            values[i] = mat(i / MAT4_WIDTH, i % MAT4_WIDTH);
+
+    } else if (_bone_format == BONE_FORMAT_MAT3X4) {  // columns
+        for (unsigned int i = 0; i < num_values; i++)
+            values[i] = mat(i % MAT4_HEIGHT, i / MAT4_HEIGHT);
+
+    } else if (_bone_format == BONE_FORMAT_DUAL_QUAT) {
+        LQuaternion q;
+        q.set_from_matrix(mat.get_upper_3());
+        LVecBase3 t = mat.get_row3(3);
+
+        // real part
+        values[0] = q.get_i();
+        values[1] = q.get_j();
+        values[2] = q.get_k();
+        values[3] = q.get_r();
+
+        // dual part, 0.5 * t * q
+        values[4] = 0.5 * (t[0] * q.get_r() + t[1] * q.get_k() - t[2] * q.get_j());
+        values[5] = 0.5 * (-t[0] * q.get_k() + t[1] * q.get_r() + t[2] * q.get_i());
+        values[6] = 0.5 * (t[0] * q.get_j() - t[1] * q.get_i() + t[2] * q.get_r());
+        values[7] = -0.5 * (t[0] * q.get_i() + t[1] * q.get_j() + t[2] * q.get_k());
+    }
+
+    if (_is_half_float) {
+        unsigned short* dest = (unsigned short*) data + bone_id * num_values;
+        for (unsigned int i = 0; i < num_values; i++)
+            dest[i] = float_to_half(values[i]);
+    } else {
+        memcpy((float*) data + bone_id * num_values, values, num_values * FLOAT_SIZE);
+    }
+}
+
+/**
+ * Fill bone matrices array with world-space bone matrices
+ * by walking through the bone table.
+ * In the incremental mode only changed bones and their descendants are updated,
+ * bones changed during the previous update are copied from the previous buffer.
+ * Returns true if anything was written into the current buffer.
+ */
+bool ArmatureNode::_update_matrices(bool is_current) {
+    bool is_changed = false;
+    unsigned int bone_size = _get_bone_size();
+
+    // images are taken by the first write, untouched texture isn't uploaded
+    unsigned char* cur_data = NULL;
+    unsigned char* prev_data = NULL;
+    auto begin_write = [&]() {
+        if (cur_data == NULL) {
+            cur_data = _get_transform_data(true);
+            prev_data = _get_transform_data(false);
+        }
+    };
+
+    // direct pose is used only if it matches the current bone table
+    Pose* pose = NULL;
+    if (is_current && _direct_pose != NULL && _direct_pose->get_layout() == _bone_layout)
+        pose = _direct_pose;
+
+    unsigned int num_entries = _bone_table.size();
+    for (unsigned int i = 0; i < num_entries; i++) {
+        BoneEntry& entry = _bone_table[i];
+        CPT(TransformState) transform = entry.node->get_transform();
+        unsigned short pose_flags = (pose != NULL && entry.slot >= 0) ?
+            pose->get_transform_flags(entry.slot) : 0;
+        if (pose_flags && transform != _direct_transforms[entry.slot])
+            pose_flags = 0;  // written by IK or a wiggle bone after the pose
+
+        if (is_current) {
+            // transform states are immutable, so comparing pointers is enough
+            entry.is_dirty = (
+                !_is_incremental || pose_flags || transform != entry.transform ||
+                (entry.parent >= 0 && _bone_table[entry.parent].is_dirty));
+            if (!entry.is_dirty) {
+                if (entry.is_pending && entry.bone_id >= 0) {
+                    begin_write();
+                    memcpy(
+                        cur_data + entry.bone_id * bone_size,
+                        prev_data + entry.bone_id * bone_size, bone_size);
+                    is_changed = true;
+                }
+                entry.is_pending = false;
+                continue;
+            }
+            // posed bones are recalculated until the pose is replaced
+            entry.transform = pose_flags ? NULL : transform;
+            entry.is_pending = true;
+        }
+
+        // get local transform, pose values replace the node transform
+        LVecBase3 pos;
+        LQuaternion quat;
+        LVecBase3 scale;
+        if (pose_flags || (is_current && _is_raw_transform)) {
+            pos = (pose_flags & TRANSFORM_POS) ? pose->get_pos(entry.slot) : transform->get_pos();
+            quat = (pose_flags & TRANSFORM_QUAT) ? pose->get_quat(entry.slot) : transform->get_quat();
+            scale = transform->get_scale();
+        }
+
+        LMatrix4 local;
+        if (pose_flags) {
+            LMatrix3 rot;
+            quat.extract_to_matrix(rot);
+            for (int r = 0; r < 3; r++)
+                rot.set_row(r, rot.get_row(r) * scale[r]);
+            local = LMatrix4(rot, pos);
+        } else {
+            local = transform->get_mat();
+        }
+
+        // get world-space matrix
+        if (entry.parent < 0)
+            entry.mat = local;
+        else
+            entry.mat = local * _bone_table[entry.parent].mat;
+
+        if (entry.bone_id < 0)
+            continue;
 
         if (is_current) {  // current matrices
+            begin_write();
             if (_is_raw_transform) {
-                LQuaternion quat = np.get_quat();
                 LMatrix4 pos_quat_scale = LMatrix4::ident_mat();
-                pos_quat_scale.set_row(0, np.get_pos());
+                pos_quat_scale.set_row(0, pos);
                 pos_quat_scale.set_row(1, LVector4(
                     quat.get_i(),
                     quat.get_j(),
                     quat.get_k(),
                     quat.get_r()
                 ));
-                pos_quat_scale.set_row(2, np.get_scale());
-                set_matrix(_bone_transform, bone_id, pos_quat_scale);
+                pos_quat_scale.set_row(2, scale);
+                _write_bone(cur_data, entry.bone_id, pos_quat_scale);
             } else {
                 // https://github.com/KhronosGroup/glTF-Tutorials/blob/master/gltfTutorial/gltfTutorial_020_Skins.md#the-joint-matrices
-                LMatrix4 inv_mat = get_matrix(_bone_init_inv, bone_id);
-                set_matrix(_bone_transform, bone_id, inv_mat * mat);
+                _write_bone(cur_data, entry.bone_id, _bone_init_inv[entry.bone_id] * entry.mat);
             }
         } else {  // initial matrices
-            set_matrix(_bone_init_local, bone_id, np.get_mat());
-            LMatrix4 inv_mat;
-            inv_mat.invert_from(mat);
-            set_matrix(_bone_init_inv, bone_id, inv_mat);
+            _bone_init_local[entry.bone_id] = local;
+            _bone_init_inv[entry.bone_id].invert_from(entry.mat);
         }
+
+        is_changed = true;
     }
 
-    for (int i = 0; i < np.get_num_children(); i++) {
-        NodePath child_np = np.get_child(i);
-        if (is_armature(child_np))
-            continue;
-        _update_matrices(child_np, mat, is_current);
+    return is_changed;
+}
+
+/**
+ * Force the next update to recalculate all of the bone matrices.
+ */
+void ArmatureNode::_invalidate_matrices() {
+    for (BoneEntry& entry : _bone_table) {
+        entry.transform = NULL;
+        entry.is_dirty = true;
     }
 }
 
@@ -277,8 +811,12 @@ void ArmatureNode::update_wiggle_bones(NodePath root_np, double dt) {
 void ArmatureNode::_update_wiggle_bones(NodePath root_np, NodePath np, double dt) {
     if (is_wiggle_bone(np)) {
         unsigned int bone_id = ((BoneNode*) np.node())->get_bone_id();
-        LMatrix4 mat = get_matrix(_bone_init_local, bone_id);
-        ((WiggleBoneNode*) np.node())->update(root_np, mat, dt);
+        if (bone_id < _num_bones) {
+            WiggleBoneNode* wiggle_bone = (WiggleBoneNode*) np.node();
+            LMatrix4 parent_mat = get_bone_transform(np.get_parent(), root_np)->get_mat();
+            LMatrix4 mat = wiggle_bone->simulate(parent_mat, _bone_init_local[bone_id], dt);
+            set_bone_transform(np, TransformState::make_mat(mat));
+        }
     }
 
     for (int i = 0; i < np.get_num_children(); i++) {
@@ -291,32 +829,40 @@ void ArmatureNode::_update_wiggle_bones(NodePath root_np, NodePath np, double dt
 
 /**
  * Fill bone IDs array with parent's IDs
- * by recursively walking through the node graph.
+ * by walking through the bone table.
  */
-void ArmatureNode::_update_id_tree(NodePath armature) {
-    for (int i = 0; i < MAX_BONES; i++) {
-        for (int j = 0; j < MAX_BONES; j++) {
-            _bone_id_tree[i][j] = -1;
+void ArmatureNode::_update_id_tree() {
+    if (_bone_tree_mode == BONE_TREE_PARENTS) {
+        _bone_id_tree.assign(_num_bones, -1);
+        for (BoneEntry& entry : _bone_table) {
+            if (entry.bone_id < 0 || entry.parent < 0)
+                continue;
+            _bone_id_tree[entry.bone_id] = _bone_table[entry.parent].bone_id;
         }
+        return;
     }
 
-    NodePathCollection bones = armature.find_all_matches("**/+BoneNode");
-    for (int i = 0; i < bones.get_num_paths(); i++) {
-        NodePath bone = bones.get_path(i);
-        unsigned int bone_id = ((BoneNode*) bone.node())->get_bone_id();
+    _bone_id_tree.assign(_num_bones * _num_bones, -1);
+
+    pvector<int> row;
+    for (BoneEntry& entry : _bone_table) {
+        if (entry.bone_id < 0)
+            continue;
 
         // walk from child to parent
-        unsigned int row[MAX_BONES];
-        int j = 0;
-        for (j = 0; j < MAX_BONES && is_any_bone(bone); j++) {
-            row[j] = ((BoneNode*) bone.node())->get_bone_id();
-            bone = bone.get_parent();
+        row.clear();
+        const BoneEntry* bone = &entry;
+        while (bone->bone_id >= 0) {
+            row.push_back(bone->bone_id);
+            if (bone->parent < 0)
+                break;
+            bone = &_bone_table[bone->parent];
         }
-        j--;
 
         // reverse the row from parent to child
-        for (int k = 0; j >= 0; j--, k++) {
-            _bone_id_tree[bone_id][k] = row[j];
+        float* ids = &_bone_id_tree[entry.bone_id * _num_bones];
+        for (int j = row.size() - 1, k = 0; j >= 0 && k < (int) _num_bones; j--, k++) {
+            ids[k] = row[j];
         }
     }
 }
@@ -338,13 +884,10 @@ void ArmatureNode::solve_ik(unsigned int priority) {
     if (!root_bone)
         return;
 
-    NodePathCollection nps = armature.find_all_matches("**/+EffectorNode");
-    for (int i = 0; i < nps.get_num_paths(); i++) {
-        NodePath np = nps.get_path(i);
-        if (((EffectorNode*) np.node())->get_priority() == priority)
-            ((EffectorNode*) np.node())->set_weight(1);
-        else
-            ((EffectorNode*) np.node())->set_weight(0);
+    _update_effectors();
+    for (NodePath& np : _effectors) {
+        EffectorNode* effector = (EffectorNode*) np.node();
+        effector->set_weight((effector->get_priority() == priority) ? 1 : 0);
     }
 
     switch (_ik_engine) {
@@ -358,11 +901,12 @@ void ArmatureNode::solve_ik(unsigned int priority) {
 #endif
 
     case IK_ENGINE_CCDIK:
-        for (int i = 0; i < nps.get_num_paths(); i++) {
-            NodePath np = nps.get_path(i);
-            EffectorNode* effector = (EffectorNode*) np.node();
-            if (effector->get_weight())
-                effector->inverse_kinematics_ccd(1e-2, 1, _ik_max_iterations);
+        for (const EffectorGroup& group : _effector_groups) {
+            if (group.priority != priority)
+                continue;
+            for (unsigned int i = group.start; i < group.end; i++)
+                ((EffectorNode*) _effectors[i].node())->inverse_kinematics_ccd(
+                    1e-2, 1, _ik_max_iterations);
         }
         break;
 
@@ -383,12 +927,9 @@ void ArmatureNode::sync_p2ik_recursive() {
  * Sync IK effector affected chains to Panda3D related nodes.
  */
 void ArmatureNode::sync_ik2p_chains() {
-    NodePath armature = NodePath::any_path(this);
-    NodePathCollection nps = armature.find_all_matches("**/+EffectorNode");
-    for (int i = 0; i < nps.get_num_paths(); i++) {
-        NodePath np = nps.get_path(i);
+    _update_effectors();
+    for (NodePath& np : _effectors)
         ((EffectorNode*) np.node())->sync_ik2p_chain_reverse();
-    }
 }
 
 NodePath ArmatureNode::find_bone(std::string name) {
@@ -409,32 +950,261 @@ NodePath ArmatureNode::find_bone(std::string name) {
     return _bones[name];
 }
 
+/**
+ * Returns the layout with all the bones of the armature,
+ * which is used to build poses for this armature.
+ */
+PointerTo<BoneLayout> ArmatureNode::get_bone_layout() {
+    if (_bone_layout != NULL)
+        return _bone_layout;
+
+    _bone_layout = new BoneLayout();
+    _layout_bones.clear();
+    {
+        LightMutexHolder holder(_bindings_lock);
+        _bindings.clear();
+    }
+
+    NodePath armature = NodePath::any_path(this);
+    NodePathCollection bones = armature.find_all_matches("**/+BoneNode");
+    for (int i = 0; i < bones.get_num_paths(); i++) {
+        NodePath np = bones.get_path(i);
+        unsigned int slot = _bone_layout->add_bone(np.get_name());
+        if (slot == _layout_bones.size())  // first bone with this name
+            _layout_bones.push_back(np);
+    }
+
+    for (BoneEntry& entry : _bone_table) {
+        int slot = _bone_layout->find_bone(entry.node->get_name());
+        if (slot >= 0 && _layout_bones[slot].node() != entry.node)
+            slot = -1;
+        entry.slot = slot;
+    }
+    return _bone_layout;
+}
+
+/**
+ * Returns false if the layout would be built by the next get_bone_layout().
+ */
+bool ArmatureNode::has_bone_layout() {
+    return _bone_layout != NULL;
+}
+
+/**
+ * Build the bone table, the layout and the binding of the armature poses
+ * on the calling thread, so the threaded updates only read them.
+ */
+void ArmatureNode::prepare() {
+    if (!_is_bone_table_valid)
+        rebuild_bone_table();
+    bind(get_bone_layout());
+}
+
+/**
+ * Returns the binding of the layout to the bones of this armature.
+ * Bindings are cached, clips with the same bone names share the binding.
+ */
+PointerTo<BoneBinding> ArmatureNode::bind(PointerTo<BoneLayout> layout) {
+    PointerTo<BoneLayout> armature_layout = get_bone_layout();
+    LightMutexHolder holder(_bindings_lock);
+    KDICT<BoneLayout*, BindingEntry>::iterator it = _bindings.find(layout.p());
+    if (it != _bindings.end())
+        return it->second.binding;
+
+    PointerTo<BoneBinding> binding = NULL;
+    for (it = _bindings.begin(); it != _bindings.end(); it++) {
+        if (it->second.binding->matches(layout)) {
+            binding = it->second.binding;
+            break;
+        }
+    }
+    if (binding == NULL)
+        binding = new BoneBinding(layout, armature_layout);
+    if (_bindings.size() >= MAX_BONE_BINDINGS)
+        _bindings.clear();  // mostly layouts of released clips
+
+    BindingEntry& entry = _bindings[layout.p()];
+    entry.layout = layout;
+    entry.binding = binding;
+    return binding;
+}
+
 /**
  * Set animation frame. Modifies bone transforms.
  */
 void ArmatureNode::apply(PointerTo<Frame> frame) {
-    NodePath armature = NodePath::any_path(this);
+    PointerTo<BoneLayout> layout = get_bone_layout();
+    if (_frame_pose == NULL || _frame_pose->get_layout() != layout)
+        _frame_pose = new Pose(layout);
+    _frame_pose->load_frame(frame);
+    apply(_frame_pose);
+}
 
-    unsigned int nt = frame->get_num_transforms();
-    for (unsigned int i = 0; i < nt; i++) {
-        std::string name = frame->get_bone_name(i);
-        NodePath np = find_bone(name);
-        if (np.is_empty())
-            continue;
+/**
+ * Set animation pose. Modifies bone transforms.
+ */
+void ArmatureNode::apply(PointerTo<Pose> pose) {
+    apply(pose, bind(pose->get_layout()));
+}
+
+/**
+ * Set animation pose using the binding of its layout.
+ * Modifies bone transforms, keeps the pose in the direct pose mode,
+ * or hands it over to sync_pose() in the buffered mode.
+ */
+void ArmatureNode::apply(PointerTo<Pose> pose, PointerTo<BoneBinding> binding) {
+    nassertv(binding->get_armature_layout() == get_bone_layout());
+    nassertv(binding->get_num_bones() == pose->get_num_bones());
+
+    if (_is_buffered)
+        _publish_pose(*pose, binding);
+    else
+        _apply_pose(*pose, *binding, _is_deferred);
+}
+
+/**
+ * Copy the pose into the back buffer and swap it with the ready buffer.
+ * Only one thread may publish at a time, the reader never blocks it.
+ */
+void ArmatureNode::_publish_pose(Pose& pose, PointerTo<BoneBinding> binding) {
+    PoseBuffer& buffer = _pose_buffers[_back_buffer];
+    if (buffer.pose == NULL || buffer.pose->get_layout() != pose.get_layout())
+        buffer.pose = new Pose(pose.get_layout());
+    buffer.pose->reset();
+    pose.copy_into(*buffer.pose);
+    buffer.binding = binding;
+
+    // unread pose is replaced, its buffer is reused
+    _back_buffer = AtomicAdjust::set(
+        _ready_buffer, _back_buffer | POSE_BUFFER_NEW) & POSE_BUFFER_INDEX;
+}
+
+/**
+ * Write the pose into the bone nodes, or record it into the command buffer.
+ */
+void ArmatureNode::_apply_pose(Pose& pose, BoneBinding& binding, bool is_recorded) {
+    PointerTo<BoneLayout> armature_layout = get_bone_layout();
+    if (binding.get_armature_layout() != armature_layout)
+        return;  // rebuilt since the pose was published
+
+    if (_is_direct_pose) {
+        if (_direct_pose == NULL || _direct_pose->get_layout() != armature_layout)
+            _direct_pose = new Pose(armature_layout);
+        _direct_pose->reset();
+        _direct_transforms.resize(armature_layout->get_num_bones());
+    }
 
-        ConstPointerTo<TransformState> transform = frame->get_transform(name);
-        if (transform == NULL)
+    unsigned int num_bones = pose.get_num_bones();
+    for (unsigned int slot = 0; slot < num_bones; slot++) {
+        unsigned short flags = pose.get_transform_flags(slot);
+        int armature_slot = binding.get_armature_slot(slot);
+        if (!flags || armature_slot < 0)
             continue;
 
-        unsigned short flags = frame->get_transform_flags(name);
-        if (flags & TRANSFORM_POS) {
-            np.set_pos(transform->get_pos());
-        }
-        if (flags & TRANSFORM_HPR) {
-            np.set_hpr(transform->get_hpr());
-        }
-        if (flags & TRANSFORM_QUAT) {
-            np.set_quat(transform->get_quat());
+        if (_is_direct_pose) {
+            _direct_pose->set_transform(
+                armature_slot, pose.get_pos(slot), pose.get_quat(slot),
+                flags, pose.get_transform_factor(slot));
+            _direct_transforms[armature_slot] = _layout_bones[armature_slot].node()->get_transform();
+            continue;
         }
+
+        // one state per bone instead of separate set_pos and set_quat
+        PandaNode* node = _layout_bones[armature_slot].node();
+        CPT(TransformState) transform = node->get_transform();
+        LVecBase3 pos = (flags & TRANSFORM_POS) ? pose.get_pos(slot) : transform->get_pos();
+        LQuaternion quat = (flags & TRANSFORM_QUAT) ? pose.get_quat(slot) : transform->get_quat();
+        transform = TransformState::make_pos_quat_scale(pos, quat, transform->get_scale());
+        if (is_recorded)
+            _commands->set_transform(node, armature_slot, transform);
+        else
+            node->set_transform(transform);
+    }
+}
+
+/**
+ * Bone writes are recorded in the deferred and buffered modes,
+ * only the main thread modifies the bone nodes then.
+ */
+bool ArmatureNode::_is_recording() {
+    return _is_deferred || _is_buffered;
+}
+
+/**
+ * Set the local transform of the bone, or record it.
+ */
+void ArmatureNode::_set_bone_transform(PandaNode* node, int slot, CPT(TransformState) transform) {
+    if (_is_recording())
+        _commands->set_transform(node, (slot >= 0) ? slot : INT_MAX, transform);
+    else
+        node->set_transform(transform);
+}
+
+/**
+ * Returns the local transform of the bone including the recorded writes.
+ */
+CPT(TransformState) ArmatureNode::get_bone_transform(NodePath np) {
+    if (_is_recording()) {
+        CPT(TransformState) transform = _commands->get_transform(np.node());
+        if (transform != NULL)
+            return transform;
+    }
+    return np.get_transform();
+}
+
+/**
+ * Returns the transform of the bone relative to the other node
+ * including the recorded writes, same as NodePath::get_transform(other).
+ */
+CPT(TransformState) ArmatureNode::get_bone_transform(NodePath np, NodePath other) {
+    if (!_is_recording() || !_commands->get_num_commands())
+        return np.get_transform(other);
+    return _get_bone_net_transform(other)->invert_compose(_get_bone_net_transform(np));
+}
+
+/**
+ * Set the local transform of the bone, or record it.
+ */
+void ArmatureNode::set_bone_transform(NodePath np, CPT(TransformState) transform) {
+    int slot = _is_recording() ? get_bone_layout()->find_bone(np.get_name()) : -1;
+    _set_bone_transform(np.node(), slot, transform);
+}
+
+void ArmatureNode::set_bone_pos(NodePath np, NodePath other, const LVecBase3& pos) {
+    if (_is_recording())
+        _set_bone_relative_transform(np, other, get_bone_transform(np, other)->set_pos(pos));
+    else
+        np.set_pos(other, pos);
+}
+
+void ArmatureNode::set_bone_quat(NodePath np, NodePath other, const LQuaternion& quat) {
+    if (_is_recording())
+        _set_bone_relative_transform(np, other, get_bone_transform(np, other)->set_quat(quat));
+    else
+        np.set_quat(other, quat);
+}
+
+/**
+ * Record the bone transform relative to the other node.
+ */
+void ArmatureNode::_set_bone_relative_transform(
+        NodePath np, NodePath other, CPT(TransformState) transform) {
+    CPT(TransformState) parent = _get_bone_net_transform(np.get_parent());
+    set_bone_transform(
+        np, parent->invert_compose(_get_bone_net_transform(other)->compose(transform)));
+}
+
+/**
+ * Compose the recorded local transforms up to the armature,
+ * nodes above the armature aren't recorded.
+ */
+CPT(TransformState) ArmatureNode::_get_bone_net_transform(NodePath np) {
+    CPT(TransformState) transform = TransformState::make_identity();
+    while (!np.is_empty()) {
+        if (np.node() == this)
+            return np.get_net_transform()->compose(transform);
+        transform = get_bone_transform(np)->compose(transform);
+        np = np.get_parent();
     }
+    return transform;
 }
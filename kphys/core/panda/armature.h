@@ -1,28 +1,45 @@
 #ifndef PANDA_ARMATURE_H
 #define PANDA_ARMATURE_H
 
+#include "atomicAdjust.h"
+#include "lightMutex.h"
 #include "nodePath.h"
 #include "pandaNode.h"
+#include "pvector.h"
 #include "texture.h"
+#include "transformState.h"
+#include "weakNodePath.h"
 
 #ifdef CPPPARSER  // interrogate
-union LMatrix4Array;
 #else  // normal compiler
 #ifdef WITH_FABRIK
 #include "ik/ik.h"
 #endif
 #endif
 
+#include "kphys/core/panda/bonebinding.h"
+#include "kphys/core/panda/bonecommands.h"
+#include "kphys/core/panda/bonepalette.h"
 #include "kphys/core/panda/ik.h"
 #include "kphys/core/panda/frame.h"
+#include "kphys/core/panda/pose.h"
 #include "kphys/core/panda/types.h"
 
+#define NUM_POSE_BUFFERS 3  // back, ready, front
+#define POSE_BUFFER_INDEX 0x3
+#define POSE_BUFFER_NEW 0x4  // ready buffer wasn't picked up yet
+#define MAX_BONE_BINDINGS 64  // cached bindings, dropped all at once when exceeded
+
 
 BEGIN_PUBLISH
 enum IK_ENGINE {
     IK_ENGINE_IK = 0,     // https://github.com/TheComet/ik
     IK_ENGINE_CCDIK = 1,  // https://github.com/Germanunkol/CCD-IK-Panda3D
 };
+enum BONE_TREE_MODE {
+    BONE_TREE_DENSE = 0,  // bone_id_tree_tex, num_bones x num_bones ancestor IDs
+    BONE_TREE_PARENTS = 1,  // bone_parent_tex, parent ID per bone
+};
 END_PUBLISH
 
 class EXPORT_CLASS ArmatureNode: public PandaNode {
@@ -30,10 +47,34 @@ PUBLISHED:
     ArmatureNode(const std::string name="armature");
     ~ArmatureNode();
     void set_raw_transform(bool is_enabled);
+    void set_incremental(bool is_enabled);
+    bool is_incremental();
+    void set_direct_pose(bool is_enabled);
+    bool is_direct_pose();
+    void set_buffered(bool is_enabled);
+    bool is_buffered();
+    bool sync_pose();
+    void set_deferred(bool is_enabled);
+    bool is_deferred();
+    PointerTo<BoneCommandBuffer> get_commands();
+    unsigned int commit();
+    void set_bone_tree_mode(unsigned int mode);
+    unsigned int get_bone_tree_mode();
+    void set_bone_format(unsigned int format, bool is_half_float=false);
+    unsigned int get_bone_format();
+    bool is_half_float();
+    void set_palette(PointerTo<BonePalette> palette, int offset=-1);
+    PointerTo<BonePalette> get_palette();
+    void clear_palette();
+    unsigned int get_bone_offset();
     void cleanup();
     void reset_ik();
+    void invalidate_effectors();
+    unsigned int get_num_effectors();
     void rebuild_bind_pose();
     void rebuild_bind_pose(NodePath np);
+    void rebuild_bone_table();
+    unsigned int get_num_bones();
     void rebuild_wiggle_bones();
     void rebuild_wiggle_bones(NodePath np);
     void rebuild_ik(unsigned int ik_engine=IK_ENGINE_IK, unsigned int max_iterations=10);
@@ -43,35 +84,113 @@ PUBLISHED:
     void update_shader_inputs(NodePath np);
     void update_wiggle_bones(NodePath root_np, double dt);
     NodePath find_bone(std::string name);
+    PointerTo<BoneLayout> get_bone_layout();
+    bool has_bone_layout();
+    PointerTo<BoneBinding> bind(PointerTo<BoneLayout> layout);
+    void prepare();
     void apply(PointerTo<Frame> frame);
+    void apply(PointerTo<Pose> pose);
+    void apply(PointerTo<Pose> pose, PointerTo<BoneBinding> binding);
 
 private:
+    struct BoneEntry {
+        PointerTo<PandaNode> node;
+        int parent;  // index of the parent entry, -1 for the root entries
+        int bone_id;  // -1 for the non-bone entries (rigid bodies)
+        int slot;  // slot in the bone layout, -1 if not in the layout
+        LMatrix4 mat;  // world-space matrix
+        CPT(TransformState) transform;  // local transform used for the last update
+        bool is_dirty;  // updated during the last update
+        bool is_pending;  // not yet written into the other transform buffer
+    };
+    struct EffectorGroup {
+        unsigned int priority;
+        unsigned int start;  // first effector of the group
+        unsigned int end;
+    };
+    struct BindingEntry {
+        PointerTo<BoneLayout> layout;  // keeps the key alive
+        PointerTo<BoneBinding> binding;
+    };
+    struct PoseBuffer {
+        PointerTo<Pose> pose;
+        PointerTo<BoneBinding> binding;
+    };
+
     unsigned int _ik_engine;
     unsigned int _ik_max_iterations;
     bool _is_raw_transform;
-    LMatrix4Array* _bone_init_local;  // initial local-space matrices
-    LMatrix4Array* _bone_init_inv;  // initial world-space inverted (inverse bind) matrices
-    LMatrix4Array* _bone_transform;  // current world-space matrices
-    float _bone_id_tree[MAX_BONES][MAX_BONES];
+    bool _is_incremental;
+    bool _is_direct_pose;
+    bool _is_buffered;
+    bool _is_deferred;
+    unsigned int _bone_format;
+    bool _is_half_float;
+    unsigned int _num_bones;  // max bone ID + 1
+    pvector<LMatrix4> _bone_init_local;  // initial local-space matrices
+    pvector<LMatrix4> _bone_init_inv;  // initial world-space inverted (inverse bind) matrices
+    unsigned int _bone_tree_mode;
+    pvector<float> _bone_id_tree;  // parent IDs, layout depends on the bone tree mode
     KDICT<std::string, NodePath> _bones;
+    PointerTo<BoneLayout> _bone_layout;  // bone names of the armature
+    pvector<NodePath> _layout_bones;  // bone node paths indexed by the layout slot
+    KDICT<BoneLayout*, BindingEntry> _bindings;  // keyed by the bound layout
+    LightMutex _bindings_lock;
+    PointerTo<Pose> _direct_pose;  // last applied pose in the direct pose mode
+    pvector<CPT(TransformState)> _direct_transforms;  // bone node transforms when the direct pose was applied
+    PointerTo<Pose> _frame_pose;  // applied frames are converted into this pose
+    PoseBuffer _pose_buffers[NUM_POSE_BUFFERS];
+    unsigned int _back_buffer;  // filled by the animation thread
+    unsigned int _front_buffer;  // applied by the main thread
+    AtomicAdjust::Integer _ready_buffer;  // index of the handed over buffer | POSE_BUFFER_NEW
+    PointerTo<BoneCommandBuffer> _commands;  // bone writes of the deferred and buffered modes
+    pvector<NodePath> _effectors;  // sorted by priority
+    pvector<EffectorGroup> _effector_groups;  // ascending priorities
+    AtomicAdjust::Integer _is_effectors_valid;  // cleared by the effectors attached or removed
     PointerTo<Texture> _bone_init_inv_tex;
     PointerTo<Texture> _bone_id_tree_tex;
-    PointerTo<Texture> _bone_transform_tex;
+    PointerTo<Texture> _bone_transform_tex;  // swaps the role with the previous texture every update
     PointerTo<Texture> _bone_prev_transform_tex;
-    int _frame_transform_indices[MAX_BONES];
+    WeakNodePath _shader_inputs_np;  // node path with bound transform textures
+    PointerTo<BonePalette> _palette;  // shared transform textures
+    unsigned int _palette_offset;  // first bone of the allocated palette block
+    unsigned int _palette_num_bones;  // size of the allocated palette block
+    bool _is_palette_block_owned;  // false if the block was allocated for many instances
+    pvector<BoneEntry> _bone_table;  // bones and rigid bodies, parents go first
+    bool _is_bone_table_valid;
 #ifdef WITH_FABRIK
     struct ik_solver_t* _ik_solver;  // [IK] solver engine
 #endif
     static TypeHandle _type_handle;
 
-    void _update_matrices(NodePath np, LMatrix4 parent_mat, bool is_current=true);
-    void _update_id_tree(NodePath np);
+    void _rebuild_bone_table(NodePath np, int parent);
+    void _resize_storage(unsigned int num_bones);
+    void _setup_transform_textures();
+    unsigned int _get_bone_size();
+    unsigned char* _get_transform_data(bool is_current);
+    void _write_bone(unsigned char* data, unsigned int bone_id, const LMatrix4& mat);
+    bool _update_matrices(bool is_current=true);
+    void _invalidate_matrices();
+    void _update_id_tree();
     void _update_wiggle_bones(NodePath root_np, NodePath np, double dt);
+    bool _is_recording();
+    void _set_bone_transform(PandaNode* node, int slot, CPT(TransformState) transform);
+    void _set_bone_relative_transform(
+        NodePath np, NodePath other, CPT(TransformState) transform);
+    CPT(TransformState) _get_bone_net_transform(NodePath np);
+    void _update_effectors();
+    void _publish_pose(Pose& pose, PointerTo<BoneBinding> binding);
+    void _apply_pose(Pose& pose, BoneBinding& binding, bool is_recorded);
 
 public:
     void solve_ik(unsigned int priority);
     void sync_p2ik_recursive();
     void sync_ik2p_chains();
+    CPT(TransformState) get_bone_transform(NodePath np);
+    CPT(TransformState) get_bone_transform(NodePath np, NodePath other);
+    void set_bone_transform(NodePath np, CPT(TransformState) transform);
+    void set_bone_pos(NodePath np, NodePath other, const LVecBase3& pos);
+    void set_bone_quat(NodePath np, NodePath other, const LQuaternion& quat);
 
     static TypeHandle get_class_type() {
         return _type_handle;
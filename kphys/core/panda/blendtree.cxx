@@ -0,0 +1,394 @@
+#include <math.h>
+
+#include "kphys/core/panda/blendtree.h"
+
+
+TypeHandle BlendNode::_type_handle;
+TypeHandle ClipBlendNode::_type_handle;
+TypeHandle CrossfadeBlendNode::_type_handle;
+TypeHandle LayerBlendNode::_type_handle;
+TypeHandle BlendTree::_type_handle;
+
+/**
+   Node of the blend tree, evaluates its pose into the output pose.
+*/
+BlendNode::BlendNode(const std::string name): Namable(name) {}
+
+BlendNode::~BlendNode() {}
+
+void BlendNode::update(double dt) {}
+
+/**
+   Prepare the node for poses of the layout, called before the evaluation
+   whenever the layout changes.
+*/
+void BlendNode::setup(PointerTo<BoneLayout> layout) {}
+
+
+/**
+   Leaf node, which plays an animation.
+*/
+ClipBlendNode::ClipBlendNode(const std::string name, PointerTo<Animation> animation): BlendNode(name)
+        , _animation(animation)
+        , _frame_index(0.0)
+        , _speed(1.0) {}
+
+ClipBlendNode::~ClipBlendNode() {
+    _animation = NULL;
+    _binding = NULL;
+}
+
+PointerTo<Animation> ClipBlendNode::get_animation() {
+    return _animation;
+}
+
+void ClipBlendNode::set_animation(PointerTo<Animation> animation) {
+    _animation = animation;
+    _frame_index = 0.0;
+}
+
+double ClipBlendNode::get_frame_index() {
+    return _frame_index;
+}
+
+void ClipBlendNode::set_frame_index(double index) {
+    _frame_index = index;
+}
+
+double ClipBlendNode::get_speed() {
+    return _speed;
+}
+
+void ClipBlendNode::set_speed(double speed) {
+    _speed = speed;
+}
+
+/**
+   Increment frame index, same as Channel::update.
+*/
+void ClipBlendNode::update(double dt) {
+    if (_animation == NULL || _animation->is_manual())
+        return;
+
+    unsigned long num_frames = _animation->get_num_frames();
+    if (num_frames == 0)
+        return;
+
+    double index = _frame_index + dt * _speed / _animation->get_frame_time();
+    if (_animation->is_loop()) {  // loop, negative speed plays backwards
+        while (index >= num_frames)
+            index -= num_frames;
+        while (index < 0)
+            index += num_frames;
+    } else {  // clamp
+        index = fmin(index, num_frames - 1);
+    }
+    _frame_index = MAX(index, 0.0);
+}
+
+/**
+   Bind the clip to the layout ahead of the evaluation.
+*/
+void ClipBlendNode::setup(PointerTo<BoneLayout> layout) {
+    if (_animation != NULL)
+        _bind(layout);
+}
+
+bool ClipBlendNode::evaluate(Pose& pose, BlendTree& tree) {
+    if (_animation == NULL || _animation->get_num_frames() == 0)
+        return false;
+
+    _bind(pose.get_layout());
+    unsigned long i = (unsigned long) floor(_frame_index);
+    unsigned long j = (unsigned long) ceil(_frame_index);
+    _animation->save_pose(pose, *_binding, i, j, fmod(_frame_index, 1));
+    return true;
+}
+
+/**
+   Resolve the clip bones, only when the animation or the layout change.
+*/
+void ClipBlendNode::_bind(PointerTo<BoneLayout> layout) {
+    PointerTo<BoneLayout> clip_layout = _animation->get_bone_layout();
+    if (_binding == NULL || _binding->get_layout() != clip_layout ||
+            _binding->get_armature_layout() != layout)
+        _binding = new BoneBinding(clip_layout, layout);
+}
+
+
+/**
+   Crossfade of any number of inputs, weights are normalized.
+*/
+CrossfadeBlendNode::CrossfadeBlendNode(const std::string name): BlendNode(name) {}
+
+CrossfadeBlendNode::~CrossfadeBlendNode() {
+    _inputs.clear();
+    _weights.clear();
+}
+
+/**
+   Returns the index of the new input.
+*/
+unsigned int CrossfadeBlendNode::add_input(PointerTo<BlendNode> node, double weight) {
+    _inputs.push_back(node);
+    _weights.push_back(weight);
+    return _inputs.size() - 1;
+}
+
+unsigned int CrossfadeBlendNode::get_num_inputs() {
+    return _inputs.size();
+}
+
+PointerTo<BlendNode> CrossfadeBlendNode::get_input(unsigned int i) {
+    nassertr(i < _inputs.size(), NULL);
+    return _inputs[i];
+}
+
+double CrossfadeBlendNode::get_weight(unsigned int i) {
+    nassertr(i < _weights.size(), 0.0);
+    return _weights[i];
+}
+
+void CrossfadeBlendNode::set_weight(unsigned int i, double weight) {
+    nassertv(i < _weights.size());
+    _weights[i] = weight;
+}
+
+void CrossfadeBlendNode::update(double dt) {
+    for (PointerTo<BlendNode>& input : _inputs)
+        input->update(dt);
+}
+
+void CrossfadeBlendNode::setup(PointerTo<BoneLayout> layout) {
+    for (PointerTo<BlendNode>& input : _inputs)
+        input->setup(layout);
+}
+
+/**
+   The first input is evaluated into the output pose,
+   the others are blended in with the running normalized weights.
+*/
+bool CrossfadeBlendNode::evaluate(Pose& pose, BlendTree& tree) {
+    double total_weight = 0.0;
+    unsigned int num_inputs = _inputs.size();
+    for (unsigned int i = 0; i < num_inputs; i++) {
+        double weight = _weights[i];
+        if (weight <= 0.0)
+            continue;
+
+        if (total_weight == 0.0) {
+            if (_inputs[i]->evaluate(pose, tree))
+                total_weight = weight;
+            continue;
+        }
+
+        Pose& input_pose = tree.push_pose();
+        if (_inputs[i]->evaluate(input_pose, tree)) {
+            total_weight += weight;
+            pose.blend(input_pose, weight / total_weight, BLEND_NLERP, NULL);
+        }
+        tree.pop_pose();
+    }
+    return total_weight > 0.0;
+}
+
+
+/**
+   Layers are applied from the first one to the last one,
+   override layers replace and additive layers add to the layers below.
+   There is no pose below the first layer, bones missing in the output
+   are copied from an override layer at full weight, whatever its weight
+   or bone weights are. Put a full layer with the base pose first
+   to fade in the layers above it.
+*/
+LayerBlendNode::LayerBlendNode(const std::string name): BlendNode(name) {}
+
+LayerBlendNode::~LayerBlendNode() {
+    _layers.clear();
+}
+
+/**
+   Returns the index of the new layer.
+*/
+unsigned int LayerBlendNode::add_layer(
+        PointerTo<BlendNode> node, unsigned int mode, double weight) {
+    Layer layer;
+    layer.node = node;
+    layer.mode = mode;
+    layer.weight = weight;
+    layer.mask = new BoneMask();
+    layer.reference = NULL;
+    _layers.push_back(layer);
+    return _layers.size() - 1;
+}
+
+unsigned int LayerBlendNode::get_num_layers() {
+    return _layers.size();
+}
+
+PointerTo<BlendNode> LayerBlendNode::get_layer(unsigned int i) {
+    nassertr(i < _layers.size(), NULL);
+    return _layers[i].node;
+}
+
+unsigned int LayerBlendNode::get_layer_mode(unsigned int i) {
+    nassertr(i < _layers.size(), LAYER_OVERRIDE);
+    return _layers[i].mode;
+}
+
+double LayerBlendNode::get_layer_weight(unsigned int i) {
+    nassertr(i < _layers.size(), 0.0);
+    return _layers[i].weight;
+}
+
+void LayerBlendNode::set_layer_weight(unsigned int i, double weight) {
+    nassertv(i < _layers.size());
+    _layers[i].weight = weight;
+}
+
+/**
+   Returns the bones affected by the layer, all bones by default.
+*/
+PointerTo<BoneMask> LayerBlendNode::get_layer_mask(unsigned int i) {
+    nassertr(i < _layers.size(), NULL);
+    return _layers[i].mask;
+}
+
+/**
+   Set the reference pose of the additive layer,
+   without the reference pose the layer pose is the difference itself.
+*/
+void LayerBlendNode::set_layer_reference(unsigned int i, PointerTo<BlendNode> reference) {
+    nassertv(i < _layers.size());
+    _layers[i].reference = reference;
+}
+
+void LayerBlendNode::update(double dt) {
+    for (Layer& layer : _layers) {
+        layer.node->update(dt);
+        if (layer.reference != NULL)
+            layer.reference->update(dt);
+    }
+}
+
+/**
+   Masks are compiled here, so the evaluation only reads them.
+*/
+void LayerBlendNode::setup(PointerTo<BoneLayout> layout) {
+    for (Layer& layer : _layers) {
+        layer.node->setup(layout);
+        if (layer.reference != NULL)
+            layer.reference->setup(layout);
+        layer.mask->get_compiled(layout, layer.compiled_mask);
+    }
+}
+
+bool LayerBlendNode::evaluate(Pose& pose, BlendTree& tree) {
+    bool has_pose = false;
+    PointerTo<BoneLayout> layout = pose.get_layout();
+    for (Layer& layer : _layers) {
+        if (layer.weight <= 0.0)
+            continue;
+
+        CompiledBoneMask* compiled = layer.mask->get_compiled(layout, layer.compiled_mask);
+        const uint32_t* mask = compiled->get_bits();
+        const float* weights = compiled->get_weights();
+        if (!has_pose && layer.mode == LAYER_OVERRIDE && layer.weight >= 1.0 &&
+                mask == NULL && weights == NULL) {
+            // the first full layer is evaluated straight into the output pose
+            has_pose = layer.node->evaluate(pose, tree);
+            continue;
+        }
+
+        Pose& layer_pose = tree.push_pose();
+        if (layer.node->evaluate(layer_pose, tree)) {
+            if (layer.mode == LAYER_ADDITIVE) {
+                Pose* reference = NULL;
+                if (layer.reference != NULL) {
+                    reference = &tree.push_pose();
+                    if (!layer.reference->evaluate(*reference, tree))
+                        reference->reset();
+                }
+                pose.add_difference(layer_pose, reference, layer.weight, mask, weights);
+                if (reference != NULL)
+                    tree.pop_pose();
+            } else {
+                pose.blend(layer_pose, layer.weight, BLEND_NLERP, mask, weights);
+            }
+            has_pose = true;
+        }
+        tree.pop_pose();
+    }
+    return has_pose;
+}
+
+
+/**
+   Tree of blend nodes evaluated into a single pose,
+   nested nodes reuse temporary poses of the tree.
+*/
+BlendTree::BlendTree(const std::string name): Namable(name)
+        , _root(NULL)
+        , _layout(NULL)
+        , _num_used_poses(0) {}
+
+BlendTree::~BlendTree() {
+    _root = NULL;
+    _layout = NULL;
+    _poses.clear();
+}
+
+PointerTo<BlendNode> BlendTree::get_root() {
+    return _root;
+}
+
+void BlendTree::set_root(PointerTo<BlendNode> root) {
+    _root = root;
+    _layout = NULL;  // set up again by the next evaluation
+}
+
+void BlendTree::update(double dt) {
+    if (_root != NULL)
+        _root->update(dt);
+}
+
+/**
+   Set up the nodes for poses of the layout.
+*/
+void BlendTree::setup(PointerTo<BoneLayout> layout) {
+    _layout = layout;
+    _poses.clear();
+    if (_root != NULL)
+        _root->setup(layout);
+}
+
+/**
+   Evaluate the tree into the pose. Returns false if nothing was evaluated.
+*/
+bool BlendTree::evaluate(PointerTo<Pose> pose) {
+    pose->reset();
+    if (_root == NULL)
+        return false;
+
+    if (_layout != pose->get_layout())
+        setup(pose->get_layout());
+    _num_used_poses = 0;
+    return _root->evaluate(*pose, *this);
+}
+
+/**
+   Returns an empty temporary pose, which is used until pop_pose() is called.
+*/
+Pose& BlendTree::push_pose() {
+    if (_num_used_poses == _poses.size())
+        _poses.push_back(new Pose(_layout));
+
+    Pose& pose = *_poses[_num_used_poses++];
+    pose.reset();
+    return pose;
+}
+
+void BlendTree::pop_pose() {
+    nassertv(_num_used_poses > 0);
+    _num_used_poses--;
+}
@@ -0,0 +1,227 @@
+#ifndef PANDA_BLEND_TREE_H
+#define PANDA_BLEND_TREE_H
+
+#include "namable.h"
+#include "pvector.h"
+#include "typedReferenceCount.h"
+
+#include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/bonebinding.h"
+#include "kphys/core/panda/bonemask.h"
+#include "kphys/core/panda/pose.h"
+
+
+BEGIN_PUBLISH
+enum LAYER_MODE {
+    LAYER_OVERRIDE = 0,  // blend the layer over the layers below
+    LAYER_ADDITIVE = 1,  // add the difference from the reference pose
+};
+END_PUBLISH
+
+class BlendTree;
+
+
+class EXPORT_CLASS BlendNode: public TypedReferenceCount, public Namable {
+PUBLISHED:
+    BlendNode(const std::string name);
+    virtual ~BlendNode();
+    virtual void update(double dt);
+
+public:
+    virtual void setup(PointerTo<BoneLayout> layout);
+    virtual bool evaluate(Pose& pose, BlendTree& tree) = 0;
+
+private:
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BlendNode", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+
+class EXPORT_CLASS ClipBlendNode: public BlendNode {
+PUBLISHED:
+    ClipBlendNode(const std::string name, PointerTo<Animation> animation=NULL);
+    ~ClipBlendNode();
+    PointerTo<Animation> get_animation();
+    void set_animation(PointerTo<Animation> animation);
+    double get_frame_index();
+    void set_frame_index(double index);
+    double get_speed();
+    void set_speed(double speed);
+    virtual void update(double dt);
+
+public:
+    virtual void setup(PointerTo<BoneLayout> layout);
+    virtual bool evaluate(Pose& pose, BlendTree& tree);
+
+private:
+    PointerTo<Animation> _animation;
+    PointerTo<BoneBinding> _binding;  // clip layout -> pose layout
+    double _frame_index;
+    double _speed;
+
+    void _bind(PointerTo<BoneLayout> layout);
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        BlendNode::init_type();
+        register_type(_type_handle, "ClipBlendNode", BlendNode::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+
+class EXPORT_CLASS CrossfadeBlendNode: public BlendNode {
+PUBLISHED:
+    CrossfadeBlendNode(const std::string name);
+    ~CrossfadeBlendNode();
+    unsigned int add_input(PointerTo<BlendNode> node, double weight=0.0);
+    unsigned int get_num_inputs();
+    PointerTo<BlendNode> get_input(unsigned int i);
+    double get_weight(unsigned int i);
+    void set_weight(unsigned int i, double weight);
+    virtual void update(double dt);
+
+public:
+    virtual void setup(PointerTo<BoneLayout> layout);
+    virtual bool evaluate(Pose& pose, BlendTree& tree);
+
+private:
+    pvector<PointerTo<BlendNode>> _inputs;
+    pvector<double> _weights;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        BlendNode::init_type();
+        register_type(_type_handle, "CrossfadeBlendNode", BlendNode::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+
+class EXPORT_CLASS LayerBlendNode: public BlendNode {
+PUBLISHED:
+    LayerBlendNode(const std::string name);
+    ~LayerBlendNode();
+    unsigned int add_layer(
+        PointerTo<BlendNode> node, unsigned int mode=LAYER_OVERRIDE, double weight=1.0);
+    unsigned int get_num_layers();
+    PointerTo<BlendNode> get_layer(unsigned int i);
+    unsigned int get_layer_mode(unsigned int i);
+    double get_layer_weight(unsigned int i);
+    void set_layer_weight(unsigned int i, double weight);
+    PointerTo<BoneMask> get_layer_mask(unsigned int i);
+    void set_layer_reference(unsigned int i, PointerTo<BlendNode> reference);
+    virtual void update(double dt);
+
+public:
+    virtual void setup(PointerTo<BoneLayout> layout);
+    virtual bool evaluate(Pose& pose, BlendTree& tree);
+
+private:
+    struct Layer {
+        PointerTo<BlendNode> node;
+        unsigned int mode;  // LAYER_MODE
+        double weight;
+        PointerTo<BoneMask> mask;
+        PointerTo<CompiledBoneMask> compiled_mask;  // for the last pose layout
+        PointerTo<BlendNode> reference;  // reference pose of the additive layer
+    };
+
+    pvector<Layer> _layers;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        BlendNode::init_type();
+        register_type(_type_handle, "LayerBlendNode", BlendNode::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+
+class EXPORT_CLASS BlendTree: public TypedReferenceCount, public Namable {
+PUBLISHED:
+    BlendTree(const std::string name);
+    ~BlendTree();
+    PointerTo<BlendNode> get_root();
+    void set_root(PointerTo<BlendNode> root);
+    void update(double dt);
+    void setup(PointerTo<BoneLayout> layout);
+    bool evaluate(PointerTo<Pose> pose);
+
+private:
+    PointerTo<BlendNode> _root;
+    PointerTo<BoneLayout> _layout;
+    pvector<PointerTo<Pose>> _poses;  // temporary poses of the nested nodes
+    unsigned int _num_used_poses;
+
+    static TypeHandle _type_handle;
+
+public:
+    Pose& push_pose();
+    void pop_pose();
+
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BlendTree", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
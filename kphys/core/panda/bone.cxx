@@ -127,8 +127,10 @@ void BoneNode::sync_p2ik_recursive() {
 
 #ifdef WITH_FABRIK
     if (_ik_node != NULL) {
-        _ik_node->position = LVecBase3_to_IKVec3(bone.get_pos());
-        _ik_node->rotation = LQuaternion_to_IKQuat(bone.get_quat());
+        ArmatureNode* armature_node = (ArmatureNode*) get_armature(bone).node();
+        CPT(TransformState) transform = armature_node->get_bone_transform(bone);
+        _ik_node->position = LVecBase3_to_IKVec3(transform->get_pos());
+        _ik_node->rotation = LQuaternion_to_IKQuat(transform->get_quat());
     }
 #endif
 
@@ -141,7 +143,10 @@ void BoneNode::sync_ik2p_local() {
 #ifdef WITH_FABRIK
     if (_ik_node != NULL) {
         // bone.set_pos(IKVec3_to_LVecBase3(_ik_node->position));
-        bone.set_quat(IKQuat_to_LQuaternion(_ik_node->rotation));
+        ArmatureNode* armature_node = (ArmatureNode*) get_armature(bone).node();
+        CPT(TransformState) transform = armature_node->get_bone_transform(bone);
+        armature_node->set_bone_transform(
+            bone, transform->set_quat(IKQuat_to_LQuaternion(_ik_node->rotation)));
     }
 #endif
 }
@@ -0,0 +1,69 @@
+#include "kphys/core/panda/bonebinding.h"
+
+
+TypeHandle BoneBinding::_type_handle;
+
+/**
+ * Slots of the layout resolved into the slots of the armature layout once,
+ * so poses of clips with another bone order are applied with an indexed loop.
+ */
+BoneBinding::BoneBinding(
+        PointerTo<BoneLayout> layout, PointerTo<BoneLayout> armature_layout)
+        : _layout(layout)
+        , _armature_layout(armature_layout)
+        , _num_bound_bones(0) {
+    unsigned int num_bones = layout->get_num_bones();
+    _armature_slots.resize(num_bones);
+    for (unsigned int slot = 0; slot < num_bones; slot++) {
+        _armature_slots[slot] = armature_layout->find_bone(layout->get_bone_name(slot));
+        if (_armature_slots[slot] >= 0)
+            _num_bound_bones++;
+    }
+}
+
+BoneBinding::~BoneBinding() {
+    _layout = NULL;
+    _armature_layout = NULL;
+    _armature_slots.clear();
+}
+
+PointerTo<BoneLayout> BoneBinding::get_layout() {
+    return _layout;
+}
+
+PointerTo<BoneLayout> BoneBinding::get_armature_layout() {
+    return _armature_layout;
+}
+
+unsigned int BoneBinding::get_num_bones() {
+    return _armature_slots.size();
+}
+
+/**
+ * Returns the number of bones found in the armature.
+ */
+unsigned int BoneBinding::get_num_bound_bones() {
+    return _num_bound_bones;
+}
+
+int BoneBinding::get_armature_slot(unsigned int slot) {
+    return _armature_slots[slot];
+}
+
+/**
+ * Check if the binding can be used for the layout,
+ * layouts of clips with the same skeleton have the same bone names.
+ */
+bool BoneBinding::matches(PointerTo<BoneLayout> layout) {
+    if (layout == _layout)
+        return true;
+
+    unsigned int num_bones = layout->get_num_bones();
+    if (num_bones != _layout->get_num_bones())
+        return false;
+    for (unsigned int slot = 0; slot < num_bones; slot++) {
+        if (layout->get_bone_name(slot) != _layout->get_bone_name(slot))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef PANDA_BONE_BINDING_H
+#define PANDA_BONE_BINDING_H
+
+#include "pvector.h"
+#include "typedReferenceCount.h"
+
+#include "kphys/core/panda/pose.h"
+
+
+class EXPORT_CLASS BoneBinding: public TypedReferenceCount {
+PUBLISHED:
+    BoneBinding(PointerTo<BoneLayout> layout, PointerTo<BoneLayout> armature_layout);
+    ~BoneBinding();
+    PointerTo<BoneLayout> get_layout();
+    PointerTo<BoneLayout> get_armature_layout();
+    unsigned int get_num_bones();
+    unsigned int get_num_bound_bones();
+    int get_armature_slot(unsigned int slot);
+    bool matches(PointerTo<BoneLayout> layout);
+
+private:
+    PointerTo<BoneLayout> _layout;
+    PointerTo<BoneLayout> _armature_layout;
+    pvector<int> _armature_slots;  // layout slot -> armature layout slot, -1 if missing
+    unsigned int _num_bound_bones;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BoneBinding", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include <algorithm>
+
+#include "kphys/core/panda/bonecommands.h"
+
+
+TypeHandle BoneCommandBuffer::_type_handle;
+
+/**
+ * Bone writes recorded by an animation thread and applied by the main thread.
+ * Commands are appended by one thread at a time without locking,
+ * the frame barrier separates them from commit().
+ */
+BoneCommandBuffer::BoneCommandBuffer() {}
+
+BoneCommandBuffer::~BoneCommandBuffer() {
+    _commands.clear();
+    _latest.clear();
+}
+
+unsigned int BoneCommandBuffer::get_num_commands() {
+    return _commands.size();
+}
+
+/**
+ * Record the local transform of the node.
+ * Later writes of a node keep the order of its first write.
+ */
+void BoneCommandBuffer::set_transform(
+        PandaNode* node, int order, CPT(TransformState) transform) {
+    BoneCommand command;
+    command.node = node;
+    command.order = order;
+    command.sequence = _commands.size();
+    command.transform = transform;
+
+    KDICT<PandaNode*, unsigned int>::iterator it = _latest.find(node);
+    if (it != _latest.end()) {
+        command.order = _commands[it->second].order;
+        it->second = command.sequence;
+    } else {
+        _latest[node] = command.sequence;
+    }
+    _commands.push_back(command);
+}
+
+/**
+ * Returns the last recorded transform of the node, NULL if there is none.
+ */
+CPT(TransformState) BoneCommandBuffer::get_transform(PandaNode* node) {
+    KDICT<PandaNode*, unsigned int>::iterator it = _latest.find(node);
+    if (it == _latest.end())
+        return NULL;
+    return _commands[it->second].transform;
+}
+
+/**
+ * Apply the commands sorted by the bone order, only the last write of every node.
+ * Returns the number of modified nodes.
+ */
+unsigned int BoneCommandBuffer::commit() {
+    std::sort(
+        _commands.begin(), _commands.end(),
+        [](const BoneCommand& a, const BoneCommand& b) {
+            if (a.order != b.order)
+                return a.order < b.order;
+            if (a.node != b.node)
+                return a.node < b.node;
+            return a.sequence < b.sequence;
+        });
+
+    unsigned int num_nodes = 0;
+    unsigned int num_commands = _commands.size();
+    for (unsigned int i = 0; i < num_commands; i++) {
+        if (i + 1 < num_commands && _commands[i + 1].node == _commands[i].node)
+            continue;  // overwritten later
+        _commands[i].node->set_transform(_commands[i].transform);
+        num_nodes++;
+    }
+    _commands.clear();
+    _latest.clear();
+    return num_nodes;
+}
+
+void BoneCommandBuffer::clear() {
+    _commands.clear();
+    _latest.clear();
+}
@@ -0,0 +1,54 @@
+#ifndef PANDA_BONE_COMMANDS_H
+#define PANDA_BONE_COMMANDS_H
+
+#include "pandaNode.h"
+#include "pvector.h"
+#include "transformState.h"
+#include "typedReferenceCount.h"
+
+#include "kphys/core/panda/types.h"
+
+
+class EXPORT_CLASS BoneCommandBuffer: public TypedReferenceCount {
+PUBLISHED:
+    BoneCommandBuffer();
+    ~BoneCommandBuffer();
+    unsigned int get_num_commands();
+    unsigned int commit();
+    void clear();
+
+public:
+    void set_transform(PandaNode* node, int order, CPT(TransformState) transform);
+    CPT(TransformState) get_transform(PandaNode* node);
+
+private:
+    struct BoneCommand {
+        PointerTo<PandaNode> node;
+        int order;  // parents go first
+        unsigned int sequence;  // later writes of the same node win
+        CPT(TransformState) transform;
+    };
+
+    pvector<BoneCommand> _commands;
+    KDICT<PandaNode*, unsigned int> _latest;  // last command of every node
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BoneCommandBuffer", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "lightMutexHolder.h"
+
+#include "kphys/core/panda/bonemask.h"
+
+
+TypeHandle BoneMask::_type_handle;
+
+/**
+   Include or exclude list of bones, compiled into a bitset per layout.
+   Empty mask enables all bones. Enabled bones may have partial weights,
+   compiled into a weight array next to the bitset.
+   Masks are compiled once per layout and shared by the threads,
+   the lists should be changed only while nothing is evaluated.
+*/
+BoneMask::BoneMask(): _version(0) {}
+
+BoneMask::~BoneMask() {
+    _include_bones.clear();
+    _exclude_bones.clear();
+    _bone_weights.clear();
+    _compiled.clear();
+}
+
+void BoneMask::include_bone(std::string name) {
+    if (_exclude_bones.find(name) == _exclude_bones.end()) {
+        _include_bones[name] = true;
+    } else {
+        _exclude_bones.erase(name);
+    }
+    _invalidate();
+}
+
+void BoneMask::exclude_bone(std::string name) {
+    if (_include_bones.find(name) == _include_bones.end()) {
+        _exclude_bones[name] = true;
+    } else {
+        _include_bones.erase(name);
+    }
+    _invalidate();
+}
+
+unsigned int BoneMask::get_num_included_bones() {
+    return _include_bones.size();
+}
+
+unsigned int BoneMask::get_num_excluded_bones() {
+    return _exclude_bones.size();
+}
+
+bool BoneMask::is_bone_included(std::string name) {
+    if (_include_bones.find(name) == _include_bones.end())
+        return false;
+    return true;
+}
+
+bool BoneMask::is_bone_excluded(std::string name) {
+    if (_exclude_bones.find(name) == _exclude_bones.end())
+        return false;
+    return true;
+}
+
+bool BoneMask::is_bone_enabled(std::string name) {
+    if (get_num_included_bones())  // whitelist
+        return is_bone_included(name);
+    else  // blacklist
+        return !is_bone_excluded(name);
+}
+
+/**
+   Set the weight of the enabled bone, 1.0 by default.
+*/
+void BoneMask::set_bone_weight(std::string name, float weight) {
+    _bone_weights[name] = MAX(0.0f, MIN(weight, 1.0f));
+    _invalidate();
+}
+
+/**
+   Returns the weight of the bone, 0.0 if the bone is disabled.
+*/
+float BoneMask::get_bone_weight(std::string name) {
+    if (!is_bone_enabled(name))
+        return 0.0f;
+    KDICT<std::string, float>::iterator it = _bone_weights.find(name);
+    return (it != _bone_weights.end()) ? it->second : 1.0f;
+}
+
+unsigned int BoneMask::get_num_weighted_bones() {
+    return _bone_weights.size();
+}
+
+/**
+   Compile the lists for the layout ahead of the evaluation,
+   usually when the poses of the armature are set up.
+*/
+void BoneMask::compile(PointerTo<BoneLayout> layout) {
+    _get_compiled(layout);
+}
+
+/**
+   Returns the lists compiled into the bitset indexed by the layout slot,
+   NULL if all bones are enabled.
+*/
+const uint32_t* BoneMask::get_bits(PointerTo<BoneLayout> layout) {
+    if (!get_num_included_bones() && !get_num_excluded_bones())
+        return NULL;
+    return _get_compiled(layout)->get_bits();
+}
+
+/**
+   Returns the weights compiled into an array indexed by the layout slot,
+   NULL if no bone has a weight, then enabled bones have the full weight.
+*/
+const float* BoneMask::get_weights(PointerTo<BoneLayout> layout) {
+    if (!get_num_weighted_bones())
+        return NULL;
+    return _get_compiled(layout)->get_weights();
+}
+
+/**
+   Returns the compiled mask kept in the cache of the caller.
+   The cache is checked without the lock and refilled only when
+   the layout or the lists change, so it's set up before the evaluation.
+*/
+CompiledBoneMask* BoneMask::get_compiled(BoneLayout* layout, PointerTo<CompiledBoneMask>& cache) {
+    if (cache == NULL || cache->_version != _version ||
+            cache->_layout.get_orig() != layout || cache->_layout.was_deleted())
+        cache = _get_compiled(layout);
+    return cache;
+}
+
+void BoneMask::_invalidate() {
+    LightMutexHolder holder(_lock);
+    _compiled.clear();
+    _version++;
+}
+
+/**
+   Returns the mask compiled for the layout, compiles it if the layout is new.
+   Masks of released layouts are dropped.
+   Compiled masks aren't modified, so they are read without the lock.
+*/
+PointerTo<CompiledBoneMask> BoneMask::_get_compiled(BoneLayout* layout) {
+    LightMutexHolder holder(_lock);
+    plist<PointerTo<CompiledBoneMask>>::iterator it = _compiled.begin();
+    while (it != _compiled.end()) {
+        if ((*it)->_layout.was_deleted()) {
+            it = _compiled.erase(it);
+            continue;
+        }
+        if ((*it)->_layout.get_orig() == layout)
+            return *it;
+        it++;
+    }
+
+    PointerTo<CompiledBoneMask> compiled = new CompiledBoneMask();
+    unsigned int num_bones = layout->get_num_bones();
+    compiled->_layout = layout;
+    compiled->_version = _version;
+    compiled->_has_bits = get_num_included_bones() || get_num_excluded_bones();
+    compiled->_has_weights = get_num_weighted_bones() > 0;
+    compiled->_bits.assign((num_bones + BONE_MASK_BITS - 1) / BONE_MASK_BITS, 0);
+    compiled->_weights.resize(num_bones);
+    for (unsigned int b = 0; b < num_bones; b++) {
+        std::string name = layout->get_bone_name(b);
+        if (is_bone_enabled(name))
+            compiled->_bits[b / BONE_MASK_BITS] |= 1u << (b % BONE_MASK_BITS);
+        compiled->_weights[b] = get_bone_weight(name);
+    }
+    _compiled.push_back(compiled);
+    return compiled;
+}
+
+
+/**
+   Returns the bitset indexed by the layout slot, NULL if all bones are enabled.
+*/
+const uint32_t* CompiledBoneMask::get_bits() {
+    return _has_bits ? _bits.data() : NULL;
+}
+
+/**
+   Returns the weights indexed by the layout slot, NULL if all enabled bones
+   have the full weight.
+*/
+const float* CompiledBoneMask::get_weights() {
+    return _has_weights ? _weights.data() : NULL;
+}
@@ -0,0 +1,96 @@
+#ifndef PANDA_BONE_MASK_H
+#define PANDA_BONE_MASK_H
+
+#include <stdint.h>
+
+#include "lightMutex.h"
+#include "plist.h"
+#include "pvector.h"
+#include "referenceCount.h"
+#include "typedReferenceCount.h"
+#include "weakPointerTo.h"
+
+#include "kphys/core/panda/pose.h"
+#include "kphys/core/panda/types.h"
+
+#define BONE_MASK_BITS 32
+
+
+/**
+   Check the bit of the bone slot in the compiled bone mask.
+*/
+inline bool is_bone_in_mask(const uint32_t* mask, unsigned int slot) {
+    return (mask[slot / BONE_MASK_BITS] >> (slot % BONE_MASK_BITS)) & 1;
+}
+
+/**
+   Bone mask compiled for a layout, kept by the users of the mask,
+   so the evaluation reads it without the lock of the mask.
+*/
+class EXPORT_CLASS CompiledBoneMask: public ReferenceCount {
+public:
+    const uint32_t* get_bits();
+    const float* get_weights();
+
+private:
+    friend class BoneMask;
+
+    WeakPointerTo<BoneLayout> _layout;  // dead layouts are pruned
+    unsigned int _version;  // version of the mask lists
+    bool _has_bits;
+    bool _has_weights;
+    pvector<uint32_t> _bits;  // bit per layout slot, set if the bone is enabled
+    pvector<float> _weights;  // weight per layout slot, 0 if the bone is disabled
+};
+
+class EXPORT_CLASS BoneMask: public TypedReferenceCount {
+PUBLISHED:
+    BoneMask();
+    ~BoneMask();
+    void include_bone(std::string name);
+    void exclude_bone(std::string name);
+    unsigned int get_num_included_bones();
+    unsigned int get_num_excluded_bones();
+    bool is_bone_included(std::string name);
+    bool is_bone_excluded(std::string name);
+    bool is_bone_enabled(std::string name);
+    void set_bone_weight(std::string name, float weight);
+    float get_bone_weight(std::string name);
+    unsigned int get_num_weighted_bones();
+    void compile(PointerTo<BoneLayout> layout);
+
+private:
+    KDICT<std::string, bool> _include_bones;
+    KDICT<std::string, bool> _exclude_bones;
+    KDICT<std::string, float> _bone_weights;
+    plist<PointerTo<CompiledBoneMask>> _compiled;  // per layout, cleared when the lists change
+    unsigned int _version;
+    LightMutex _lock;
+
+    void _invalidate();
+    PointerTo<CompiledBoneMask> _get_compiled(BoneLayout* layout);
+
+    static TypeHandle _type_handle;
+
+public:
+    const uint32_t* get_bits(PointerTo<BoneLayout> layout);
+    const float* get_weights(PointerTo<BoneLayout> layout);
+    CompiledBoneMask* get_compiled(BoneLayout* layout, PointerTo<CompiledBoneMask>& cache);
+
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BoneMask", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "kphys/core/panda/bonepalette.h"
+
+
+TypeHandle BonePalette::_type_handle;
+
+/**
+ * Returns the size of a single bone in the transform textures in bytes.
+ */
+unsigned int get_bone_size(unsigned int bone_format, bool is_half_float) {
+    unsigned int num_texels;
+    switch (bone_format) {
+    case BONE_FORMAT_MAT3X4:
+        num_texels = 3;
+        break;
+    case BONE_FORMAT_DUAL_QUAT:
+        num_texels = 2;
+        break;
+    default:  // BONE_FORMAT_MAT4
+        num_texels = RGBA_MAT4_SIZE;
+        break;
+    }
+    return num_texels * RGBA_CHANNEL_COUNT * (is_half_float ? HALF_FLOAT_SIZE : FLOAT_SIZE);
+}
+
+
+/**
+ * Shared storage of bone transforms for many armatures.
+ * Every armature gets its own block of bones in the same pair of textures
+ * and a bone_offset shader input with the beginning of the block.
+ * Identical armatures drawn with hardware instancing share one contiguous
+ * block from allocate_instances(), see samples/yuki.vert.glsl.
+ */
+BonePalette::BonePalette(
+        const std::string name, unsigned int bone_format,
+        bool is_half_float, unsigned int num_bones): Namable(name)
+        , _bone_format(bone_format)
+        , _is_half_float(is_half_float)
+        , _num_bones(0)
+        , _num_used_bones(0)
+        , _index(0)
+        , _is_modified(1) {
+    _transform_tex = new Texture(name);
+    _prev_transform_tex = new Texture(name);
+    _resize(MAX(num_bones, 1));
+}
+
+BonePalette::~BonePalette() {
+    _free_blocks.clear();
+    _written_bones.clear();
+}
+
+unsigned int BonePalette::get_bone_format() {
+    return _bone_format;
+}
+
+bool BonePalette::is_half_float() {
+    return _is_half_float;
+}
+
+/**
+ * Returns the number of bones the palette can hold without growing.
+ */
+unsigned int BonePalette::get_num_bones() {
+    return _num_bones;
+}
+
+unsigned int BonePalette::get_num_used_bones() {
+    return _num_used_bones;
+}
+
+PointerTo<Texture> BonePalette::get_transform_texture() {
+    return _transform_tex;
+}
+
+PointerTo<Texture> BonePalette::get_prev_transform_texture() {
+    return _prev_transform_tex;
+}
+
+/**
+ * Upload bone transforms written by the armatures.
+ * Should be called once per frame after updating shader inputs
+ * of the all armatures, which are using this palette.
+ * Blocks which weren't written since the last update keep their last
+ * transforms in both buffers, so skipped or culled armatures don't
+ * fall back to older matrices.
+ */
+void BonePalette::update() {
+    if (!AtomicAdjust::set(_is_modified, 0))
+        return;
+
+    unsigned char* cur_data = _data[_index].p();
+    const unsigned char* prev_data = _data[1 - _index].p();
+    unsigned int bone_size = get_bone_size(_bone_format, _is_half_float);
+    unsigned int b = 0;
+    while (b < _num_used_bones) {
+        if (_written_bones[b]) {
+            _written_bones[b++] = 0;
+            continue;
+        }
+        unsigned int start = b;
+        while (b < _num_used_bones && !_written_bones[b])
+            b++;
+        memcpy(cur_data + start * bone_size, prev_data + start * bone_size, (b - start) * bone_size);
+    }
+
+    _transform_tex->set_ram_image(_data[_index]);
+    _prev_transform_tex->set_ram_image(_data[1 - _index]);
+
+    // current matrices become previous
+    _index = 1 - _index;
+}
+
+/**
+ * Reserve a block of bones. Returns the offset of the block.
+ */
+unsigned int BonePalette::allocate(unsigned int num_bones) {
+    // reuse a released block of the same size
+    pmultimap<unsigned int, unsigned int>::iterator it = _free_blocks.find(num_bones);
+    if (it != _free_blocks.end()) {
+        unsigned int offset = it->second;
+        _free_blocks.erase(it);
+        return offset;
+    }
+
+    unsigned int offset = _num_used_bones;
+    _num_used_bones += num_bones;
+    if (_num_used_bones > _num_bones)
+        _resize(MAX(_num_used_bones, _num_bones * 2));
+    return offset;
+}
+
+/**
+ * Reserve a contiguous block for many armatures with the same skeleton.
+ * Instance i uses offset + i * num_bones, which is passed to
+ * ArmatureNode::set_palette(), the shader adds gl_InstanceID * num_bones
+ * to the bone_offset of the first instance.
+ */
+unsigned int BonePalette::allocate_instances(unsigned int num_bones, unsigned int num_instances) {
+    return allocate(num_bones * num_instances);
+}
+
+void BonePalette::release_instances(
+        unsigned int offset, unsigned int num_bones, unsigned int num_instances) {
+    release(offset, num_bones * num_instances);
+}
+
+/**
+ * Return a block of bones back to the palette.
+ */
+void BonePalette::release(unsigned int offset, unsigned int num_bones) {
+    if (offset + num_bones == _num_used_bones)
+        _num_used_bones = offset;
+    else
+        _free_blocks.insert(std::make_pair(num_bones, offset));
+}
+
+/**
+ * Returns a pointer to the current or previous bone transforms.
+ */
+unsigned char* BonePalette::get_data(bool is_current) {
+    return _data[is_current ? _index : 1 - _index].p();
+}
+
+/**
+ * Mark the block as written for the next update. Armatures mark
+ * their own blocks, so the animation threads may call it together.
+ */
+void BonePalette::mark_modified(unsigned int offset, unsigned int num_bones) {
+    nassertv(offset + num_bones <= _written_bones.size());
+    memset(_written_bones.data() + offset, 1, num_bones);
+    AtomicAdjust::set(_is_modified, 1);
+}
+
+/**
+ * Grow textures and buffers, keeping already written bone transforms.
+ */
+void BonePalette::_resize(unsigned int num_bones) {
+    unsigned int bone_size = get_bone_size(_bone_format, _is_half_float);
+    unsigned int num_texels = num_bones * bone_size / (RGBA_CHANNEL_COUNT * (
+        _is_half_float ? HALF_FLOAT_SIZE : FLOAT_SIZE));
+
+    Texture::ComponentType ctype = _is_half_float ? Texture::T_half_float : Texture::T_float;
+    Texture::Format format = _is_half_float ? Texture::F_rgba16 : Texture::F_rgba32;
+    _transform_tex->setup_buffer_texture(
+        num_texels, ctype, format, GeomEnums::UH_dynamic);
+    _prev_transform_tex->setup_buffer_texture(
+        num_texels, ctype, format, GeomEnums::UH_dynamic);
+
+    for (unsigned int i = 0; i < 2; i++) {
+        PTA_uchar data = PTA_uchar::empty_array(bone_size * num_bones);
+        if (_num_bones)
+            memcpy(data.p(), _data[i].p(), bone_size * _num_bones);
+        _data[i] = data;
+    }
+
+    _num_bones = num_bones;
+    _written_bones.resize(num_bones, 0);
+    _transform_tex->set_ram_image(_data[1 - _index]);
+    _prev_transform_tex->set_ram_image(_data[_index]);
+    AtomicAdjust::set(_is_modified, 1);
+}
@@ -0,0 +1,80 @@
+#ifndef PANDA_BONE_PALETTE_H
+#define PANDA_BONE_PALETTE_H
+
+#include "atomicAdjust.h"
+#include "namable.h"
+#include "pmap.h"
+#include "pvector.h"
+#include "texture.h"
+#include "typedReferenceCount.h"
+
+#include "kphys/core/panda/types.h"
+
+
+BEGIN_PUBLISH
+enum BONE_FORMAT {
+    BONE_FORMAT_MAT4 = 0,  // 4 texels per bone, full matrix
+    BONE_FORMAT_MAT3X4 = 1,  // 3 texels per bone, affine matrix columns
+    BONE_FORMAT_DUAL_QUAT = 2,  // 2 texels per bone, real and dual quaternions
+};
+END_PUBLISH
+
+unsigned int get_bone_size(unsigned int bone_format, bool is_half_float);
+
+
+class EXPORT_CLASS BonePalette: public TypedReferenceCount, public Namable {
+PUBLISHED:
+    BonePalette(
+        const std::string name, unsigned int bone_format=BONE_FORMAT_MAT4,
+        bool is_half_float=false, unsigned int num_bones=1024);
+    ~BonePalette();
+    unsigned int get_bone_format();
+    bool is_half_float();
+    unsigned int get_num_bones();
+    unsigned int get_num_used_bones();
+    unsigned int allocate_instances(unsigned int num_bones, unsigned int num_instances);
+    void release_instances(unsigned int offset, unsigned int num_bones, unsigned int num_instances);
+    PointerTo<Texture> get_transform_texture();
+    PointerTo<Texture> get_prev_transform_texture();
+    void update();
+
+private:
+    unsigned int _bone_format;
+    bool _is_half_float;
+    unsigned int _num_bones;  // capacity
+    unsigned int _num_used_bones;  // end of the last allocated block
+    pmultimap<unsigned int, unsigned int> _free_blocks;  // size -> offset
+    PTA_uchar _data[2];  // current and previous matrices, shared with the textures
+    unsigned int _index;  // index of the current matrices buffer
+    pvector<unsigned char> _written_bones;  // 1 if the bone was written since the last update
+    AtomicAdjust::Integer _is_modified;  // marked by the animation threads
+    PointerTo<Texture> _transform_tex;
+    PointerTo<Texture> _prev_transform_tex;
+
+    void _resize(unsigned int num_bones);
+
+    static TypeHandle _type_handle;
+
+public:
+    unsigned int allocate(unsigned int num_bones);
+    void release(unsigned int offset, unsigned int num_bones);
+    unsigned char* get_data(bool is_current);
+    void mark_modified(unsigned int offset, unsigned int num_bones);
+
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BonePalette", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
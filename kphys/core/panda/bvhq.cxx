@@ -1,6 +1,8 @@
+#include <charconv>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string_view>
 
 #include "nodePath.h"
 #include "virtualFileSystem.h"
@@ -11,7 +13,6 @@
 #include "kphys/core/panda/bvhq.h"
 
 #define WORD_MAX_LEN 256
-#define MAX_CHANNELS 10
 
 #define NO_HIERARCHY 1
 #define NO_MOTION 2
@@ -20,6 +21,27 @@
 #define NO_FRAMES 5
 #define NO_FRAME_TIME 6
 
+enum CHANNEL_TYPE {
+    CHANNEL_XPOS = 0,
+    CHANNEL_YPOS = 1,
+    CHANNEL_ZPOS = 2,
+    CHANNEL_XROT = 3,
+    CHANNEL_YROT = 4,
+    CHANNEL_ZROT = 5,
+    CHANNEL_IROT = 6,
+    CHANNEL_JROT = 7,
+    CHANNEL_KROT = 8,
+    CHANNEL_RROT = 9,
+    NUM_CHANNEL_TYPES = 10,
+    CHANNEL_UNKNOWN = 0xff,
+};
+
+static const char* CHANNEL_NAMES[NUM_CHANNEL_TYPES] = {
+    "Xposition", "Yposition", "Zposition",
+    "Xrotation", "Yrotation", "Zrotation",
+    "Irotation", "Jrotation", "Krotation", "Rrotation",
+};
+
 
 TypeHandle BVHQ::_type_handle;
 TypeHandle BVHQJoint::_type_handle;
@@ -45,291 +67,286 @@ void BVHQJoint::add_channel(std::string name) {
 }
 
 
+/**
+ * Split the text into words and lines without copying.
+ */
+class BVHQReader {
+public:
+    BVHQReader(const char* data, size_t size): _pos(data), _end(data + size) {}
+
+    /**
+     * Read the next word, skipping any whitespace including line ends.
+     */
+    bool next_word(std::string_view& word) {
+        while (_pos < _end && is_space(*_pos))
+            _pos++;
+        const char* begin = _pos;
+        while (_pos < _end && !is_space(*_pos))
+            _pos++;
+        word = std::string_view(begin, _pos - begin);
+        return !word.empty();
+    }
+
+    /**
+     * Read the next non-empty line.
+     */
+    bool next_line(std::string_view& line) {
+        while (_pos < _end && is_space(*_pos))
+            _pos++;
+        const char* begin = _pos;
+        while (_pos < _end && *_pos != '\n' && *_pos != '\r')
+            _pos++;
+        line = std::string_view(begin, _pos - begin);
+        return !line.empty();
+    }
+
+    /**
+     * Read the next word of the line, line is consumed.
+     */
+    static bool next_word(std::string_view& line, std::string_view& word) {
+        size_t begin = 0;
+        while (begin < line.size() && is_space(line[begin]))
+            begin++;
+        size_t end = begin;
+        while (end < line.size() && !is_space(line[end]))
+            end++;
+        word = line.substr(begin, end - begin);
+        line.remove_prefix(end);
+        return !word.empty();
+    }
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+private:
+    const char* _pos;
+    const char* _end;
+};
+
+static double parse_number(std::string_view word) {
+    double value = 0;
+#ifdef __cpp_lib_to_chars
+    std::from_chars(word.data(), word.data() + word.size(), value);
+#else
+    char buffer[WORD_MAX_LEN + 1];
+    size_t size = MIN(word.size(), (size_t) WORD_MAX_LEN);
+    memcpy(buffer, word.data(), size);
+    buffer[size] = '\0';
+    value = strtod(buffer, NULL);
+#endif
+    return value;
+}
+
+static unsigned char get_channel_type(std::string_view channel) {
+    for (unsigned char i = 0; i < NUM_CHANNEL_TYPES; i++) {
+        if (channel == CHANNEL_NAMES[i])
+            return i;
+    }
+    return CHANNEL_UNKNOWN;
+}
+
+
 BVHQ::BVHQ(const std::string name, Filename filename, bool debug): Animation(name) {
     if (debug)
         printf("FILE OPEN %s\n", name.c_str());
 
+    // read the whole file in one block
     VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
-    _istream = vfs->open_read_file(filename, true);
-    if (_istream == NULL) {
+    vector_uchar data;
+    if (!vfs->read_file(filename, data, true))
         return;
-    }
 
-    _frame_time = 0;
+    unsigned int exception = _parse((const char*) data.data(), data.size(), debug);
+    if (debug) {
+        switch(exception) {
+        case NO_HIERARCHY:
+            printf("HIERARCHY not found!\n");
+            break;
+        case NO_MOTION:
+            printf("MOTION not found!\n");
+            break;
+        case NO_JOINT_NAME:
+            printf("JOINT has no name!\n");
+            break;
+        case NO_CHANNELS:
+            printf("CHANNELS not found!\n");
+            break;
+        case NO_FRAMES:
+            printf("FRAMES not found!\n");
+            break;
+        case NO_FRAME_TIME:
+            printf("FRAME_TIME not found!\n");
+            break;
+        default:
+            break;
+        }
+        printf("DONE\n");
+    }
+}
 
-    char* word = (char*) malloc(sizeof(char) * (WORD_MAX_LEN + 1));
-    char end = ' ';
-    unsigned int exception = 0;
+BVHQ::~BVHQ() {
+    _hierarchy.clear();
+}
 
-    unsigned long num_frames = 0;
+/**
+ * Parse the whole file. Returns an exception code or 0.
+ */
+unsigned int BVHQ::_parse(const char* data, size_t size, bool debug) {
+    BVHQReader reader(data, size);
+    std::string_view word, line;
 
-    while (end != '\0') {
-        end = _readword(word, WORD_MAX_LEN);
-        if (strcmp(word, "HIERARCHY") == 0)
+    while (reader.next_word(word)) {
+        if (word == "HIERARCHY")
             break;
     }
-    if (end == '\0') {
-        exception = NO_HIERARCHY;
-        goto except;
-    }
+    if (word != "HIERARCHY")
+        return NO_HIERARCHY;
 
-    while (end != '\0') {  // HIERARCHY
-        end = _readword(word, WORD_MAX_LEN);
+    while (reader.next_word(word)) {  // HIERARCHY
+        if (word == "ROOT" || word == "JOINT") {
+            if (!reader.next_word(word))
+                return NO_JOINT_NAME;
 
-        if (strcmp(word, "ROOT") == 0 || strcmp(word, "JOINT") == 0) {
-            if (end == '\0' || end == '\n') {
-                exception = NO_JOINT_NAME;
-                goto except;
-            }
-            end = _readword(word, WORD_MAX_LEN);  //  read bone name
-
-            char* name = (char*) malloc(sizeof(char) * (strlen(word) + 1));
-            strcpy(name, word);
-
-            PointerTo<BVHQJoint> joint = new BVHQJoint(std::string(name));
+            PointerTo<BVHQJoint> joint = new BVHQJoint(std::string(word));
             _hierarchy.push_back(joint);
-
             if (debug)
                 printf("JOINT %s\n", joint->get_name().c_str());
 
-        } else if (strcmp(word, "CHANNELS") == 0) {
-            if (end == '\0' || end == '\n') {
-                exception = NO_CHANNELS;
-                goto except;
-            }
-            end = _readword(word, WORD_MAX_LEN);  // read channels count
+        } else if (word == "CHANNELS") {
+            if (_hierarchy.empty() || !reader.next_word(word))
+                return NO_CHANNELS;
 
-            unsigned short bone_num_channels = atoi(word);
+            unsigned long num_channels = (unsigned long) parse_number(word);
             if (debug)
-                printf("JOINT %s CHANNELS %d\n", _hierarchy.back()->get_name().c_str(), bone_num_channels);
+                printf("JOINT %s CHANNELS %lu\n", _hierarchy.back()->get_name().c_str(), num_channels);
 
-            if (end == '\0' || end == '\n') {
-                exception = NO_CHANNELS;
-                goto except;
-            }
-
-            for (unsigned short i = 0; i < bone_num_channels; i++) {
-                end = _readword(word, WORD_MAX_LEN);  // read channel
-
-                char* channel = (char*) malloc(sizeof(char) * (strlen(word) + 1));
-                strcpy(channel, word);
-
-                _hierarchy.back()->add_channel(std::string(channel));
+            for (unsigned long i = 0; i < num_channels; i++) {
+                if (!reader.next_word(word))
+                    return NO_CHANNELS;
+                _hierarchy.back()->add_channel(std::string(word));
                 if (debug)
-                    printf("JOINT %s CHANNEL %s\n", _hierarchy.back()->get_name().c_str(), channel);
-
-                if (end == '\n')  // no more channels
-                    break;
-
-                if (end == '\0')  // no more channels
-                    goto finally;
+                    printf("JOINT %s CHANNEL %s\n", _hierarchy.back()->get_name().c_str(),
+                           std::string(word).c_str());
             }
 
-        } else if (strcmp(word, "MOTION") == 0) {
+        } else if (word == "MOTION") {
             break;  // leave hierarchy
         }
     }  // HIERARCHY
-    if (end == '\0') {
-        exception = NO_MOTION;
-        goto except;
-    }
+    if (word != "MOTION")
+        return NO_MOTION;
 
-    while (end != '\0') {  // MOTION
-        end = _readword(word, WORD_MAX_LEN);
+    // MOTION header
+    unsigned long num_frames = 0;
+    while (reader.next_word(word)) {
+        if (word == "Frames:") {
+            if (!reader.next_word(word))
+                return NO_FRAMES;
+            num_frames = (unsigned long) parse_number(word);
+            if (debug)
+                printf("FRAMES %lu\n", num_frames);
 
-        if (strcmp(word, "Frames:") == 0) {
-            if (end == '\0' || end == '\n') {
-                exception = NO_FRAMES;
-                goto except;
-            }
-            end = _readword(word, WORD_MAX_LEN);  // read frames count
-            num_frames = atol(word);
+        } else if (word == "Frame") {
+            if (!reader.next_word(word) || word != "Time:" || !reader.next_word(word))
+                return NO_FRAME_TIME;
+            _frame_time = parse_number(word);
             if (debug)
-                printf("FRAMES %ld\n", num_frames);
-            if (end == '\0')
-                goto finally;
-
-        } else if (strcmp(word, "Frame") == 0) {
-            if (end == '\0' || end == '\n') {
-                exception = NO_FRAME_TIME;
-                goto except;
-            }
+                printf("FRAME TIME %.6f\n", _frame_time);
+            break;  // frames go next
+        }
+    }
+    if (word.empty())
+        return num_frames ? NO_FRAME_TIME : NO_FRAMES;
+
+    // resolve channel layout once, rotations are stored as quaternions
+    pvector<unsigned int> channel_bones;
+    pvector<unsigned char> channel_types;
+    for (PointerTo<BVHQJoint> joint: _hierarchy) {
+        unsigned short flags = 0;
+        for (unsigned long ci = 0; ci < joint->get_num_channels(); ci++) {
+            unsigned char type = get_channel_type(joint->get_channel(ci));
+            if (type <= CHANNEL_ZPOS)
+                flags |= TRANSFORM_POS;
+            else if (type != CHANNEL_UNKNOWN)
+                flags |= TRANSFORM_QUAT;
+            channel_types.push_back(type);
+        }
+        unsigned int bone = _add_clip_bone(joint->get_name(), flags);
+        for (unsigned long ci = 0; ci < joint->get_num_channels(); ci++)
+            channel_bones.push_back(bone);
+    }
 
-            end = _readword(word, WORD_MAX_LEN);  // read next keyword
-            if (strcmp(word, "Time:") == 0) {
-                if (end == '\0' || end == '\n') {
-                    exception = NO_FRAME_TIME;
-                    goto except;
-                }
-                end = _readword(word, WORD_MAX_LEN);  // read frame time
-                _frame_time = atof(word);
-                if (debug)
-                    printf("FRAME TIME %.6f\n", _frame_time);
-                if (end == '\0')  // end of motion section
-                    goto finally;
-            }
-            if (end == '\0')  // end of motion section
-                goto finally;
+    unsigned int num_bones = get_num_bones();
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        _clip_data[c].reserve(num_frames * num_bones);
 
-        } else if (num_frames) {
-            for (unsigned long iframe = 0; iframe < num_frames; iframe++) {
-                if (debug)
-                    printf("FRAME %ld\n", iframe);
-
-                PointerTo<Frame> frame = new Frame();
-                unsigned int bi = 0;
-
-                for (PointerTo<BVHQJoint> joint: _hierarchy) {
-                    LVecBase3 pos, hpr;
-                    LQuaternion quat;
-                    unsigned short flags = 0;
-
-                    for (unsigned long ci = 0; ci < joint->get_num_channels(); ci++) {
-                        std::string channel = joint->get_channel(ci);
-
-                        if (iframe > 0 || bi > 0 || ci > 0)
-                            end = _readword(word, WORD_MAX_LEN);  // read channel value
-
-                        // if (debug)
-                        //     printf("CHANNEL %s %s %s\n", joint->name, channel, word);
-
-                        if (strcmp(channel.c_str(), "Xposition") == 0) {
-                            pos.set_x(atof(word));
-                            flags |= TRANSFORM_POS;
-                        }
-                        if (strcmp(channel.c_str(), "Yposition") == 0) {
-                            pos.set_y(atof(word));
-                            flags |= TRANSFORM_POS;
-                        }
-                        if (strcmp(channel.c_str(), "Zposition") == 0) {
-                            pos.set_z(atof(word));
-                            flags |= TRANSFORM_POS;
-                        }
-
-                        if (strcmp(channel.c_str(), "Xrotation") == 0) {
-                            hpr.set_x(atof(word));
-                            flags |= TRANSFORM_HPR;
-                        }
-                        if (strcmp(channel.c_str(), "Yrotation") == 0) {
-                            hpr.set_y(atof(word));
-                            flags |= TRANSFORM_HPR;
-                        }
-                        if (strcmp(channel.c_str(), "Zrotation") == 0) {
-                            hpr.set_z(atof(word));
-                            flags |= TRANSFORM_HPR;
-                        }
-
-                        if (strcmp(channel.c_str(), "Irotation") == 0) {
-                            quat.set_i(atof(word));
-                            flags |= TRANSFORM_QUAT;
-                        }
-                        if (strcmp(channel.c_str(), "Jrotation") == 0) {
-                            quat.set_j(atof(word));
-                            flags |= TRANSFORM_QUAT;
-                        }
-                        if (strcmp(channel.c_str(), "Krotation") == 0) {
-                            quat.set_k(atof(word));
-                            flags |= TRANSFORM_QUAT;
-                        }
-                        if (strcmp(channel.c_str(), "Rrotation") == 0) {
-                            quat.set_r(atof(word));
-                            flags |= TRANSFORM_QUAT;
-                        }
-
-                        if (end == '\0' || end == '\n')
-                            break;  // leave channels
-                    }  // bone channels
-
-                    ConstPointerTo<TransformState> transform = NULL;
-
-                    if (flags & TRANSFORM_POS && flags & TRANSFORM_HPR && !(flags & TRANSFORM_QUAT))
-                        transform = TransformState::make_pos_hpr(pos, hpr);
-                    else if (flags & TRANSFORM_POS && !(flags & TRANSFORM_HPR) && flags & TRANSFORM_QUAT)
-                        // there is no make_pos_quat() method
-                        transform = TransformState::make_pos_quat_scale(
-                            pos, quat, LVecBase3(1, 1, 1));
-                    else if (flags & TRANSFORM_POS && !(flags & TRANSFORM_HPR) && !(flags & TRANSFORM_QUAT))
-                        transform = TransformState::make_pos(pos);
-                    else if (!(flags & TRANSFORM_POS) && flags & TRANSFORM_HPR && !(flags & TRANSFORM_QUAT))
-                        transform = TransformState::make_hpr(hpr);
-                    else if (!(flags & TRANSFORM_POS) && !(flags & TRANSFORM_HPR) && flags & TRANSFORM_QUAT)
-                        transform = TransformState::make_quat(quat);
-
-                    if (transform != NULL)
-                        frame->set_transform(joint->get_name(), transform, flags);
-
-                    bi++;
-                    if (end == '\0' || end == '\n')
-                        break;  // leave bones
-                }  // bone
-
-                _motion.push_back(frame);
-
-                if (end == '\0')
-                    break;  // leave frames
-            }  // frame
-            break;  // leave motion
-        }  // has frames count
-    }  // MOTION
-
-    goto finally;
-
-    except:
+    pvector<LVecBase3> pos(num_bones), hpr(num_bones);
+    pvector<LQuaternion> quat(num_bones);
+    pvector<unsigned short> flags(num_bones);
+
+    // MOTION frames, one frame per line
+    for (unsigned long iframe = 0; iframe < num_frames; iframe++) {
+        if (!reader.next_line(line))
+            break;  // file is truncated
         if (debug)
-            switch(exception) {
-            case NO_HIERARCHY:
-                printf("HIERARCHY not found!\n");
+            printf("FRAME %lu\n", iframe);
+
+        for (unsigned int b = 0; b < num_bones; b++) {
+            pos[b] = LVecBase3(0, 0, 0);
+            hpr[b] = LVecBase3(0, 0, 0);
+            quat[b] = LQuaternion::ident_quat();
+            flags[b] = 0;
+        }
+
+        for (size_t ci = 0; ci < channel_types.size(); ci++) {
+            if (!BVHQReader::next_word(line, word))
+                break;  // missing values are identities
+
+            unsigned int b = channel_bones[ci];
+            double value = parse_number(word);
+            switch (channel_types[ci]) {
+            case CHANNEL_XPOS:
+            case CHANNEL_YPOS:
+            case CHANNEL_ZPOS:
+                pos[b][channel_types[ci] - CHANNEL_XPOS] = value;
                 break;
-            case NO_MOTION:
-                printf("MOTION not found!\n");
+            case CHANNEL_XROT:
+            case CHANNEL_YROT:
+            case CHANNEL_ZROT:
+                hpr[b][channel_types[ci] - CHANNEL_XROT] = value;
+                flags[b] |= TRANSFORM_HPR;
                 break;
-            case NO_JOINT_NAME:
-                printf("JOINT has no name!\n");
+            case CHANNEL_IROT:
+                quat[b].set_i(value);
+                flags[b] |= TRANSFORM_QUAT;
                 break;
-            case NO_CHANNELS:
-                printf("CHANNELS not found!\n");
+            case CHANNEL_JROT:
+                quat[b].set_j(value);
+                flags[b] |= TRANSFORM_QUAT;
                 break;
-            case NO_FRAMES:
-                printf("FRAMES not found!\n");
+            case CHANNEL_KROT:
+                quat[b].set_k(value);
+                flags[b] |= TRANSFORM_QUAT;
                 break;
-            case NO_FRAME_TIME:
-                printf("FRAME_TIME not found!\n");
+            case CHANNEL_RROT:
+                quat[b].set_r(value);
+                flags[b] |= TRANSFORM_QUAT;
                 break;
-            default:
+            default:  // CHANNEL_UNKNOWN
                 break;
             }
+        }
 
-    finally:
-        free(word);
-        if (debug)
-            printf("DONE\n");
-        vfs->close_read_file(_istream);
-        if (debug)
-            printf("FILE CLOSED\n");
-
-}
-
-BVHQ::~BVHQ() {
-    _hierarchy.clear();
-}
-
-char BVHQ::_readword(char* word, unsigned long size) {
-    unsigned long i = 0;
-    char c = '*';
-
-    while (c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '\0' &&
-           i < size && !_istream->eof()) {
-        _istream->get(c);
-        word[i++] = c;
+        unsigned long index = _add_clip_frame();
+        for (unsigned int b = 0; b < num_bones; b++) {
+            if (flags[b] & TRANSFORM_HPR && !(flags[b] & TRANSFORM_QUAT))
+                quat[b].set_hpr(hpr[b]);
+            _set_clip_transform(index, b, pos[b], quat[b]);
+        }
     }
 
-    if (i == 0) {
-        word[i] = '\0';
-        return '\0';
-    } else {
-        word[i - 1] = '\0';
-        return c;
-    }
+    return 0;
 }
 
 bool BVHQ::is_valid() {
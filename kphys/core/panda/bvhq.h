@@ -48,10 +48,9 @@ PUBLISHED:
     bool is_valid();
 
 private:
-    std::istream* _istream;
     pvector<PointerTo<BVHQJoint>> _hierarchy;
 
-    char _readword(char* word, unsigned long size);
+    unsigned int _parse(const char* data, size_t size, bool debug);
 
     static TypeHandle _type_handle;
 
@@ -2,9 +2,61 @@
 
 #include "kphys/core/panda/channel.h"
 
-
 TypeHandle Channel::_type_handle;
 
+
+/**
+   Rotation axis scaled by the angle in radians, the shortest path.
+*/
+static LVecBase3 quat_to_scaled_axis(LQuaternion quat) {
+    if (quat.get_r() < 0)
+        quat = -quat;
+    LVecBase3 axis(quat.get_i(), quat.get_j(), quat.get_k());
+    double length = axis.length();
+    if (length < 1e-6)
+        return axis * 2.0;
+    return axis * (2.0 * atan2(length, quat.get_r()) / length);
+}
+
+/**
+   Quintic decay of the offset x0 with the velocity v0, which reaches zero
+   with zero velocity and acceleration at the end of the duration.
+   Velocity is taken along the offset, velocity away from zero is dropped
+   and fast offsets end earlier, so the decay doesn't overshoot.
+   https://www.gdcvault.com/play/1025165/Inertialization
+*/
+static LVecBase3 decay_offset(const LVecBase3& x0, const LVecBase3& v0, double duration, double t) {
+    double x = x0.length();
+    if (x < 1e-6)
+        return LVecBase3::zero();
+    LVecBase3 direction = x0 / x;
+
+    double v = MIN(v0.dot(direction), 0.0);
+    if (v < 0.0)
+        duration = MIN(duration, -5.0 * x / v);
+    if (t >= duration)
+        return LVecBase3::zero();
+
+    double t2 = duration * duration;
+    double a = (-8.0 * v * duration - 20.0 * x) / t2;
+    double k5 = -(a * t2 + 6.0 * v * duration + 12.0 * x) / (2.0 * t2 * t2 * duration);
+    double k4 = (3.0 * a * t2 + 16.0 * v * duration + 30.0 * x) / (2.0 * t2 * t2);
+    double k3 = -(3.0 * a * t2 + 12.0 * v * duration + 20.0 * x) / (2.0 * t2 * duration);
+    double value = (((((k5 * t + k4) * t + k3) * t + a * 0.5) * t + v) * t + x);
+    return direction * value;
+}
+
+static LQuaternion scaled_axis_to_quat(const LVecBase3& axis) {
+    double angle = axis.length();
+    if (angle < 1e-6) {
+        LQuaternion quat(1.0, axis[0] * 0.5, axis[1] * 0.5, axis[2] * 0.5);
+        quat.normalize();
+        return quat;
+    }
+    double s = sin(angle * 0.5) / angle;
+    return LQuaternion(cos(angle * 0.5), axis[0] * s, axis[1] * s, axis[2] * s);
+}
+
 Channel::Channel(const std::string name): Namable(name) {
     for (unsigned short i = 0; i < NUM_SLOTS; i++) {
         _animations[i] = NULL;
@@ -12,66 +64,78 @@ Channel::Channel(const std::string name): Namable(name) {
     }
     _factor = 0.0;
     _blending_func = BF_LINEAR;
+    _bone_mask = new BoneMask();
+    _transition_mode = TRANSITION_CROSSFADE;
+    _dt = 0.0;
+    _is_switched = false;
+    _inertialization_time = -1.0;
 }
 
 Channel::~Channel() {
     for (unsigned short i = 0; i < NUM_SLOTS; i++) {
         _animations[i] = NULL;
         _frame_indices[i] = 0.0;
+        _bindings[i] = NULL;
     }
-    _include_bones.clear();
-    _exclude_bones.clear();
+    for (unsigned short i = 0; i < NUM_HISTORY_POSES; i++)
+        _history[i] = NULL;
+    _bone_mask = NULL;
+    _compiled_mask = NULL;
 }
 
 void Channel::include_bone(std::string name) {
-    if (_exclude_bones.find(name) == _exclude_bones.end()) {
-        _include_bones[name] = true;
-    } else {
-        _exclude_bones.erase(name);
-    }
+    _bone_mask->include_bone(name);
 }
 
 void Channel::exclude_bone(std::string name) {
-    if (_include_bones.find(name) == _include_bones.end()) {
-        _exclude_bones[name] = true;
-    } else {
-        _include_bones.erase(name);
-    }
+    _bone_mask->exclude_bone(name);
 }
 
 unsigned int Channel::get_num_included_bones() {
-    return _include_bones.size();
+    return _bone_mask->get_num_included_bones();
 }
 
 unsigned int Channel::get_num_excluded_bones() {
-    return _exclude_bones.size();
+    return _bone_mask->get_num_excluded_bones();
 }
 
 bool Channel::is_bone_included(std::string name) {
-    if (_include_bones.find(name) == _include_bones.end())
-        return false;
-    return true;
+    return _bone_mask->is_bone_included(name);
 }
 
 bool Channel::is_bone_excluded(std::string name) {
-    if (_exclude_bones.find(name) == _exclude_bones.end())
-        return false;
-    return true;
+    return _bone_mask->is_bone_excluded(name);
 }
 
 bool Channel::is_bone_enabled(std::string name) {
-    if (get_num_included_bones())  // whitelist
-        return is_bone_included(name);
-    else  // blacklist
-        return !is_bone_excluded(name);
+    return _bone_mask->is_bone_enabled(name);
+}
+
+/**
+   Returns the include/exclude lists of the channel.
+   Channels use only the enabled bones, bone weights are used by the blend tree layers.
+*/
+PointerTo<BoneMask> Channel::get_bone_mask() {
+    return _bone_mask;
+}
+
+/**
+   Returns the bone mask compiled for the layout, cached by the channel.
+*/
+CompiledBoneMask* Channel::get_compiled_mask(BoneLayout* layout) {
+    return _bone_mask->get_compiled(layout, _compiled_mask);
 }
 
 /**
    Returns factor of blending.
    0:   A = 100%, B =   0%
    100: A =   0%, B = 100%
+   Inertialized channels use only B.
 */
 double Channel::get_factor() {
+    if (_transition_mode == TRANSITION_INERTIALIZE)
+        return (_animations[SLOT_B] != NULL) ? 1.0 : 0.0;
+
     double factor = _factor / _blending_time;
     switch (_blending_func) {
     case BF_EXPONENTIAL:
@@ -89,6 +153,40 @@ void Channel::set_blending_func(unsigned int type) {
     _blending_func = type;
 }
 
+/**
+   Crossfade samples both animations during the blending time.
+   Inertialization samples only the new animation and decays
+   the offset from the last output pose over the blending time.
+*/
+void Channel::set_transition_mode(unsigned int mode) {
+    _transition_mode = mode;
+    _is_switched = false;
+    _inertialization_time = -1.0;
+    for (unsigned short i = 0; i < NUM_HISTORY_POSES; i++)
+        _history[i] = NULL;
+}
+
+unsigned int Channel::get_transition_mode() {
+    return _transition_mode;
+}
+
+/**
+   Returns the slot of the output pose in the inertialization mode,
+   slot B during and after the transition, slot A while nothing was pushed.
+*/
+unsigned short Channel::get_output_slot() {
+    return (_animations[SLOT_B] != NULL) ? SLOT_B : SLOT_A;
+}
+
+/**
+   Returns false if the slot doesn't contribute to the output pose.
+*/
+bool Channel::is_slot_sampled(unsigned short slot) {
+    if (_transition_mode != TRANSITION_INERTIALIZE || slot != SLOT_A)
+        return true;
+    return _animations[SLOT_B] == NULL;
+}
+
 double Channel::get_frame_index(unsigned short slot) {
     return _frame_indices[slot];
 }
@@ -121,6 +219,41 @@ bool Channel::save_frame(Frame& frame, unsigned short slot, bool interpolate) {
     return true;
 }
 
+/**
+   Returns animation pose from the specified slot.
+*/
+bool Channel::save_pose(Pose& pose, unsigned short slot, bool interpolate) {
+    PointerTo<Animation> animation = get_animation(slot);
+    if (animation == NULL)
+        return false;
+
+    BoneBinding& binding = _bind(slot, pose);
+    double index = get_frame_index(slot);
+    if (interpolate) {
+        unsigned long i = (unsigned long) floor(index);
+        unsigned long j = (unsigned long) ceil(index);
+        double factor = fmod(index, 1);  // index % 1
+        animation->save_pose(pose, binding, i, j, factor);
+    } else {
+        unsigned long i = (unsigned long) round(index);
+        animation->save_pose(pose, binding, i, i, 0.0);
+    }
+    return true;
+}
+
+/**
+   Returns the binding of the slot animation to the pose layout,
+   resolved again only when the animation or the layout change.
+*/
+BoneBinding& Channel::_bind(unsigned short slot, Pose& pose) {
+    PointerTo<BoneLayout> layout = _animations[slot]->get_bone_layout();
+    PointerTo<BoneBinding>& binding = _bindings[slot];
+    if (binding == NULL || binding->get_layout() != layout ||
+            binding->get_armature_layout() != pose.get_layout())
+        binding = new BoneBinding(layout, pose.get_layout());
+    return *binding;
+}
+
 /**
    Returns the animation in the specified slot.
 */
@@ -149,8 +282,13 @@ void Channel::push_animation(PointerTo<Animation> animation) {
     _frame_indices[SLOT_B] = 0.0;
 
     if ((_animations[SLOT_A] != NULL && !_animations[SLOT_A]->can_blend_out()) ||
-            (_animations[SLOT_B] != NULL && !_animations[SLOT_B]->can_blend_in()))
+            (_animations[SLOT_B] != NULL && !_animations[SLOT_B]->can_blend_in())) {
         _factor = _blending_time;  // set to max
+        _is_switched = false;  // cut, no offset from the old pose
+        _inertialization_time = -1.0;
+    } else if (animation != NULL && _transition_mode == TRANSITION_INERTIALIZE) {
+        _is_switched = true;  // capture the offset from the next sampled pose
+    }
 
 #ifdef KPHYS_DEBUG
     ls();
@@ -167,6 +305,7 @@ void Channel::push_animation(PointerTo<Animation> animation) {
 void Channel::switch_animation() {
     _animations[SLOT_A] = _animations[SLOT_B];
     _frame_indices[SLOT_A] = _frame_indices[SLOT_B];
+    _bindings[SLOT_A] = _bindings[SLOT_B];
 #ifdef KPHYS_DEBUG
     ls();
 #endif
@@ -180,7 +319,7 @@ void Channel::update(double dt) {
         if (_animations[s] == NULL || _animations[s]->is_manual())
             continue;
 
-        if (s == SLOT_A && _factor >= _blending_time)
+        if (s == SLOT_A && (_factor >= _blending_time || !is_slot_sampled(s)))
             continue;
 
         double index_delta = dt / _animations[s]->get_frame_time();
@@ -202,9 +341,113 @@ void Channel::update(double dt) {
 
     // update blending factor
     _factor = fmin(_factor + dt, _blending_time);
+    _dt = dt;
+    if (_inertialization_time >= 0.0)
+        _inertialization_time += dt;
 
 #ifdef KPHYS_DEBUG
     if (get_factor() > 0.0 && get_factor() < 1.0)
         ls();
 #endif
 }
+
+/**
+   Add the decaying offset to the sampled pose of the output slot
+   and remember the result for the next transition.
+*/
+void Channel::inertialize(Pose& pose) {
+    if (_transition_mode != TRANSITION_INERTIALIZE)
+        return;
+
+    if (_is_switched) {
+        _is_switched = false;
+        _start_inertialization(pose);
+    }
+    if (_inertialization_time >= 0.0) {
+        if (_inertialization_time < _blending_time)
+            _apply_inertialization(pose, _inertialization_time);
+        else
+            _inertialization_time = -1.0;  // finished
+    }
+    _record_history(pose);
+}
+
+/**
+   Offsets and velocities from the new pose to the last output pose.
+   Velocity of the new animation is treated as zero, so it is sampled only once.
+*/
+void Channel::_start_inertialization(Pose& pose) {
+    _inertialization_time = -1.0;
+    PointerTo<Pose> source = _history[0];
+    PointerTo<Pose> previous = _history[1];
+    if (source == NULL || source->get_layout() != pose.get_layout() || _blending_time <= 0.0)
+        return;
+    if (previous != NULL && (previous->get_layout() != pose.get_layout() || _dt <= 0.0))
+        previous = NULL;
+
+    unsigned int num_bones = pose.get_num_bones();
+    _offset_flags.assign(num_bones, 0);
+    _pos_offsets.resize(num_bones);
+    _pos_velocities.resize(num_bones);
+    _rot_offsets.resize(num_bones);
+    _rot_velocities.resize(num_bones);
+
+    for (unsigned int b = 0; b < num_bones; b++) {
+        unsigned short flags = source->get_transform_flags(b) & pose.get_transform_flags(b);
+        unsigned short prev_flags = (previous != NULL) ? previous->get_transform_flags(b) : 0;
+        _offset_flags[b] = flags;
+
+        if (flags & TRANSFORM_POS) {
+            _pos_offsets[b] = source->get_pos(b) - pose.get_pos(b);
+            _pos_velocities[b] = LVecBase3::zero();
+            if (prev_flags & TRANSFORM_POS)
+                _pos_velocities[b] = (source->get_pos(b) - previous->get_pos(b)) / _dt;
+        }
+        if (flags & TRANSFORM_QUAT) {
+            LQuaternion quat = source->get_quat(b);
+            _rot_offsets[b] = quat_to_scaled_axis(pose.get_quat(b).conjugate() * quat);
+            _rot_velocities[b] = LVecBase3::zero();
+            if (prev_flags & TRANSFORM_QUAT)
+                _rot_velocities[b] = quat_to_scaled_axis(
+                    previous->get_quat(b).conjugate() * quat) / _dt;
+        }
+    }
+    _inertialization_time = 0.0;
+}
+
+/**
+   Add the offsets decayed by the quintic polynomial over the blending time.
+*/
+void Channel::_apply_inertialization(Pose& pose, double t) {
+    unsigned int num_bones = MIN(pose.get_num_bones(), (unsigned int) _offset_flags.size());
+    for (unsigned int b = 0; b < num_bones; b++) {
+        unsigned short pose_flags = pose.get_transform_flags(b);
+        unsigned short flags = _offset_flags[b] & pose_flags;
+        if (!flags)
+            continue;
+
+        LVecBase3 pos = pose.get_pos(b);
+        LQuaternion quat = pose.get_quat(b);
+        if (flags & TRANSFORM_POS)
+            pos += decay_offset(_pos_offsets[b], _pos_velocities[b], _blending_time, t);
+        if (flags & TRANSFORM_QUAT)
+            quat = quat * scaled_axis_to_quat(
+                decay_offset(_rot_offsets[b], _rot_velocities[b], _blending_time, t));
+        pose.set_transform(b, pos, quat, pose_flags, pose.get_transform_factor(b));
+    }
+}
+
+/**
+   Keep the last two output poses, one copy per update.
+*/
+void Channel::_record_history(Pose& pose) {
+    PointerTo<Pose> oldest = _history[NUM_HISTORY_POSES - 1];
+    if (oldest == NULL || oldest->get_layout() != pose.get_layout())
+        oldest = new Pose(pose.get_layout());
+    for (unsigned short i = NUM_HISTORY_POSES - 1; i > 0; i--)
+        _history[i] = _history[i - 1];
+    _history[0] = oldest;
+
+    oldest->reset();
+    pose.copy_into(*oldest.p());
+}
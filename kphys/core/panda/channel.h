@@ -5,7 +5,10 @@
 #include "typedReferenceCount.h"
 
 #include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/bonebinding.h"
+#include "kphys/core/panda/bonemask.h"
 #include "kphys/core/panda/frame.h"
+#include "kphys/core/panda/pose.h"
 #include "kphys/core/panda/types.h"
 
 #ifndef NDEBUG
@@ -13,6 +16,7 @@
 #endif
 
 #define NUM_SLOTS 2
+#define NUM_HISTORY_POSES 2  // output poses kept for the inertialization
 
 
 BEGIN_PUBLISH
@@ -24,6 +28,10 @@ enum BLENDING_FUNC {
     BF_LINEAR = 0,
     BF_EXPONENTIAL = 1,
 };
+enum TRANSITION_MODE {
+    TRANSITION_CROSSFADE = 0,  // sample and blend both slots
+    TRANSITION_INERTIALIZE = 1,  // sample only slot B, decay the offset from the old pose
+};
 END_PUBLISH
 
 class EXPORT_CLASS Channel: public TypedReferenceCount, public Namable {
@@ -33,9 +41,14 @@ PUBLISHED:
     double get_factor();
     void set_blending_time(double t);
     void set_blending_func(unsigned int type);
+    void set_transition_mode(unsigned int mode);
+    unsigned int get_transition_mode();
+    bool is_slot_sampled(unsigned short slot);
+    unsigned short get_output_slot();
     double get_frame_index(unsigned short slot);
     void set_frame_index(unsigned short slot, double frame);
     bool save_frame(Frame& frame, unsigned short slot, bool interpolate=true);
+    bool save_pose(Pose& pose, unsigned short slot, bool interpolate=true);
     PointerTo<Animation> get_animation(unsigned short slot);
     void ls();
     void push_animation(PointerTo<Animation> animation);
@@ -48,19 +61,39 @@ PUBLISHED:
     bool is_bone_included(std::string name);
     bool is_bone_excluded(std::string name);
     bool is_bone_enabled(std::string name);
+    PointerTo<BoneMask> get_bone_mask();
 
 private:
     PointerTo<Animation> _animations[NUM_SLOTS];
     double _frame_indices[NUM_SLOTS];
+    PointerTo<BoneBinding> _bindings[NUM_SLOTS];  // clip layout -> pose layout
     double _factor;
     double _blending_time;
     unsigned int _blending_func;
-    KDICT<std::string, bool> _include_bones;
-    KDICT<std::string, bool> _exclude_bones;
+    PointerTo<BoneMask> _bone_mask;
+    PointerTo<CompiledBoneMask> _compiled_mask;  // for the last pose layout
+    unsigned int _transition_mode;
+    double _dt;  // time step of the last update
+    bool _is_switched;  // animation was pushed since the last inertialization
+    double _inertialization_time;  // time since the switch, negative if inactive
+    PointerTo<Pose> _history[NUM_HISTORY_POSES];  // last output poses, newest first
+    pvector<unsigned short> _offset_flags;
+    pvector<LVecBase3> _pos_offsets;
+    pvector<LVecBase3> _pos_velocities;
+    pvector<LVecBase3> _rot_offsets;  // rotation axis scaled by the angle
+    pvector<LVecBase3> _rot_velocities;
+
+    BoneBinding& _bind(unsigned short slot, Pose& pose);
+    void _start_inertialization(Pose& pose);
+    void _apply_inertialization(Pose& pose, double t);
+    void _record_history(Pose& pose);
 
     static TypeHandle _type_handle;
 
 public:
+    void inertialize(Pose& pose);
+    CompiledBoneMask* get_compiled_mask(BoneLayout* layout);
+
     static TypeHandle get_class_type() {
         return _type_handle;
     }
@@ -0,0 +1,411 @@
+#include <fstream>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "subfileInfo.h"
+#include "virtualFile.h"
+#include "virtualFileSystem.h"
+
+#include "kphys/core/panda/clipfile.h"
+
+
+TypeHandle ClipFile::_type_handle;
+
+
+/**
+ * Read-only view of a file. Files stored on disk, including uncompressed
+ * multifile subfiles, are memory mapped, other files are read into memory.
+ */
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+    bool open(const Filename& filename);
+    void close();
+    const unsigned char* get_data();
+    size_t get_size();
+    bool is_mapped();
+
+private:
+    const unsigned char* _data;
+    size_t _size;
+    void* _mapping;  // beginning of the mapped view
+    size_t _mapping_size;
+#ifdef _WIN32
+    HANDLE _file_handle;
+    HANDLE _mapping_handle;
+#endif
+    vector_uchar _buffer;  // read file, if it can't be mapped
+
+    bool _map(const SubfileInfo& info);
+};
+
+MappedFile::MappedFile(): _data(NULL), _size(0), _mapping(NULL), _mapping_size(0) {
+#ifdef _WIN32
+    _file_handle = INVALID_HANDLE_VALUE;
+    _mapping_handle = NULL;
+#endif
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const Filename& filename) {
+    close();
+
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    PT(VirtualFile) file = vfs->get_file(filename);
+    if (file == NULL)
+        return false;
+
+    SubfileInfo info;
+    if (file->get_system_info(info) && _map(info))
+        return true;
+
+    // compressed, encrypted or virtual file
+    if (!file->read_file(_buffer, true))
+        return false;
+    _data = _buffer.data();
+    _size = _buffer.size();
+    return true;
+}
+
+void MappedFile::close() {
+    if (_mapping != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(_mapping);
+        CloseHandle(_mapping_handle);
+        CloseHandle(_file_handle);
+        _mapping_handle = NULL;
+        _file_handle = INVALID_HANDLE_VALUE;
+#else
+        munmap(_mapping, _mapping_size);
+#endif
+        _mapping = NULL;
+        _mapping_size = 0;
+    }
+    _buffer.clear();
+    _data = NULL;
+    _size = 0;
+}
+
+const unsigned char* MappedFile::get_data() {
+    return _data;
+}
+
+size_t MappedFile::get_size() {
+    return _size;
+}
+
+bool MappedFile::is_mapped() {
+    return _mapping != NULL;
+}
+
+bool MappedFile::_map(const SubfileInfo& info) {
+    std::string os_filename = info.get_filename().to_os_specific();
+    size_t start = (size_t) info.get_start();
+    size_t size = info.get_size();
+    if (size == 0 || start % sizeof(float))  // frame planes would be misaligned
+        return false;
+
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    size_t offset = start - start % system_info.dwAllocationGranularity;
+
+    _file_handle = CreateFileA(
+        os_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file_handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    _mapping_handle = CreateFileMappingA(_file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (_mapping_handle == NULL) {
+        CloseHandle(_file_handle);
+        _file_handle = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    _mapping_size = start - offset + size;
+    _mapping = MapViewOfFile(
+        _mapping_handle, FILE_MAP_READ,
+        (DWORD) ((unsigned long long) offset >> 32), (DWORD) (offset & 0xffffffff),
+        _mapping_size);
+    if (_mapping == NULL) {
+        CloseHandle(_mapping_handle);
+        CloseHandle(_file_handle);
+        _mapping_handle = NULL;
+        _file_handle = INVALID_HANDLE_VALUE;
+        return false;
+    }
+#else
+    size_t offset = start - start % sysconf(_SC_PAGE_SIZE);
+
+    int fd = ::open(os_filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    _mapping_size = start - offset + size;
+    void* mapping = mmap(NULL, _mapping_size, PROT_READ, MAP_SHARED, fd, offset);
+    ::close(fd);  // mapping keeps the file open
+    if (mapping == MAP_FAILED)
+        return false;
+    _mapping = mapping;
+#endif
+
+    _data = (const unsigned char*) _mapping + (start - offset);
+    _size = size;
+    return true;
+}
+
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + CLIP_FILE_ALIGN - 1) & ~(uint64_t) (CLIP_FILE_ALIGN - 1);
+}
+
+static bool is_in_file(size_t file_size, uint64_t offset, uint64_t size) {
+    return offset <= file_size && size <= file_size - offset;
+}
+
+/**
+ * Key frames of a track should start at 0, grow and stay inside the clip,
+ * sampling relies on it to find the keys.
+ */
+static bool is_valid_key_frames(
+        const unsigned int* frames, unsigned int num_keys, uint32_t num_frames) {
+    if (num_keys == 0)
+        return true;
+    if (frames[0] != 0)
+        return false;
+    for (unsigned int k = 1; k < num_keys; k++) {
+        if (frames[k] <= frames[k - 1])
+            return false;
+    }
+    return frames[num_keys - 1] < num_frames;
+}
+
+
+/**
+ * Animation clip loaded from the binary clip file.
+ * Uncompressed frame planes are used directly from the mapped file.
+ */
+ClipFile::ClipFile(const std::string name, Filename filename): Animation(name) {
+    _mapped_file = new MappedFile();
+    _is_valid = false;
+
+    if (!_mapped_file->open(filename))
+        return;
+
+    _is_valid = _read(_mapped_file->get_data(), _mapped_file->get_size());
+    if (!_is_valid || _is_compressed)
+        _mapped_file->close();  // the data was copied
+}
+
+ClipFile::~ClipFile() {
+    delete _mapped_file;
+}
+
+bool ClipFile::is_valid() {
+    return _is_valid;
+}
+
+/**
+ * Check if frame data is used directly from the memory mapped file.
+ */
+bool ClipFile::is_mapped() {
+    return _is_valid && _mapped_file->is_mapped();
+}
+
+bool ClipFile::_read(const unsigned char* data, size_t size) {
+    ClipFileHeader header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CLIP_FILE_MAGIC, 4) != 0 || header.version != CLIP_FILE_VERSION)
+        return false;
+
+    // bones
+    if (!is_in_file(size, header.names_offset, header.names_size) ||
+            !is_in_file(size, header.bone_flags_offset, header.num_bones * sizeof(unsigned short)))
+        return false;
+
+    const char* names = (const char*) data + header.names_offset;
+    const char* names_end = names + header.names_size;
+    for (uint32_t b = 0; b < header.num_bones; b++) {
+        const char* name_end = (const char*) memchr(names, '\0', names_end - names);
+        if (name_end == NULL)
+            return false;
+
+        unsigned short flags;
+        memcpy(&flags, data + header.bone_flags_offset + b * sizeof(flags), sizeof(flags));
+        if (_add_clip_bone(std::string(names, name_end), flags) != b)
+            return false;  // duplicate name
+        names = name_end + 1;
+    }
+
+    _frame_time = header.frame_time;
+    _is_loop = header.flags & CLIP_FILE_LOOP;
+    _is_manual = header.flags & CLIP_FILE_MANUAL;
+    _blend_in = header.flags & CLIP_FILE_BLEND_IN;
+    _blend_out = header.flags & CLIP_FILE_BLEND_OUT;
+
+    if (header.flags & CLIP_FILE_COMPRESSED) {
+        if (!is_in_file(size, header.tracks_offset, header.num_bones * sizeof(ClipTrack)) ||
+                !is_in_file(size, header.pos_key_frames_offset, header.num_pos_keys * 4ull) ||
+                !is_in_file(size, header.pos_keys_offset, header.num_pos_keys * 6ull) ||
+                !is_in_file(size, header.quat_key_frames_offset, header.num_quat_keys * 4ull) ||
+                !is_in_file(size, header.quat_keys_offset, header.num_quat_keys * 6ull))
+            return false;
+
+        // compressed tracks are small, copy them
+        _tracks.resize(header.num_bones);
+        memcpy(_tracks.data(), data + header.tracks_offset, header.num_bones * sizeof(ClipTrack));
+        for (const ClipTrack& track: _tracks) {
+            if ((uint64_t) track.pos_key + track.num_pos_keys > header.num_pos_keys ||
+                    (uint64_t) track.quat_key + track.num_quat_keys > header.num_quat_keys)
+                return false;
+        }
+
+        _pos_key_frames.resize(header.num_pos_keys);
+        _pos_keys.resize(header.num_pos_keys * 3);
+        _quat_key_frames.resize(header.num_quat_keys);
+        _quat_keys.resize(header.num_quat_keys * SMALLEST_THREE_SIZE);
+        memcpy(_pos_key_frames.data(), data + header.pos_key_frames_offset, _pos_key_frames.size() * 4);
+        memcpy(_pos_keys.data(), data + header.pos_keys_offset, _pos_keys.size() * 2);
+        memcpy(_quat_key_frames.data(), data + header.quat_key_frames_offset, _quat_key_frames.size() * 4);
+        memcpy(_quat_keys.data(), data + header.quat_keys_offset, _quat_keys.size() * 2);
+        for (const ClipTrack& track: _tracks) {
+            if (!is_valid_key_frames(
+                        _pos_key_frames.data() + track.pos_key, track.num_pos_keys,
+                        header.num_frames) ||
+                    !is_valid_key_frames(
+                        _quat_key_frames.data() + track.quat_key, track.num_quat_keys,
+                        header.num_frames))
+                return false;
+        }
+        _is_compressed = true;
+    } else {
+        uint64_t plane_size = (uint64_t) header.num_frames * header.num_bones * sizeof(float);
+        uint64_t plane_stride = align_offset(plane_size);
+        if (header.planes_offset % sizeof(float) ||
+                !is_in_file(size, header.planes_offset, plane_stride * NUM_POSE_COMPONENTS))
+            return false;
+
+        // no copies, planes point to the file data
+        for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+            _clip_planes[c] = (const float*) (data + header.planes_offset + c * plane_stride);
+    }
+
+    _num_frames = header.num_frames;
+    return true;
+}
+
+/**
+ * Write the animation into the binary clip file.
+ * Compressed animations are written compressed.
+ */
+bool ClipFile::write(PointerTo<Animation> animation, Filename filename) {
+    unsigned int num_bones = animation->get_num_bones();
+    std::string names;
+    for (unsigned int b = 0; b < num_bones; b++) {
+        names += animation->_clip_layout->get_bone_name(b);
+        names.push_back('\0');
+    }
+
+    ClipFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLIP_FILE_MAGIC, 4);
+    header.version = CLIP_FILE_VERSION;
+    header.flags = 0;
+    if (animation->_is_compressed)
+        header.flags |= CLIP_FILE_COMPRESSED;
+    if (animation->_is_loop)
+        header.flags |= CLIP_FILE_LOOP;
+    if (animation->_is_manual)
+        header.flags |= CLIP_FILE_MANUAL;
+    if (animation->_blend_in)
+        header.flags |= CLIP_FILE_BLEND_IN;
+    if (animation->_blend_out)
+        header.flags |= CLIP_FILE_BLEND_OUT;
+    header.num_bones = num_bones;
+    header.num_frames = animation->_num_frames;
+    header.frame_time = animation->_frame_time;
+
+    // sections layout
+    uint64_t offset = sizeof(header);
+    header.names_offset = offset;
+    header.names_size = names.size();
+    offset += header.names_size;
+    header.bone_flags_offset = offset = align_offset(offset);
+    offset += num_bones * sizeof(unsigned short);
+
+    uint64_t plane_size = 0;
+    uint64_t plane_stride = 0;
+    if (animation->_is_compressed) {
+        header.num_pos_keys = animation->_pos_key_frames.size();
+        header.num_quat_keys = animation->_quat_key_frames.size();
+        header.tracks_offset = offset = align_offset(offset);
+        offset += num_bones * sizeof(ClipTrack);
+        header.pos_key_frames_offset = offset = align_offset(offset);
+        offset += header.num_pos_keys * 4ull;
+        header.pos_keys_offset = offset = align_offset(offset);
+        offset += header.num_pos_keys * 6ull;
+        header.quat_key_frames_offset = offset = align_offset(offset);
+        offset += header.num_quat_keys * 4ull;
+        header.quat_keys_offset = offset = align_offset(offset);
+        offset += header.num_quat_keys * 6ull;
+    } else {
+        plane_size = (uint64_t) header.num_frames * num_bones * sizeof(float);
+        plane_stride = align_offset(plane_size);
+        header.planes_offset = offset = align_offset(offset);
+        offset += plane_stride * NUM_POSE_COMPONENTS;
+    }
+    if (offset > UINT32_MAX)
+        return false;  // offsets of the header are 32-bit
+
+    pvector<unsigned char> buffer(offset, 0);
+    unsigned char* data = buffer.data();
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + header.names_offset, names.data(), header.names_size);
+    memcpy(
+        data + header.bone_flags_offset, animation->_clip_flags.data(),
+        num_bones * sizeof(unsigned short));
+
+    if (animation->_is_compressed) {
+        memcpy(data + header.tracks_offset, animation->_tracks.data(), num_bones * sizeof(ClipTrack));
+        memcpy(data + header.pos_key_frames_offset, animation->_pos_key_frames.data(), header.num_pos_keys * 4);
+        memcpy(data + header.pos_keys_offset, animation->_pos_keys.data(), header.num_pos_keys * 6);
+        memcpy(data + header.quat_key_frames_offset, animation->_quat_key_frames.data(), header.num_quat_keys * 4);
+        memcpy(data + header.quat_keys_offset, animation->_quat_keys.data(), header.num_quat_keys * 6);
+    } else if (plane_size) {
+        for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+            memcpy(data + header.planes_offset + c * plane_stride, animation->_clip_planes[c], plane_size);
+    }
+
+    // write next to the target and rename, a mapped clip keeps the old file
+    std::string dirname = filename.get_dirname();
+    Filename temp = Filename::temporary(
+        dirname.empty() ? "." : dirname, "." + filename.get_basename() + ".", ".tmp");
+    std::ofstream out;
+    temp.set_binary();
+    if (!temp.open_write(out))
+        return false;
+    out.write((const char*) data, buffer.size());
+    out.close();
+    if (out.fail() || !temp.rename_to(filename)) {
+        temp.unlink();
+        return false;
+    }
+    return true;
+}
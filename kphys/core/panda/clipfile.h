@@ -0,0 +1,86 @@
+#ifndef PANDA_CLIP_FILE_H
+#define PANDA_CLIP_FILE_H
+
+#include <stdint.h>
+
+#include "filename.h"
+
+#include "kphys/core/panda/animation.h"
+
+#define CLIP_FILE_MAGIC "KCLP"
+#define CLIP_FILE_VERSION 1
+#define CLIP_FILE_ALIGN 16
+
+
+BEGIN_PUBLISH
+enum CLIP_FILE_FLAGS {
+    CLIP_FILE_COMPRESSED = 1 << 0,
+    CLIP_FILE_LOOP = 1 << 1,
+    CLIP_FILE_MANUAL = 1 << 2,
+    CLIP_FILE_BLEND_IN = 1 << 3,
+    CLIP_FILE_BLEND_OUT = 1 << 4,
+};
+END_PUBLISH
+
+class MappedFile;
+
+
+/**
+ * Binary clip file, all offsets are in bytes from the beginning of the file.
+ * Frame planes are aligned to CLIP_FILE_ALIGN bytes.
+ */
+struct ClipFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;  // CLIP_FILE_FLAGS
+    uint32_t num_bones;
+    uint32_t num_frames;
+    float frame_time;
+    uint32_t names_offset;  // '\0' terminated bone names
+    uint32_t names_size;
+    uint32_t bone_flags_offset;  // unsigned short per bone
+    uint32_t planes_offset;  // NUM_POSE_COMPONENTS planes of num_frames * num_bones floats
+    uint32_t tracks_offset;  // compressed tracks per bone
+    uint32_t pos_key_frames_offset;
+    uint32_t pos_keys_offset;
+    uint32_t num_pos_keys;
+    uint32_t quat_key_frames_offset;
+    uint32_t quat_keys_offset;
+    uint32_t num_quat_keys;
+};
+
+
+class EXPORT_CLASS ClipFile: public Animation {
+PUBLISHED:
+    ClipFile(const std::string name, Filename filename);
+    ~ClipFile();
+    bool is_valid();
+    bool is_mapped();
+    static bool write(PointerTo<Animation> animation, Filename filename);
+
+private:
+    MappedFile* _mapped_file;
+    bool _is_valid;
+
+    bool _read(const unsigned char* data, size_t size);
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        Animation::init_type();
+        register_type(_type_handle, "ClipFile", Animation::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
@@ -1,12 +1,20 @@
 #include "dconfig.h"
 
 #include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/animationcache.h"
+#include "kphys/core/panda/animationloader.h"
 #include "kphys/core/panda/animator.h"
 #include "kphys/core/panda/armature.h"
+#include "kphys/core/panda/blendtree.h"
 #include "kphys/core/panda/bone.h"
+#include "kphys/core/panda/bonebinding.h"
+#include "kphys/core/panda/bonecommands.h"
+#include "kphys/core/panda/bonemask.h"
+#include "kphys/core/panda/bonepalette.h"
 #include "kphys/core/panda/bvhq.h"
 #include "kphys/core/panda/ccdik.h"
 #include "kphys/core/panda/channel.h"
+#include "kphys/core/panda/clipfile.h"
 #include "kphys/core/panda/config.h"
 #include "kphys/core/panda/controller_base.h"
 #include "kphys/core/panda/controller.h"
@@ -18,8 +26,10 @@
 #include "kphys/core/panda/ik.h"
 #include "kphys/core/panda/multianimation.h"
 #include "kphys/core/panda/multianimator.h"
+#include "kphys/core/panda/pose.h"
 #include "kphys/core/panda/puppet.h"
 #include "kphys/core/panda/puppetmaster.h"
+#include "kphys/core/panda/puppettask.h"
 #include "kphys/core/panda/spring.h"
 #include "kphys/core/panda/spring2.h"
 #include "kphys/core/panda/types.h"
@@ -29,6 +39,15 @@
 Configure(config_core);
 NotifyCategoryDef(core, "");
 
+ConfigVariableInt64 kphys_animation_cache_budget
+("kphys-animation-cache-budget", 64 * 1024 * 1024,
+ PRC_DESC("Size in bytes of the unused animations kept by the AnimationCache."));
+
+ConfigVariableInt kphys_puppet_threads
+("kphys-puppet-threads", 0,
+ PRC_DESC("Number of worker threads of the PuppetMasterNode, "
+          "0 uses one thread less than the number of CPU cores."));
+
 ConfigureFn(config_core) {
     init_libcore();
 }
@@ -40,15 +59,25 @@ void init_libcore() {
     initialized = true;
 
     Animation::init_type();
+    AnimationLoadTask::init_type();
     MultiAnimation::init_type();
     AnimatorNode::init_type();
     MultiAnimatorNode::init_type();
     BVHQ::init_type();
     BVHQJoint::init_type();
+    ClipFile::init_type();
     Channel::init_type();
+    BlendNode::init_type();
+    ClipBlendNode::init_type();
+    CrossfadeBlendNode::init_type();
+    LayerBlendNode::init_type();
+    BlendTree::init_type();
     Frame::init_type();
+    BoneLayout::init_type();
+    Pose::init_type();
     Puppet::init_type();
     PuppetMasterNode::init_type();
+    PuppetTask::init_type();
 
     BaseControllerNode::init_type();
     ControllerNode::init_type();
@@ -59,8 +88,13 @@ void init_libcore() {
 
     ArmatureNode::init_type();
     BoneNode::init_type();
+    BoneBinding::init_type();
+    BoneCommandBuffer::init_type();
+    BoneMask::init_type();
+    BonePalette::init_type();
     WiggleBoneNode::init_type();
     EffectorNode::init_type();
 
+    AnimationCache::get_global_ptr();
     return;
 }
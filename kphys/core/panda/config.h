@@ -2,11 +2,16 @@
 #define PANDA_CONFIG_H
 #pragma once
 
+#include "configVariableInt.h"
+#include "configVariableInt64.h"
 #include "notifyCategoryProxy.h"
 
 
 NotifyCategoryDecl(core, EXPORT_CLASS, EXPORT_TEMPL);
 
+extern ConfigVariableInt64 kphys_animation_cache_budget;
+extern ConfigVariableInt kphys_puppet_threads;
+
 extern EXPORT_CLASS void init_libcore();
 
 #endif
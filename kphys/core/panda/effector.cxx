@@ -6,6 +6,7 @@
 
 #include "nodePath.h"
 
+#include "kphys/core/panda/armature.h"
 #include "kphys/core/panda/bone.h"
 #include "kphys/core/panda/ccdik.h"
 #include "kphys/core/panda/converters.h"
@@ -41,6 +42,29 @@ unsigned int EffectorNode::get_priority() {
     return _priority;
 }
 
+/**
+ * Invalidate the effector registry of the armatures the effector was
+ * removed from and of the armatures above its new place,
+ * registries of other armatures are kept.
+ */
+void EffectorNode::parents_changed() {
+    PandaNode::parents_changed();
+    for (WeakPointerTo<PandaNode>& armature : _armatures) {
+        if (!armature.was_deleted())
+            ((ArmatureNode*) armature.p())->invalidate_effectors();
+    }
+    _armatures.clear();
+
+    NodePath np = NodePath::any_path(this);
+    while (np.has_parent()) {
+        np = np.get_parent();
+        if (is_armature(np)) {
+            ((ArmatureNode*) np.node())->invalidate_effectors();
+            _armatures.push_back(np.node());
+        }
+    }
+}
+
 double EffectorNode::get_weight() {
     return _weight;
 }
@@ -87,28 +111,31 @@ unsigned int EffectorNode::rebuild_ik(struct ik_solver_t* ik_solver, unsigned in
 void EffectorNode::sync_p2ik_local() {
     NodePath effector = NodePath::any_path(this);
     NodePath armature = get_armature(effector);
+    ArmatureNode* armature_node = (ArmatureNode*) armature.node();
     NodePath chain_root = get_chain_root();
 
     // IK positions and rotations are relative to chain root
 #ifdef WITH_FABRIK
     if (_ik_effector != NULL) {
-        _ik_effector->target_position = LVecBase3_to_IKVec3(effector.get_pos(chain_root));
-        _ik_effector->target_rotation = LQuaternion_to_IKQuat(effector.get_quat(chain_root));
+        CPT(TransformState) transform = armature_node->get_bone_transform(effector, chain_root);
+        _ik_effector->target_position = LVecBase3_to_IKVec3(transform->get_pos());
+        _ik_effector->target_rotation = LQuaternion_to_IKQuat(transform->get_quat());
     }
 #endif
 
     // save world-space position and rotation
-    _position = effector.get_pos(armature);
-    // _rotation = effector.get_quat(armature);
+    _position = armature_node->get_bone_transform(effector, armature)->get_pos();
+    // _rotation = armature_node->get_bone_transform(effector, armature)->get_quat();
 }
 
 void EffectorNode::sync_ik2p_local() {
     NodePath effector = NodePath::any_path(this);
     NodePath armature = get_armature(effector);
+    ArmatureNode* armature_node = (ArmatureNode*) armature.node();
 
     // restore world-space position and rotation
-    effector.set_pos(armature, _position);
-    effector.set_quat(armature, LQuaternion::ident_quat());
+    armature_node->set_bone_pos(effector, armature, _position);
+    armature_node->set_bone_quat(effector, armature, LQuaternion::ident_quat());
 }
 
 /**
@@ -141,16 +168,18 @@ void EffectorNode::inverse_kinematics_ccd(
     NodePath target = NodePath::any_path(this);
     NodePath end_effector = target.get_parent();
     NodePath armature = get_armature(target);
+    ArmatureNode* armature_node = (ArmatureNode*) armature.node();
 
     // save world-space target position because it will be modified
     sync_p2ik_local();
-    LPoint3 target_pos_ws = target.get_pos(armature);
+    LPoint3 target_pos_ws = armature_node->get_bone_transform(target, armature)->get_pos();
 
     double err, ang;
     bool target_reached = false;
     for (unsigned int i = 0; i < max_iterations; i++) {
         if (i >= min_iterations) {
-            err = (target_pos_ws - end_effector.get_pos(armature)).length();
+            LPoint3 ee_ws = armature_node->get_bone_transform(end_effector, armature)->get_pos();
+            err = (target_pos_ws - ee_ws).length();
             if (err < threshold) {
                 target_reached = true;
                 break;
@@ -165,10 +194,11 @@ void EffectorNode::inverse_kinematics_ccd(
                 continue;
 
             // same as "target.get_pos(bone)" but using saved world-space position
-            LPoint3 target_pos = bone.get_relative_point(armature, target_pos_ws);
+            LPoint3 target_pos = armature_node->get_bone_transform(armature, bone)
+                ->get_mat().xform_point(target_pos_ws);
 
             LPoint3 pos = LPoint3::zero();
-            LPoint3 ee = end_effector.get_pos(bone);
+            LPoint3 ee = armature_node->get_bone_transform(end_effector, bone)->get_pos();
 
             LVector3 d1 = target_pos - pos;
             LVector3 d2 = ee - pos;
@@ -181,7 +211,7 @@ void EffectorNode::inverse_kinematics_ccd(
             LQuaternion q;
             q.set_from_axis_angle_rad(ang, cross);
             // Add this rotation to the current rotation:
-            LQuaternion q_old = bone.get_quat(armature);
+            LQuaternion q_old = armature_node->get_bone_transform(bone, armature)->get_quat();
             LQuaternion q_new = q * q_old;
             q_new.normalize();
 
@@ -220,7 +250,7 @@ void EffectorNode::inverse_kinematics_ccd(
 
                 q_new.set_from_axis_angle_rad(ang, rot_axis);
 
-                bone.set_quat(armature, q_new);
+                armature_node->set_bone_quat(bone, armature, q_new);
             }
         }
     }
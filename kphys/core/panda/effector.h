@@ -2,7 +2,9 @@
 #define PANDA_EFFECTOR_H
 
 #include "pandaNode.h"
+#include "pvector.h"
 #include "transformState.h"
+#include "weakPointerTo.h"
 
 #ifdef CPPPARSER  // interrogate
 #else  // normal compiler
@@ -34,8 +36,12 @@ private:
 #ifdef WITH_FABRIK
     struct ik_effector_t* _ik_effector;  // [IK] effector
 #endif
+    pvector<WeakPointerTo<PandaNode>> _armatures;  // armatures above the effector
     static TypeHandle _type_handle;
 
+protected:
+    virtual void parents_changed();
+
 public:
 #ifdef WITH_FABRIK
     struct ik_effector_t* get_ik_effector();
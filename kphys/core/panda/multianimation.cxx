@@ -7,20 +7,56 @@ MultiAnimation::MultiAnimation(const std::string name): Namable(name) {}
 
 MultiAnimation::~MultiAnimation() {
     _animations.clear();
+    _loading_animations.clear();
 }
 
 /**
    Put a reusable animation in the storage.
 */
 void MultiAnimation::put_animation(std::string channel_name, PointerTo<Animation> animation) {
+    _loading_animations.erase(channel_name);
     _animations[channel_name] = animation;
 }
 
+/**
+   Put an animation, which is being loaded, in the storage.
+   It becomes available when the loading task is done.
+*/
+void MultiAnimation::put_animation(std::string channel_name, PointerTo<AnimationLoadTask> task) {
+    _animations.erase(channel_name);
+    _loading_animations[channel_name] = task;
+}
+
 /**
    Get a reusable animation from the storage.
+   Returns NULL if the animation is still being loaded.
 */
 PointerTo<Animation> MultiAnimation::get_animation(std::string channel_name) {
+    _take_loaded_animations();
     if (_animations.find(channel_name) == _animations.end())
         return nullptr;
     return _animations[channel_name];
 }
+
+/**
+   Check if any of the animations is still being loaded.
+*/
+bool MultiAnimation::is_loading() {
+    _take_loaded_animations();
+    return !_loading_animations.empty();
+}
+
+void MultiAnimation::_take_loaded_animations() {
+    KDICT<std::string, PointerTo<AnimationLoadTask>>::iterator it = _loading_animations.begin();
+    while (it != _loading_animations.end()) {
+        if (!it->second->done()) {
+            it++;
+            continue;
+        }
+
+        PointerTo<Animation> animation = it->second->get_animation();
+        if (animation != nullptr)
+            _animations[it->first] = animation;
+        it = _loading_animations.erase(it);
+    }
+}
@@ -6,6 +6,7 @@
 #include "typedReferenceCount.h"
 
 #include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/animationloader.h"
 #include "kphys/core/panda/types.h"
 
 
@@ -14,10 +15,15 @@ PUBLISHED:
     MultiAnimation(const std::string name);
     ~MultiAnimation();
     void put_animation(std::string channel_name, PointerTo<Animation> animation);
+    void put_animation(std::string channel_name, PointerTo<AnimationLoadTask> task);
     PointerTo<Animation> get_animation(std::string channel_name);
+    bool is_loading();
 
 private:
     KDICT<std::string, PointerTo<Animation>> _animations;
+    KDICT<std::string, PointerTo<AnimationLoadTask>> _loading_animations;
+
+    void _take_loaded_animations();
 
     static TypeHandle _type_handle;
 
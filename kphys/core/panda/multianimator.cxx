@@ -47,7 +47,7 @@ void MultiAnimatorNode::switch_multi_animation(std::string name) {
     }
 
     PointerTo<MultiAnimation> multi_animation = get_multi_animation(name);
-    if (multi_animation == nullptr) {
+    if (multi_animation == nullptr || multi_animation->is_loading()) {
         return;
     }
 
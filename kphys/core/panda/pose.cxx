@@ -0,0 +1,370 @@
+#include <string.h>
+
+#include "kphys/core/panda/bonemask.h"
+#include "kphys/core/panda/pose.h"
+
+
+TypeHandle BoneLayout::_type_handle;
+TypeHandle Pose::_type_handle;
+
+
+/**
+ * Ordered set of bone names shared by poses of the same skeleton.
+ * Bone names are resolved into slots once, poses are indexed by slots.
+ */
+BoneLayout::BoneLayout() {}
+
+BoneLayout::~BoneLayout() {
+    _bone_names.clear();
+    _slots.clear();
+}
+
+/**
+ * Returns the slot of the bone, adds the bone if it is not in the layout.
+ */
+unsigned int BoneLayout::add_bone(std::string name) {
+    KDICT<std::string, unsigned int>::iterator it = _slots.find(name);
+    if (it != _slots.end())
+        return it->second;
+
+    unsigned int slot = _bone_names.size();
+    _bone_names.push_back(name);
+    _slots[name] = slot;
+    return slot;
+}
+
+/**
+ * Returns the slot of the bone or -1 if it is not in the layout.
+ */
+int BoneLayout::find_bone(std::string name) {
+    KDICT<std::string, unsigned int>::iterator it = _slots.find(name);
+    if (it == _slots.end())
+        return -1;
+    return it->second;
+}
+
+unsigned int BoneLayout::get_num_bones() {
+    return _bone_names.size();
+}
+
+std::string BoneLayout::get_bone_name(unsigned int slot) {
+    nassertr(slot < _bone_names.size(), std::string());
+    return _bone_names[slot];
+}
+
+
+/**
+ * Bone transforms stored in contiguous arrays indexed by the layout slot.
+ * Rotations are kept as quaternions, HPR transforms are converted on load.
+ */
+Pose::Pose(PointerTo<BoneLayout> layout): _layout(layout) {
+    _num_bones = layout->get_num_bones();
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        _components[c].assign(_num_bones, (c == POSE_QUAT_R) ? 1.0f : 0.0f);
+    _flags.assign(_num_bones, 0);
+    _factors.assign(_num_bones, 1.0f);
+}
+
+Pose::~Pose() {
+    _layout = NULL;
+}
+
+PointerTo<BoneLayout> Pose::get_layout() {
+    return _layout;
+}
+
+unsigned int Pose::get_num_bones() {
+    return _num_bones;
+}
+
+/**
+ * Mark all transforms as not set, keeps the allocated arrays.
+ */
+void Pose::reset() {
+    memset(_flags.data(), 0, _num_bones * sizeof(unsigned short));
+}
+
+/**
+ * The layout may still grow after the pose is created,
+ * slots added later are out of the pose and are rejected.
+ */
+bool Pose::has_transform(unsigned int slot) {
+    nassertr(slot < _num_bones, false);
+    return _flags[slot] != 0;
+}
+
+unsigned short Pose::get_transform_flags(unsigned int slot) {
+    nassertr(slot < _num_bones, 0);
+    return _flags[slot];
+}
+
+double Pose::get_transform_factor(unsigned int slot) {
+    nassertr(slot < _num_bones, 1.0);
+    return _flags[slot] ? _factors[slot] : 1.0;
+}
+
+LVecBase3 Pose::get_pos(unsigned int slot) {
+    nassertr(slot < _num_bones, LVecBase3::zero());
+    return LVecBase3(
+        _components[POSE_POS_X][slot],
+        _components[POSE_POS_Y][slot],
+        _components[POSE_POS_Z][slot]);
+}
+
+LQuaternion Pose::get_quat(unsigned int slot) {
+    nassertr(slot < _num_bones, LQuaternion::ident_quat());
+    return LQuaternion(
+        _components[POSE_QUAT_R][slot],
+        _components[POSE_QUAT_I][slot],
+        _components[POSE_QUAT_J][slot],
+        _components[POSE_QUAT_K][slot]);
+}
+
+void Pose::set_transform(
+        unsigned int slot, const LVecBase3& pos, const LQuaternion& quat,
+        unsigned short flags, double factor) {
+    nassertv(slot < _num_bones);
+    for (unsigned int c = 0; c < 3; c++)
+        _components[POSE_POS_X + c][slot] = pos[c];
+    for (unsigned int c = 0; c < 4; c++)
+        _components[POSE_QUAT_R + c][slot] = quat[c];
+    _flags[slot] = flags;
+    _factors[slot] = factor;
+}
+
+/**
+ * Convert a frame into the pose. Bones missing in the layout are skipped.
+ */
+void Pose::load_frame(PointerTo<Frame> frame) {
+    reset();
+
+    unsigned int nt = frame->get_num_transforms();
+    for (unsigned int i = 0; i < nt; i++) {
+        std::string name = frame->get_bone_name(i);
+        int slot = _layout->find_bone(name);
+        if (slot < 0 || (unsigned int)slot >= _num_bones)
+            continue;
+
+        ConstPointerTo<TransformState> transform = frame->get_transform(name);
+        unsigned short frame_flags = frame->get_transform_flags(name);
+        unsigned short flags = 0;
+        if (frame_flags & TRANSFORM_POS)
+            flags |= TRANSFORM_POS;
+        if (frame_flags & (TRANSFORM_HPR | TRANSFORM_QUAT))
+            flags |= TRANSFORM_QUAT;
+
+        set_transform(
+            slot, transform->get_pos(), transform->get_quat(),
+            flags, frame->get_transform_factor(name));
+    }
+}
+
+void Pose::copy_transform_into(Pose& pose_dest, unsigned int slot, double factor) {
+    nassertv(slot < _num_bones && slot < pose_dest._num_bones);
+    // don't overwrite existing transform
+    if (pose_dest._flags[slot] || !_flags[slot])
+        return;
+
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++)
+        pose_dest._components[c][slot] = _components[c][slot];
+    pose_dest._flags[slot] = _flags[slot];
+    pose_dest._factors[slot] = (factor == FACTOR_AUTO) ? _factors[slot] : factor;
+}
+
+void Pose::copy_into(Pose& pose_dest) {
+    nassertv(pose_dest._num_bones == _num_bones);
+    for (unsigned int b = 0; b < _num_bones; b++)
+        copy_transform_into(pose_dest, b);
+}
+
+/**
+ * Same as Frame::mix_into, but works on the arrays
+ * without name lookups and transform states.
+ * Flags are resolved per bone, then all bones are blended by the SIMD kernel.
+ */
+void Pose::mix_into(Pose& pose_dest, PointerTo<Pose> pose_b, double factor, unsigned int blend_mode) {
+    nassertv(pose_b->_layout == _layout && pose_dest._layout == _layout);
+    nassertv(pose_b->_num_bones == _num_bones && pose_dest._num_bones == _num_bones);
+
+    if (factor == 0.0)
+        return copy_into(pose_dest);
+    else if (factor >= 1.0)
+        return pose_b->copy_into(pose_dest);
+
+    _blend_factors.resize(_num_bones);
+    for (unsigned int b = 0; b < _num_bones; b++) {
+        _blend_factors[b] = -1.0f;
+
+        // don't overwrite existing transform
+        if (pose_dest._flags[b])
+            continue;
+
+        unsigned short flags_a = _flags[b];
+        unsigned short flags_b = pose_b->_flags[b];
+        double cfactor = (factor == FACTOR_AUTO) ? pose_b->get_transform_factor(b) : factor;
+
+        unsigned short flags;
+        if (flags_a && cfactor < 0.001) {  // copy pose A
+            flags = flags_a;
+            cfactor = 0.0;
+        } else if (flags_b && cfactor > 0.999) {  // copy pose B
+            flags = flags_b;
+            cfactor = 1.0;
+        } else {  // one of the poses is missing, can't mix
+            flags = flags_a & flags_b;
+        }
+        if (!flags)
+            continue;
+
+        _blend_factors[b] = cfactor;
+        pose_dest._flags[b] = flags;
+        pose_dest._factors[b] = 1.0;
+    }
+
+    float* dest[NUM_POSE_COMPONENTS];
+    const float* a[NUM_POSE_COMPONENTS];
+    const float* b[NUM_POSE_COMPONENTS];
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++) {
+        dest[c] = pose_dest._components[c].data();
+        a[c] = _components[c].data();
+        b[c] = pose_b->_components[c].data();
+    }
+    blend_transforms(
+        dest, a, b, _blend_factors.data(), _blend_factors.data(), _num_bones, blend_mode);
+}
+
+void Pose::blend(PointerTo<Pose> pose_b, double factor, unsigned int blend_mode) {
+    blend(*pose_b, factor, blend_mode, NULL);
+}
+
+/**
+ * Blend pose B into this pose in place. Transforms missing in this pose
+ * are copied from B, components missing in B are kept.
+ * Bones which are not in the mask are kept, NULL mask enables all bones.
+ * The factor is scaled by the bone weights, NULL weights are all 1.0.
+ */
+void Pose::blend(
+        Pose& pose_b, double factor, unsigned int blend_mode,
+        const uint32_t* mask, const float* weights) {
+    nassertv(pose_b._layout == _layout && pose_b._num_bones == _num_bones);
+    if (factor <= 0.0)
+        return;
+    factor = MIN(factor, 1.0);
+
+    _blend_factors.resize(_num_bones);
+    _blend_quat_factors.resize(_num_bones);
+    for (unsigned int b = 0; b < _num_bones; b++) {
+        unsigned short flags_a = _flags[b];
+        unsigned short flags_b = pose_b._flags[b];
+        _blend_factors[b] = -1.0f;
+        _blend_quat_factors[b] = -1.0f;
+        if (!flags_b || (mask != NULL && !is_bone_in_mask(mask, b)))
+            continue;
+        float bone_factor = (weights != NULL) ? factor * weights[b] : factor;
+        if (bone_factor <= 0.0f)
+            continue;
+
+        if (flags_b & TRANSFORM_POS)
+            _blend_factors[b] = (flags_a & TRANSFORM_POS) ? bone_factor : 1.0f;
+        if (flags_b & TRANSFORM_QUAT)
+            _blend_quat_factors[b] = (flags_a & TRANSFORM_QUAT) ? bone_factor : 1.0f;
+        if (!flags_a)
+            _factors[b] = pose_b._factors[b];
+        _flags[b] = flags_a | flags_b;
+    }
+
+    float* dest[NUM_POSE_COMPONENTS];
+    const float* b[NUM_POSE_COMPONENTS];
+    for (unsigned int c = 0; c < NUM_POSE_COMPONENTS; c++) {
+        dest[c] = _components[c].data();
+        b[c] = pose_b._components[c].data();
+    }
+    blend_transforms(
+        dest, dest, b, _blend_factors.data(), _blend_quat_factors.data(),
+        _num_bones, blend_mode);
+}
+
+void Pose::add_difference(PointerTo<Pose> pose_b, PointerTo<Pose> reference, double factor) {
+    add_difference(*pose_b, reference, factor, NULL);
+}
+
+/**
+ * Add the difference between pose B and the reference pose to this pose,
+ * scaled by the factor. Without the reference pose B is the difference itself.
+ * Missing transforms of this pose and of the reference pose are identities.
+ */
+void Pose::add_difference(
+        Pose& pose_b, Pose* reference, double factor,
+        const uint32_t* mask, const float* weights) {
+    nassertv(pose_b._layout == _layout && pose_b._num_bones == _num_bones);
+    nassertv(reference == NULL ||
+             (reference->_layout == _layout && reference->_num_bones == _num_bones));
+    if (factor <= 0.0)
+        return;
+
+    for (unsigned int b = 0; b < _num_bones; b++) {
+        unsigned short flags_b = pose_b._flags[b];
+        if (!flags_b || (mask != NULL && !is_bone_in_mask(mask, b)))
+            continue;
+        double bone_factor = (weights != NULL) ? factor * weights[b] : factor;
+        if (bone_factor <= 0.0)
+            continue;
+
+        unsigned short flags_a = _flags[b];
+        unsigned short flags_ref = (reference != NULL) ? reference->_flags[b] : 0;
+
+        if (flags_b & TRANSFORM_POS) {
+            LVecBase3 pos = (flags_a & TRANSFORM_POS) ? get_pos(b) : LVecBase3::zero();
+            LVecBase3 delta = pose_b.get_pos(b);
+            if (flags_ref & TRANSFORM_POS)
+                delta -= reference->get_pos(b);
+            pos += delta * bone_factor;
+            for (unsigned int c = 0; c < 3; c++)
+                _components[POSE_POS_X + c][b] = pos[c];
+        }
+
+        if (flags_b & TRANSFORM_QUAT) {
+            LQuaternion quat = (flags_a & TRANSFORM_QUAT) ? get_quat(b) : LQuaternion::ident_quat();
+            LQuaternion delta = pose_b.get_quat(b);
+            if (flags_ref & TRANSFORM_QUAT)
+                delta = reference->get_quat(b).conjugate() * delta;
+            if (delta.get_r() < 0)  // shortest path from the identity
+                delta = -delta;
+            delta = LQuaternion::ident_quat() + (delta - LQuaternion::ident_quat()) * bone_factor;
+            delta.normalize();
+            quat = quat * delta;
+            for (unsigned int c = 0; c < 4; c++)
+                _components[POSE_QUAT_R + c][b] = quat[c];
+        }
+
+        if (!flags_a)
+            _factors[b] = 1.0;
+        _flags[b] = flags_a | (flags_b & (TRANSFORM_POS | TRANSFORM_QUAT));
+    }
+}
+
+void Pose::ls() {
+    printf("Pose (%d bones) {\n", _num_bones);
+    for (unsigned int b = 0; b < _num_bones; b++) {
+        unsigned short flags = _flags[b];
+        if (!flags)
+            continue;
+
+        printf("    Bone (%s) {", _layout->get_bone_name(b).c_str());
+        if (flags & TRANSFORM_POS)
+            printf(
+                " pos(%f, %f, %f)",
+                _components[POSE_POS_X][b],
+                _components[POSE_POS_Y][b],
+                _components[POSE_POS_Z][b]);
+        if (flags & TRANSFORM_QUAT)
+            printf(
+                " quat(%f, %f, %f, %f)",
+                _components[POSE_QUAT_I][b],
+                _components[POSE_QUAT_J][b],
+                _components[POSE_QUAT_K][b],
+                _components[POSE_QUAT_R][b]);
+        printf(" * %f }\n", _factors[b]);
+    }
+    printf("}\n");
+}
@@ -0,0 +1,119 @@
+#ifndef PANDA_POSE_H
+#define PANDA_POSE_H
+
+#include <stdint.h>
+
+#include "pvector.h"
+#include "typedReferenceCount.h"
+
+#include "kphys/core/panda/frame.h"
+#include "kphys/core/panda/posekernels.h"
+#include "kphys/core/panda/types.h"
+
+
+enum PoseComponent {
+    POSE_POS_X = 0,
+    POSE_POS_Y = 1,
+    POSE_POS_Z = 2,
+    POSE_QUAT_R = 3,
+    POSE_QUAT_I = 4,
+    POSE_QUAT_J = 5,
+    POSE_QUAT_K = 6,
+};
+
+
+class EXPORT_CLASS BoneLayout: public TypedReferenceCount {
+PUBLISHED:
+    BoneLayout();
+    ~BoneLayout();
+    unsigned int add_bone(std::string name);
+    int find_bone(std::string name);
+    unsigned int get_num_bones();
+    std::string get_bone_name(unsigned int slot);
+
+private:
+    pvector<std::string> _bone_names;
+    KDICT<std::string, unsigned int> _slots;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "BoneLayout", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+
+class EXPORT_CLASS Pose: public TypedReferenceCount {
+PUBLISHED:
+    Pose(PointerTo<BoneLayout> layout);
+    ~Pose();
+    PointerTo<BoneLayout> get_layout();
+    unsigned int get_num_bones();
+    void reset();
+    bool has_transform(unsigned int slot);
+    unsigned short get_transform_flags(unsigned int slot);
+    double get_transform_factor(unsigned int slot);
+    LVecBase3 get_pos(unsigned int slot);
+    LQuaternion get_quat(unsigned int slot);
+    void set_transform(
+        unsigned int slot, const LVecBase3& pos, const LQuaternion& quat,
+        unsigned short flags, double factor=1.0);
+    void load_frame(PointerTo<Frame> frame);
+    void copy_transform_into(Pose& pose_dest, unsigned int slot, double factor=FACTOR_AUTO);
+    void copy_into(Pose& pose_dest);
+    void mix_into(
+        Pose& pose_dest, PointerTo<Pose> pose_b,
+        double factor=FACTOR_AUTO, unsigned int blend_mode=BLEND_LERP);
+    void blend(PointerTo<Pose> pose_b, double factor, unsigned int blend_mode=BLEND_NLERP);
+    void add_difference(PointerTo<Pose> pose_b, PointerTo<Pose> reference, double factor);
+    void ls();
+
+private:
+    PointerTo<BoneLayout> _layout;
+    unsigned int _num_bones;
+    // component planes indexed by the layout slot
+    pvector<float> _components[NUM_POSE_COMPONENTS];  // pos xyz, quat rijk
+    pvector<unsigned short> _flags;  // TRANSFORM_POS | TRANSFORM_QUAT, 0 if not set
+    pvector<float> _factors;
+    pvector<float> _blend_factors;  // blend factors of positions, negative if skipped
+    pvector<float> _blend_quat_factors;  // blend factors of quaternions, negative if skipped
+
+    static TypeHandle _type_handle;
+
+public:
+    void blend(
+        Pose& pose_b, double factor, unsigned int blend_mode,
+        const uint32_t* mask, const float* weights=NULL);
+    void add_difference(
+        Pose& pose_b, Pose* reference, double factor,
+        const uint32_t* mask, const float* weights=NULL);
+
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(_type_handle, "Pose", TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
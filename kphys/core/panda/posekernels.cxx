@@ -0,0 +1,210 @@
+#include <math.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "kphys/core/panda/pose.h"
+#include "kphys/core/panda/posekernels.h"
+
+
+/*
+ * Every instruction set is wrapped into the same set of operations,
+ * so the blend kernel is written only once. Masks are the results of comparisons.
+ */
+
+struct ScalarFloats {
+    typedef float T;
+    typedef bool M;
+    static const unsigned int WIDTH = 1;
+
+    static inline T load(const float* p) { return *p; }
+    static inline void store(float* p, T v) { *p = v; }
+    static inline T set(float f) { return f; }
+    static inline T add(T a, T b) { return a + b; }
+    static inline T sub(T a, T b) { return a - b; }
+    static inline T mul(T a, T b) { return a * b; }
+    static inline T max(T a, T b) { return (a > b) ? a : b; }
+    static inline T div(T a, T b) { return a / b; }
+    static inline T sqrt(T a) { return sqrtf(a); }
+    static inline M less(T a, T b) { return a < b; }
+    static inline M both(M a, M b) { return a && b; }
+    static inline T select(M m, T a, T b) { return m ? a : b; }
+};
+
+#if defined(__AVX__)
+#define BLEND_KERNEL_NAME "avx"
+#define BLEND_SIMD
+struct SIMDFloats {
+    typedef __m256 T;
+    typedef __m256 M;
+    static const unsigned int WIDTH = 8;
+
+    static inline T load(const float* p) { return _mm256_loadu_ps(p); }
+    static inline void store(float* p, T v) { _mm256_storeu_ps(p, v); }
+    static inline T set(float f) { return _mm256_set1_ps(f); }
+    static inline T add(T a, T b) { return _mm256_add_ps(a, b); }
+    static inline T sub(T a, T b) { return _mm256_sub_ps(a, b); }
+    static inline T mul(T a, T b) { return _mm256_mul_ps(a, b); }
+    static inline T max(T a, T b) { return _mm256_max_ps(a, b); }
+    static inline T div(T a, T b) { return _mm256_div_ps(a, b); }
+    static inline T sqrt(T a) { return _mm256_sqrt_ps(a); }
+    static inline M less(T a, T b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static inline M both(M a, M b) { return _mm256_and_ps(a, b); }
+    static inline T select(M m, T a, T b) { return _mm256_blendv_ps(b, a, m); }
+};
+#elif defined(__SSE2__) || defined(_M_X64)
+#define BLEND_KERNEL_NAME "sse2"
+#define BLEND_SIMD
+struct SIMDFloats {
+    typedef __m128 T;
+    typedef __m128 M;
+    static const unsigned int WIDTH = 4;
+
+    static inline T load(const float* p) { return _mm_loadu_ps(p); }
+    static inline void store(float* p, T v) { _mm_storeu_ps(p, v); }
+    static inline T set(float f) { return _mm_set1_ps(f); }
+    static inline T add(T a, T b) { return _mm_add_ps(a, b); }
+    static inline T sub(T a, T b) { return _mm_sub_ps(a, b); }
+    static inline T mul(T a, T b) { return _mm_mul_ps(a, b); }
+    static inline T max(T a, T b) { return _mm_max_ps(a, b); }
+    static inline T div(T a, T b) { return _mm_div_ps(a, b); }
+    static inline T sqrt(T a) { return _mm_sqrt_ps(a); }
+    static inline M less(T a, T b) { return _mm_cmplt_ps(a, b); }
+    static inline M both(M a, M b) { return _mm_and_ps(a, b); }
+    static inline T select(M m, T a, T b) {
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+    }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define BLEND_KERNEL_NAME "neon"
+#define BLEND_SIMD
+struct SIMDFloats {
+    typedef float32x4_t T;
+    typedef uint32x4_t M;
+    static const unsigned int WIDTH = 4;
+
+    static inline T load(const float* p) { return vld1q_f32(p); }
+    static inline void store(float* p, T v) { vst1q_f32(p, v); }
+    static inline T set(float f) { return vdupq_n_f32(f); }
+    static inline T add(T a, T b) { return vaddq_f32(a, b); }
+    static inline T sub(T a, T b) { return vsubq_f32(a, b); }
+    static inline T mul(T a, T b) { return vmulq_f32(a, b); }
+    static inline T max(T a, T b) { return vmaxq_f32(a, b); }
+    static inline T div(T a, T b) { return vdivq_f32(a, b); }
+    static inline T sqrt(T a) { return vsqrtq_f32(a); }
+    static inline M less(T a, T b) { return vcltq_f32(a, b); }
+    static inline M both(M a, M b) { return vandq_u32(a, b); }
+    static inline T select(M m, T a, T b) { return vbslq_f32(m, a, b); }
+};
+#else
+#define BLEND_KERNEL_NAME "scalar"
+#endif
+
+
+/**
+ * Blend bones [start, end) with V::WIDTH bones per step,
+ * returns the first bone which didn't fit into a full step.
+ */
+template <class V>
+static unsigned int blend_range(
+        float* const dest[NUM_POSE_COMPONENTS],
+        const float* const a[NUM_POSE_COMPONENTS],
+        const float* const b[NUM_POSE_COMPONENTS],
+        const float* pos_factors, const float* quat_factors,
+        unsigned int start, unsigned int end, unsigned int mode) {
+    typedef typename V::T T;
+    typedef typename V::M M;
+
+    const T zero = V::set(0.0f);
+    const T half = V::set(0.5f);
+    const T one = V::set(1.0f);
+
+    unsigned int i = start;
+    for (; i + V::WIDTH <= end; i += V::WIDTH) {
+        T t = V::load(pos_factors + i);
+        M keep = V::less(t, zero);
+
+        T s = V::sub(one, t);
+        for (unsigned int c = POSE_POS_X; c <= POSE_POS_Z; c++) {
+            T v = V::add(V::mul(s, V::load(a[c] + i)), V::mul(t, V::load(b[c] + i)));
+            V::store(dest[c] + i, V::select(keep, V::load(dest[c] + i), v));
+        }
+
+        t = V::load(quat_factors + i);
+        keep = V::less(t, zero);
+
+        T qa[4];
+        T qb[4];
+        T dot = zero;
+        for (unsigned int c = 0; c < 4; c++) {
+            qa[c] = V::load(a[POSE_QUAT_R + c] + i);
+            qb[c] = V::load(b[POSE_QUAT_R + c] + i);
+            dot = V::add(dot, V::mul(qa[c], qb[c]));
+        }
+
+        // negate quat B if dot product is negative, B is copied as is
+        M flip = V::both(V::less(dot, zero), V::less(t, one));
+        for (unsigned int c = 0; c < 4; c++)
+            qb[c] = V::select(flip, V::sub(zero, qb[c]), qb[c]);
+
+        T qt = t;
+        if (mode == BLEND_SLERP) {
+            // zeux.io/2015/07/23/approximating-slerp
+            T d = V::select(flip, V::sub(zero, dot), dot);
+            T ka = V::add(V::set(3.55645f), V::mul(d, V::set(-1.43519f)));
+            ka = V::add(V::set(-3.2452f), V::mul(d, ka));
+            ka = V::add(V::set(1.0904f), V::mul(d, ka));
+            T kb = V::add(V::set(-1.06021f), V::mul(d, V::set(0.215638f)));
+            kb = V::add(V::set(0.848013f), V::mul(d, kb));
+            T th = V::sub(t, half);
+            T k = V::add(V::mul(ka, V::mul(th, th)), kb);
+            qt = V::add(t, V::mul(V::mul(V::mul(t, th), V::sub(t, one)), k));
+        }
+        T qs = V::sub(one, qt);
+
+        T q[4];
+        T len = zero;
+        for (unsigned int c = 0; c < 4; c++) {
+            q[c] = V::add(V::mul(qs, qa[c]), V::mul(qt, qb[c]));
+            len = V::add(len, V::mul(q[c], q[c]));
+        }
+        if (mode != BLEND_LERP) {
+            T scale = V::div(one, V::sqrt(V::max(len, V::set(1e-12f))));
+            for (unsigned int c = 0; c < 4; c++)
+                q[c] = V::mul(q[c], scale);
+        }
+        for (unsigned int c = 0; c < 4; c++) {
+            float* p = dest[POSE_QUAT_R + c] + i;
+            V::store(p, V::select(keep, V::load(p), q[c]));
+        }
+    }
+    return i;
+}
+
+
+void blend_transforms(
+        float* const dest[NUM_POSE_COMPONENTS],
+        const float* const a[NUM_POSE_COMPONENTS],
+        const float* const b[NUM_POSE_COMPONENTS],
+        const float* pos_factors, const float* quat_factors,
+        unsigned int num_bones, unsigned int mode) {
+    unsigned int start = 0;
+#ifdef BLEND_SIMD
+    start = blend_range<SIMDFloats>(
+        dest, a, b, pos_factors, quat_factors, 0, num_bones, mode);
+#endif
+    blend_range<ScalarFloats>(
+        dest, a, b, pos_factors, quat_factors, start, num_bones, mode);
+}
+
+/**
+ * Returns the instruction set of the blend kernel, chosen at compile time.
+ */
+const char* get_blend_kernel_name() {
+    return BLEND_KERNEL_NAME;
+}
@@ -0,0 +1,31 @@
+#ifndef PANDA_POSE_KERNELS_H
+#define PANDA_POSE_KERNELS_H
+
+#include "pandabase.h"
+
+#define NUM_POSE_COMPONENTS 7
+
+
+BEGIN_PUBLISH
+enum BLEND_MODE {
+    BLEND_LERP = 0,  // linear quaternions, not normalized
+    BLEND_NLERP = 1,  // normalized linear quaternions
+    BLEND_SLERP = 2,  // nlerp with the corrected factor, approximates slerp
+};
+END_PUBLISH
+
+/**
+ * Blend positions and quaternions of num_bones bones in one pass,
+ * dest = a * (1 - factor) + b * factor. Quaternions of B are negated
+ * for the shortest path. Negative factors keep the dest values.
+ */
+void blend_transforms(
+    float* const dest[NUM_POSE_COMPONENTS],
+    const float* const a[NUM_POSE_COMPONENTS],
+    const float* const b[NUM_POSE_COMPONENTS],
+    const float* pos_factors, const float* quat_factors,
+    unsigned int num_bones, unsigned int mode);
+
+const char* get_blend_kernel_name();
+
+#endif
@@ -1,17 +1,53 @@
-#include "kphys/core/panda/animator.h"
+#include "lightMutexHolder.h"
+
 #include "kphys/core/panda/puppet.h"
+#include "kphys/core/panda/puppetmaster.h"
 
 
 TypeHandle Puppet::_type_handle;
 
+/**
+ * Worker thread of the PuppetMasterNode.
+ * Runs the jobs of its own queue, then steals the jobs of other workers.
+ */
 Puppet::Puppet(
         const std::string &name, const std::string &sync_name,
-        NodePath animator):
-        Thread(name, sync_name), _animator(animator) {}
+        PuppetMasterNode* master, unsigned int index):
+        Thread(name, sync_name), _master(master), _index(index) {}
 
 Puppet::~Puppet() {}
 
+void Puppet::push_job(unsigned int job) {
+    LightMutexHolder holder(_lock);
+    _jobs.push_back(job);
+}
+
+/**
+ * Take the job from the back of the queue, used by the owner.
+ */
+bool Puppet::pop_job(unsigned int& job) {
+    LightMutexHolder holder(_lock);
+    if (_jobs.empty())
+        return false;
+    job = _jobs.back();
+    _jobs.pop_back();
+    return true;
+}
+
+/**
+ * Take the job from the front of the queue, used by other workers.
+ */
+bool Puppet::steal_job(unsigned int& job) {
+    LightMutexHolder holder(_lock);
+    if (_jobs.empty())
+        return false;
+    job = _jobs.front();
+    _jobs.pop_front();
+    return true;
+}
+
 void Puppet::thread_main() {
-    ((AnimatorNode*) _animator.node())->apply();
-    sleep(0.01);
+    unsigned long tick = 0;
+    while (_master->wait_tick(tick))
+        _master->run_jobs(_index);
 }
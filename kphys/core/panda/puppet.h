@@ -1,17 +1,30 @@
 #ifndef PANDA_PUPPET_H
 #define PANDA_PUPPET_H
 
-#include "nodePath.h"
+#include "lightMutex.h"
+#include "pdeque.h"
 #include "thread.h"
 
 
+class PuppetMasterNode;
+
+
 class EXPORT_CLASS Puppet: public Thread {
 PUBLISHED:
-    Puppet(const std::string &name, const std::string &sync_name, NodePath _animator);
+    Puppet(const std::string &name, const std::string &sync_name,
+           PuppetMasterNode* master, unsigned int index);
     ~Puppet();
 
+public:
+    void push_job(unsigned int job);
+    bool pop_job(unsigned int& job);
+    bool steal_job(unsigned int& job);
+
 private:
-    NodePath _animator;
+    PuppetMasterNode* _master;
+    unsigned int _index;
+    LightMutex _lock;
+    pdeque<unsigned int> _jobs;  // actor indices of the current tick
     void thread_main();
 
     static TypeHandle _type_handle;
@@ -1,35 +1,304 @@
+#include <algorithm>
+#include <thread>
+
+#include "mutexHolder.h"
 #include "threadPriority.h"
+
+#include "kphys/core/panda/config.h"
 #include "kphys/core/panda/puppetmaster.h"
 
 
 TypeHandle PuppetMasterNode::_type_handle;
 
-PuppetMasterNode::PuppetMasterNode(const std::string name): PandaNode(name) {}
+/**
+ * Runs the animators below the node on a fixed pool of worker threads.
+ * Number of workers defaults to kphys-puppet-threads,
+ * the calling thread works too.
+ */
+PuppetMasterNode::PuppetMasterNode(const std::string name, unsigned int num_workers):
+        PandaNode(name),
+        _num_workers(num_workers),
+        _stages(PUPPET_UPDATE | PUPPET_APPLY),
+        _dt(0.0),
+        _tick_cvar(_lock),
+        _done_cvar(_lock),
+        _tick(0),
+        _is_running(false),
+        _pending(0) {
+    if (_num_workers == 0) {
+        int num_threads = kphys_puppet_threads;
+        if (num_threads <= 0)
+            num_threads = (int) std::thread::hardware_concurrency() - 1;
+        _num_workers = (unsigned int) MAX(num_threads, 1);
+    }
+}
 
-PuppetMasterNode::~PuppetMasterNode() {}
+PuppetMasterNode::~PuppetMasterNode() {
+    stop();
+}
 
+/**
+ * Collect all animators and armatures below the node,
+ * each actor is a job of the tick. Layouts, bindings and poses
+ * are built here, the jobs only read them.
+ * Call again after changing the bones or the animators.
+ */
 void PuppetMasterNode::build() {
+    nassertv(!_is_running);
+    _animators.clear();
+    _armatures.clear();
+
     NodePath master = NodePath::any_path(this);
 
     NodePathCollection nps = master.find_all_matches("**/+AnimatorNode");
     int num_nps = nps.get_num_paths();
-    for (int i = 0; i < num_nps; i++) {
-        NodePath np = nps.get_path(i);
-        PointerTo<Puppet> puppet = new Puppet(np.get_name(), np.get_name(), np);
-        _puppets.push_back(puppet);
-    }
+    for (int i = 0; i < num_nps; i++)
+        _animators.push_back((AnimatorNode*) nps.get_path(i).node());
 
     nps = master.find_all_matches("**/+MultiAnimatorNode");
     num_nps = nps.get_num_paths();
+    for (int i = 0; i < num_nps; i++)
+        _animators.push_back((AnimatorNode*) nps.get_path(i).node());
+
+    // looked up once here, the workers don't touch the lookup cache
+    for (PointerTo<AnimatorNode> animator : _animators) {
+        NodePath armature = animator->find_armature();
+        _armatures.push_back(armature.is_empty() ? NULL : (ArmatureNode*) armature.node());
+    }
+
+    // armatures driven only by IK and wiggle bones
+    nps = master.find_all_matches("**/+ArmatureNode");
+    num_nps = nps.get_num_paths();
     for (int i = 0; i < num_nps; i++) {
-        NodePath np = nps.get_path(i);
-        PointerTo<Puppet> puppet = new Puppet(np.get_name(), np.get_name(), np);
-        _puppets.push_back(puppet);
+        ArmatureNode* armature = (ArmatureNode*) nps.get_path(i).node();
+        if (std::find(_armatures.begin(), _armatures.end(), armature) != _armatures.end())
+            continue;
+        _animators.push_back(NULL);
+        _armatures.push_back(armature);
+    }
+
+    unsigned int num_jobs = _animators.size();
+    for (unsigned int i = 0; i < num_jobs; i++) {
+        if (_armatures[i] == NULL)
+            continue;
+        _armatures[i]->prepare();
+        if (_animators[i] != NULL)
+            _animators[i]->setup();
     }
 }
 
 void PuppetMasterNode::start() {
-    for (PointerTo<Puppet> puppet : _puppets) {
-        puppet->start(ThreadPriority::TP_low, true);
+    if (_is_running)
+        return;
+
+    _is_running = true;
+    for (unsigned int i = 0; i < _num_workers; i++) {
+        std::string name = get_name() + "-puppet-" + std::to_string(i);
+        PointerTo<Puppet> puppet = new Puppet(name, get_name(), this, i);
+        _puppets.push_back(puppet);
+        puppet->start(ThreadPriority::TP_normal, true);
     }
 }
+
+/**
+ * Stop and join the workers, update() runs the jobs on the calling thread then.
+ */
+void PuppetMasterNode::stop() {
+    {
+        MutexHolder holder(_lock);
+        if (!_is_running)
+            return;
+        _is_running = false;
+        _tick_cvar.notify_all();
+    }
+    for (PointerTo<Puppet> puppet : _puppets)
+        puppet->join();
+    _puppets.clear();
+}
+
+bool PuppetMasterNode::is_running() {
+    return _is_running;
+}
+
+/**
+ * Run one tick of all animators and wait for them to finish.
+ */
+void PuppetMasterNode::update(double dt) {
+    begin_update(dt);
+    finish_update();
+}
+
+/**
+ * Hand out the jobs of the tick and return without waiting,
+ * so the animation runs in parallel with the rendering of the frame.
+ * Armatures should be buffered or deferred, see ArmatureNode.
+ */
+void PuppetMasterNode::begin_update(double dt) {
+    unsigned int num_jobs = _animators.size();
+    if (num_jobs == 0)
+        return;
+
+    _dt = dt;
+    if (_stages & PUPPET_WIGGLE)
+        _root = NodePath::any_path(this).get_top();
+
+    if (_puppets.empty()) {
+        for (unsigned int i = 0; i < num_jobs; i++)
+            _run_job(i);
+        return;
+    }
+
+    AtomicAdjust::set(_pending, num_jobs);
+    unsigned int num_puppets = _puppets.size();
+    for (unsigned int i = 0; i < num_jobs; i++)
+        _puppets[i % num_puppets]->push_job(i);
+
+    MutexHolder holder(_lock);
+    _tick++;
+    _tick_cvar.notify_all();
+}
+
+/**
+ * Frame barrier, helps with the remaining jobs and waits for the others.
+ */
+void PuppetMasterNode::finish_update() {
+    if (_puppets.empty())
+        return;
+
+    run_jobs(_puppets.size());  // help instead of waiting
+
+    MutexHolder holder(_lock);
+    while (AtomicAdjust::get(_pending) > 0)
+        _done_cvar.wait();
+}
+
+/**
+ * Apply the poses published by the buffered armatures
+ * and the recorded bone writes, called by the main thread.
+ * IK and wiggle bones were recorded by the workers, only the matrices
+ * of these armatures are updated here, they are read by the rendering.
+ */
+void PuppetMasterNode::sync() {
+    for (PointerTo<ArmatureNode> armature : _armatures) {
+        if (armature == NULL || !_is_synced(armature))
+            continue;
+        armature->sync_pose();
+        armature->commit();
+        if (_stages & PUPPET_MATRICES)
+            armature->update_shader_inputs();
+    }
+}
+
+unsigned int PuppetMasterNode::get_num_workers() {
+    return _num_workers;
+}
+
+unsigned int PuppetMasterNode::get_num_actors() {
+    return _animators.size();
+}
+
+unsigned int PuppetMasterNode::get_stages() {
+    return _stages;
+}
+
+/**
+ * Select the PUPPET_STAGE flags which are run for every animator.
+ */
+void PuppetMasterNode::set_stages(unsigned int stages) {
+    _stages = stages;
+}
+
+/**
+ * Returns true if the jobs don't write into the scene graph,
+ * so the tick may run while the frame is rendered. Poses, IK and wiggle bones
+ * of buffered and deferred armatures reach the bones in sync(), which also
+ * updates their matrices on the main thread. Other armatures allow
+ * only PUPPET_UPDATE.
+ */
+bool PuppetMasterNode::can_overlap() {
+    if (!(_stages & ~PUPPET_UPDATE))
+        return true;
+
+    for (PointerTo<ArmatureNode> armature : _armatures) {
+        if (armature != NULL && !_is_synced(armature))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Block the worker until the next tick, returns false when stopped.
+ */
+bool PuppetMasterNode::wait_tick(unsigned long& tick) {
+    MutexHolder holder(_lock);
+    while (_is_running && _tick == tick)
+        _tick_cvar.wait();
+    tick = _tick;
+    return _is_running;
+}
+
+/**
+ * Run the jobs until all queues are empty.
+ */
+void PuppetMasterNode::run_jobs(unsigned int worker) {
+    unsigned int job;
+    while (_next_job(worker, job)) {
+        _run_job(job);
+        if (!AtomicAdjust::dec(_pending)) {  // the last job of the tick
+            MutexHolder holder(_lock);
+            _done_cvar.notify_all();
+        }
+    }
+}
+
+/**
+ * Own queue first, then steal from the other workers.
+ * The master thread has no queue of its own.
+ */
+bool PuppetMasterNode::_next_job(unsigned int worker, unsigned int& job) {
+    unsigned int num_puppets = _puppets.size();
+    if (worker < num_puppets && _puppets[worker]->pop_job(job))
+        return true;
+
+    for (unsigned int i = 1; i <= num_puppets; i++) {
+        unsigned int victim = (worker + i) % num_puppets;
+        if (victim != worker && _puppets[victim]->steal_job(job))
+            return true;
+    }
+    return false;
+}
+
+void PuppetMasterNode::_run_job(unsigned int job) {
+    AnimatorNode* animator = _animators[job];
+    ArmatureNode* armature_node = _armatures[job];
+    nassertv(armature_node == NULL || armature_node->has_bone_layout());  // built by build()
+
+    if (animator != NULL) {
+        if (_stages & PUPPET_UPDATE)
+            animator->update(_dt);
+        if (_stages & PUPPET_APPLY)
+            animator->apply();
+    }
+
+    if (armature_node != NULL)
+        _run_armature_stages(armature_node);
+}
+
+/**
+ * Buffered and deferred armatures get their bones and matrices in sync().
+ */
+bool PuppetMasterNode::_is_synced(ArmatureNode* armature_node) {
+    return armature_node->is_buffered() || armature_node->is_deferred();
+}
+
+void PuppetMasterNode::_run_armature_stages(ArmatureNode* armature_node) {
+    // chains are restored before the solvers, matrices of the final pose go last
+    if (_stages & PUPPET_RESET_IK)
+        armature_node->reset_ik();
+    if (_stages & PUPPET_WIGGLE)
+        armature_node->update_wiggle_bones(_root, _dt);
+    if (_stages & PUPPET_IK)
+        armature_node->update_ik();
+    if ((_stages & PUPPET_MATRICES) && !_is_synced(armature_node))
+        armature_node->update_shader_inputs();
+}
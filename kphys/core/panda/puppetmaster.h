@@ -1,19 +1,70 @@
 #ifndef PANDA_PUPPET_MASTER_H
 #define PANDA_PUPPET_MASTER_H
 
+#include "atomicAdjust.h"
+#include "conditionVar.h"
 #include "pandaNode.h"
+#include "pmutex.h"
+
+#include "kphys/core/panda/animator.h"
+#include "kphys/core/panda/armature.h"
 #include "kphys/core/panda/puppet.h"
 
 
+BEGIN_PUBLISH
+enum PUPPET_STAGE {
+    PUPPET_UPDATE = 1 << 0,  // advance the channels
+    PUPPET_APPLY = 1 << 1,  // write the pose into the armature
+    PUPPET_IK = 1 << 2,
+    PUPPET_WIGGLE = 1 << 3,
+    PUPPET_MATRICES = 1 << 4,  // update the shader inputs
+    PUPPET_RESET_IK = 1 << 5,  // restore the IK chains before the wiggle bones and IK
+    PUPPET_ALL = (1 << 6) - 1,
+};
+END_PUBLISH
+
 class EXPORT_CLASS PuppetMasterNode: public PandaNode {
  PUBLISHED:
-    PuppetMasterNode(const std::string name);
+    PuppetMasterNode(const std::string name, unsigned int num_workers=0);
     ~PuppetMasterNode();
     void build();
     void start();
+    void stop();
+    bool is_running();
+    void update(double dt);
+    void begin_update(double dt);
+    void finish_update();
+    void sync();
+    unsigned int get_num_workers();
+    unsigned int get_num_actors();
+    unsigned int get_stages();
+    void set_stages(unsigned int stages);
+    bool can_overlap();
+
+ public:
+    bool wait_tick(unsigned long& tick);
+    void run_jobs(unsigned int worker);
 
  private:
+    unsigned int _num_workers;
     pvector<PointerTo<Puppet>> _puppets;
+    pvector<PointerTo<AnimatorNode>> _animators;  // NULL for the armatures without animators
+    pvector<PointerTo<ArmatureNode>> _armatures;  // NULL if the animator has no armature
+    unsigned int _stages;
+    double _dt;
+    NodePath _root;  // wiggle bones are simulated in the space of the scene root
+
+    Mutex _lock;
+    ConditionVar _tick_cvar;  // workers wait for the next tick
+    ConditionVar _done_cvar;  // frame barrier, master waits for the jobs
+    unsigned long _tick;
+    bool _is_running;
+    AtomicAdjust::Integer _pending;  // unfinished jobs of the current tick
+
+    bool _next_job(unsigned int worker, unsigned int& job);
+    void _run_job(unsigned int job);
+    bool _is_synced(ArmatureNode* armature_node);
+    void _run_armature_stages(ArmatureNode* armature_node);
 
     static TypeHandle _type_handle;
 
@@ -0,0 +1,79 @@
+#include "clockObject.h"
+
+#include "kphys/core/panda/puppettask.h"
+
+
+TypeHandle PuppetTask::_type_handle;
+
+/**
+ * Runs the whole animation pipeline of the puppet master every frame,
+ * Python only adds the task and sets the stages:
+ * base.taskMgr.add(PuppetTask(master))
+ */
+PuppetTask::PuppetTask(PointerTo<PuppetMasterNode> master, const std::string name)
+        : AsyncTask(name)
+        , _master(master)
+        , _is_overlapped(false)
+        , _is_pending(false)
+        , _time_scale(1.0) {}
+
+PuppetTask::~PuppetTask() {
+    _master = NULL;
+}
+
+PointerTo<PuppetMasterNode> PuppetTask::get_master() {
+    return _master;
+}
+
+/**
+ * Overlapped task starts the tick and lets it run while the frame is rendered,
+ * the poses appear one frame later. Armatures should be buffered or deferred,
+ * otherwise the task falls back to the blocking update.
+ */
+void PuppetTask::set_overlapped(bool is_enabled) {
+    _is_overlapped = is_enabled;
+}
+
+bool PuppetTask::is_overlapped() {
+    return _is_overlapped;
+}
+
+void PuppetTask::set_time_scale(double scale) {
+    _time_scale = scale;
+}
+
+double PuppetTask::get_time_scale() {
+    return _time_scale;
+}
+
+AsyncTask::DoneStatus PuppetTask::do_task() {
+    double dt = ClockObject::get_global_clock()->get_dt() * _time_scale;
+
+    bool is_overlapped = _is_overlapped;
+    if (is_overlapped && !_master->can_overlap()) {
+        nassert_raise("overlapped puppets should have buffered or deferred armatures");
+        is_overlapped = false;
+    }
+
+    if (is_overlapped) {
+        if (_is_pending)
+            _master->finish_update();
+        _master->sync();
+        _master->begin_update(dt);
+        _is_pending = true;
+    } else {
+        if (_is_pending)
+            _master->finish_update();
+        _master->update(dt);
+        _master->sync();
+        _is_pending = false;
+    }
+    return DS_cont;
+}
+
+void PuppetTask::upon_death(AsyncTaskManager* manager, bool clean_exit) {
+    AsyncTask::upon_death(manager, clean_exit);
+    if (_is_pending)
+        _master->finish_update();
+    _is_pending = false;
+}
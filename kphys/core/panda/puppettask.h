@@ -0,0 +1,48 @@
+#ifndef PANDA_PUPPET_TASK_H
+#define PANDA_PUPPET_TASK_H
+
+#include "asyncTask.h"
+
+#include "kphys/core/panda/puppetmaster.h"
+
+
+class EXPORT_CLASS PuppetTask: public AsyncTask {
+PUBLISHED:
+    PuppetTask(PointerTo<PuppetMasterNode> master, const std::string name="puppets");
+    ~PuppetTask();
+    PointerTo<PuppetMasterNode> get_master();
+    void set_overlapped(bool is_enabled);
+    bool is_overlapped();
+    void set_time_scale(double scale);
+    double get_time_scale();
+
+protected:
+    virtual DoneStatus do_task();
+    virtual void upon_death(AsyncTaskManager* manager, bool clean_exit);
+
+private:
+    PointerTo<PuppetMasterNode> _master;
+    bool _is_overlapped;
+    bool _is_pending;  // tick started by the previous frame
+    double _time_scale;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        AsyncTask::init_type();
+        register_type(_type_handle, "PuppetTask", AsyncTask::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
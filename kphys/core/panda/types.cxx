@@ -1,3 +1,6 @@
+#include <math.h>
+#include <string.h>
+
 #include "bulletRigidBodyNode.h"
 
 #include "kphys/core/panda/animator.h"
@@ -9,12 +12,79 @@
 #include "kphys/core/panda/types.h"
 
 
-LMatrix4 get_matrix(LMatrix4Array* array, unsigned short i) {
-    return array->matrices[i];
+/**
+ * Convert 32-bit float to 16-bit half float (IEEE 754).
+ * Rounds to nearest, flushes values below the half float range to zero.
+ */
+unsigned short float_to_half(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    unsigned short sign = (bits >> 16) & 0x8000;
+    int exponent = ((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x007fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff)  // infinity or NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 0x1f)  // overflow
+        return sign | 0x7c00;
+    if (exponent <= 0) {  // subnormal or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x00800000;
+        unsigned int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)  // round
+            half++;
+        return sign | half;
+    }
+
+    unsigned short half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x00001000)  // round, may carry into exponent
+        half++;
+    return half;
 }
 
-void set_matrix(LMatrix4Array* array, unsigned short i, LMatrix4 matrix) {
-    array->matrices[i] = matrix;
+/**
+ * Pack unit quaternion into 48 bits: index of the largest component
+ * in the top bits of the first two values and the other three components
+ * quantized to 15 bits in [-1/sqrt(2), 1/sqrt(2)] range.
+ */
+void quat_to_smallest_three(const LQuaternion& quat, unsigned short* packed) {
+    unsigned int largest = 0;
+    for (unsigned int c = 1; c < 4; c++) {
+        if (fabs(quat[c]) > fabs(quat[largest]))
+            largest = c;
+    }
+    // q and -q are the same rotation, keep the largest component positive
+    float sign = (quat[largest] < 0) ? -1.0f : 1.0f;
+
+    unsigned int i = 0;
+    for (unsigned int c = 0; c < 4; c++) {
+        if (c == largest)
+            continue;
+        float value = (sign * quat[c] * (float) M_SQRT2 + 1.0f) * 0.5f;
+        value = MIN(MAX(value, 0.0f), 1.0f);
+        packed[i++] = (unsigned short) lrintf(value * 0x7fff);
+    }
+    packed[0] |= (largest >> 1) << 15;
+    packed[1] |= (largest & 1) << 15;
+}
+
+LQuaternion smallest_three_to_quat(const unsigned short* packed) {
+    unsigned int largest = ((packed[0] >> 15) << 1) | (packed[1] >> 15);
+    LQuaternion quat;
+    float sum = 0;
+    unsigned int i = 0;
+    for (unsigned int c = 0; c < 4; c++) {
+        if (c == largest)
+            continue;
+        float value = ((packed[i++] & 0x7fff) / (float) 0x7fff * 2.0f - 1.0f) / (float) M_SQRT2;
+        quat[c] = value;
+        sum += value * value;
+    }
+    quat[largest] = sqrtf(MAX(1.0f - sum, 0.0f));
+    return quat;
 }
 
 bool is_armature(NodePath np) {
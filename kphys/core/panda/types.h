@@ -5,13 +5,14 @@
 #include "nodePath.h"
 #include "pmap.h"
 
-#define MAX_BONES 256
 #define FLOAT_SIZE 4
 #define MAT4_SIZE (MAT4_WIDTH * MAT4_HEIGHT * FLOAT_SIZE)
 #define MAT4_WIDTH 4
 #define MAT4_HEIGHT 4
 #define RGBA_CHANNEL_COUNT 4
 #define RGBA_MAT4_SIZE ((MAT4_WIDTH * MAT4_HEIGHT) / RGBA_CHANNEL_COUNT)
+#define HALF_FLOAT_SIZE 2
+#define SMALLEST_THREE_SIZE 3  // 48-bit quaternion as 3 unsigned shorts
 
 #define MAX(a, b) (a > b ? a : b)
 #define MIN(a, b) (a < b ? a : b)
@@ -20,13 +21,9 @@
 // #define KDICT pmap
 #define KDICT std::unordered_map
 
-typedef union LMatrix4Array {
-    LMatrix4 matrices[MAX_BONES];
-    unsigned char data[MAT4_SIZE * MAX_BONES];
-} LMatrix4Array;
-
-LMatrix4 get_matrix(LMatrix4Array* array, unsigned short i);
-void set_matrix(LMatrix4Array* array, unsigned short i, LMatrix4 matrix);
+unsigned short float_to_half(float value);
+void quat_to_smallest_three(const LQuaternion& quat, unsigned short* packed);
+LQuaternion smallest_three_to_quat(const unsigned short* packed);
 bool is_armature(NodePath np);
 bool is_bone(NodePath np);
 bool is_wiggle_bone(NodePath np);
@@ -112,17 +112,15 @@ void WiggleBoneNode::set_max_degrees(double value) {
 
 /**
  * Process bone transform input to calculate acceleration,
- * update it using calculated point mass and apply it to bone.
+ * update it using calculated point mass and return the new bone matrix.
  */
-void WiggleBoneNode::_process(NodePath root, LMatrix4 bone_pose, double delta) {
-    NodePath np = NodePath::any_path(this);
-
+LMatrix4 WiggleBoneNode::_process(const LMatrix4& parent_mat, LMatrix4 bone_pose, double delta) {
     // may be 0.0 on first frame
     if (delta == 0.0)
         delta = 1.0 / 60.0;
 
     // panda -> phys
-    LMatrix4 global_bone_pose = np.get_parent().get_mat(root) * bone_pose;
+    LMatrix4 global_bone_pose = parent_mat * bone_pose;
     LMatrix4 invert_global_bone_pose;
     invert_global_bone_pose.invert_from(global_bone_pose);
     _global_to_pose = invert_global_bone_pose.get_upper_3();
@@ -136,7 +134,7 @@ void WiggleBoneNode::_process(NodePath root, LMatrix4 bone_pose, double delta) {
     _acceleration /= MIN(MAX(delta_factor, 1.0), 3.0);  // TODO: adjust for rates higher than 60 fps
 
     // phys -> panda
-    np.set_mat(_pose() * bone_pose);
+    return _pose() * bone_pose;
 }
 
 
@@ -247,8 +245,24 @@ LMatrix4 WiggleBoneNode::_pose() {
 }
 
 void WiggleBoneNode::update(NodePath root, LMatrix4 bone_pose, double delta) {
+    NodePath::any_path(this).set_mat(simulate(root, bone_pose, delta));
+}
+
+/**
+ * Same as update, but returns the new local matrix instead of setting it.
+ */
+LMatrix4 WiggleBoneNode::simulate(NodePath root, LMatrix4 bone_pose, double delta) {
+    NodePath np = NodePath::any_path(this);
+    return simulate(np.get_parent().get_mat(root), bone_pose, delta);
+}
+
+/**
+ * Same as simulate, but takes the parent matrix relative to the root,
+ * so the parent doesn't have to be written into the node yet.
+ */
+LMatrix4 WiggleBoneNode::simulate(const LMatrix4& parent_mat, LMatrix4 bone_pose, double delta) {
     _physics_process(delta);
-    _process(root, bone_pose, delta);
+    return _process(parent_mat, bone_pose, delta);
 }
 
 LVecBase3 _project_to_vector_plane(
@@ -61,6 +61,8 @@ PUBLISHED:
 
     void reset();
     void update(NodePath root, LMatrix4 bone_pose, double delta);
+    LMatrix4 simulate(NodePath root, LMatrix4 bone_pose, double delta);
+    LMatrix4 simulate(const LMatrix4& parent_mat, LMatrix4 bone_pose, double delta);
 
 private:
     int _wb_mode = WIGGLEBONE_MODE_ROTATION;
@@ -78,7 +80,7 @@ private:
     LVecBase3 _prev_mass_center;
     LVecBase3 _prev_velocity;
 
-    void _process(NodePath root, LMatrix4 bone_pose, double delta);
+    LMatrix4 _process(const LMatrix4& parent_mat, LMatrix4 bone_pose, double delta);
     void _physics_process(double delta);
     LVecBase3 _update_acceleration(const LMatrix4& global_bone_pose, double delta);
     void _solve(
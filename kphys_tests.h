@@ -1,13 +1,46 @@
 #include <cxxtest/TestSuite.h>
 
+#include "kphys/core/panda/animation.h"
+#include "kphys/core/panda/animationcache.h"
+#include "kphys/core/panda/armature.h"
+#include "kphys/core/panda/bone.h"
+#include "kphys/core/panda/bonecommands.h"
+#include "kphys/core/panda/bonemask.h"
+#include "kphys/core/panda/bonepalette.h"
+#include "kphys/core/panda/blendtree.h"
+#include "kphys/core/panda/bvhq.h"
+#include "kphys/core/panda/channel.h"
+#include "kphys/core/panda/clipfile.h"
+#include "kphys/core/panda/effector.h"
 #include "kphys/core/panda/hit.h"
 #include "kphys/core/panda/frame.h"
 #include "kphys/core/panda/hitbox.h"
+#include "kphys/core/panda/pose.h"
 #include "bulletBoxShape.h"
 #include "bulletGhostNode.h"
 #include "pandaNode.h"
 #include "transformState.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**
+   Node which logs the order of its transform changes.
+*/
+class OrderNode : public PandaNode {
+public:
+    OrderNode(const std::string name, pvector<std::string>* log): PandaNode(name), _log(log) {}
+
+protected:
+    virtual void transform_changed() {
+        PandaNode::transform_changed();
+        _log->push_back(get_name());
+    }
+
+private:
+    pvector<std::string>* _log;
+};
 
 
 class ChaosTest : public CxxTest::TestSuite {
@@ -172,4 +205,514 @@ public:
         frame_b->reset();
         frame_dest->reset();
     }
+
+    void test_pose_mix_into(void) {
+        PointerTo<BoneLayout> layout = new BoneLayout();
+        layout->add_bone("bone1");
+        layout->add_bone("bone2");
+
+        PointerTo<Frame> frame_a = new Frame();
+        PointerTo<Frame> frame_b = new Frame();
+        frame_a->set_transform(
+            "bone1", TransformState::make_pos(LVecBase3(1, 2, 3)), TRANSFORM_POS);
+        frame_a->set_transform(
+            "bone3", TransformState::make_pos(LVecBase3(1, 2, 3)), TRANSFORM_POS);
+        frame_b->set_transform(
+            "bone1", TransformState::make_pos(LVecBase3(4, 5, 6)), TRANSFORM_POS);
+        frame_b->set_transform(
+            "bone2", TransformState::make_hpr(LVecBase3(90, 0, 0)), TRANSFORM_HPR);
+
+        PointerTo<Pose> pose_a = new Pose(layout);
+        PointerTo<Pose> pose_b = new Pose(layout);
+        PointerTo<Pose> pose_dest = new Pose(layout);
+        pose_a->load_frame(frame_a);
+        pose_b->load_frame(frame_b);
+
+        // bones missing in the layout are skipped, HPR is converted to quat
+        TS_ASSERT_EQUALS(pose_a->get_num_bones(), 2);
+        TS_ASSERT_EQUALS(pose_b->get_transform_flags(1), TRANSFORM_QUAT);
+
+        // Mix pose_a and pose_b into pose_dest with a factor of 0.5
+        pose_a->mix_into(*pose_dest.p(), pose_b, 0.5);
+
+        LVecBase3 expected_pos = LVecBase3(2.5, 3.5, 4.5);
+        TS_ASSERT_EQUALS(pose_dest->get_pos(0), expected_pos);
+        TS_ASSERT(!pose_dest->has_transform(1));  // missing in pose_a, can't mix
+    }
+
+    static PointerTo<Animation> make_clip(void) {
+        PointerTo<Animation> animation = new Animation("animation");
+        for (unsigned int i = 0; i < 100; i++) {
+            PointerTo<Frame> frame = new Frame();
+            LQuaternion quat;
+            quat.set_hpr(LVecBase3(i * 0.9, 0, 0));
+            frame->set_transform(
+                "bone1", TransformState::make_pos_quat_scale(
+                    LVecBase3(i * 0.1, 0, 1), quat, LVecBase3(1, 1, 1)),
+                TRANSFORM_POS | TRANSFORM_QUAT);
+            animation->add_frame(frame);
+        }
+        return animation;
+    }
+
+    void test_animation_compress(void) {
+        PointerTo<Animation> animation = make_clip();
+        size_t data_size = animation->get_data_size();
+        animation->compress(0.001, 0.001);
+
+        // linear motion is reduced to the first and the last keys
+        TS_ASSERT(animation->is_compressed());
+        TS_ASSERT_LESS_THAN(animation->get_data_size(), data_size / 10);
+
+        PointerTo<Frame> frame = animation->get_frame(50);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_pos().get_x(), 5.0, 0.001);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_hpr().get_x(), 45.0, 0.1);
+
+        // empty clip is left as is
+        PointerTo<Animation> empty = new Animation("empty");
+        empty->compress(0.001, 0.001);
+        TS_ASSERT(!empty->is_compressed());
+    }
+
+    void test_animation_compress_range(void) {
+        // 16-bit steps over 1000 units are larger than the tolerance
+        PointerTo<Animation> animation = new Animation("animation");
+        for (unsigned int i = 0; i < 10; i++) {
+            PointerTo<Frame> frame = new Frame();
+            frame->set_transform(
+                "bone1", TransformState::make_pos(LVecBase3((i % 2) ? 1000.0 : 0.0123, 0, 0)),
+                TRANSFORM_POS);
+            animation->add_frame(frame);
+        }
+        animation->compress(0.001, 0.001);
+        TS_ASSERT(!animation->is_compressed());
+        PointerTo<Frame> frame = animation->get_frame(2);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_pos().get_x(), 0.0123, 0.0001);
+    }
+
+    static void patch_file(Filename filename, long offset, const void* data, size_t size) {
+        FILE* file = fopen(filename.to_os_specific().c_str(), "r+b");
+        fseek(file, offset, SEEK_SET);
+        fwrite(data, 1, size, file);
+        fclose(file);
+    }
+
+    void test_clip_file(void) {
+        Filename filename = Filename::temporary("", "kphys_test_", ".clip");
+        PointerTo<Animation> animation = make_clip();
+
+        // uncompressed round trip
+        TS_ASSERT(ClipFile::write(animation, filename));
+        PointerTo<ClipFile> clip = new ClipFile("clip", filename);
+        TS_ASSERT(clip->is_valid());
+        TS_ASSERT(!clip->is_compressed());
+        TS_ASSERT_EQUALS(clip->get_num_frames(), 100ul);
+        PointerTo<Frame> frame = clip->get_frame(50);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_pos().get_x(), 5.0, 0.001);
+        clip = NULL;
+
+        // compressed round trip
+        animation->compress(0.001, 0.001);
+        TS_ASSERT(ClipFile::write(animation, filename));
+        clip = new ClipFile("clip", filename);
+        TS_ASSERT(clip->is_valid());
+        TS_ASSERT(clip->is_compressed());
+        frame = clip->get_frame(50);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_pos().get_x(), 5.0, 0.001);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_hpr().get_x(), 45.0, 0.1);
+
+        // rewrite while the file is mapped, the loaded clip keeps the old data
+        TS_ASSERT(ClipFile::write(animation, filename));
+        frame = clip->get_frame(50);
+        TS_ASSERT_DELTA(frame->get_transform("bone1")->get_pos().get_x(), 5.0, 0.001);
+        clip = NULL;
+
+        // key frames out of order
+        ClipFileHeader header;
+        FILE* file = fopen(filename.to_os_specific().c_str(), "rb");
+        TS_ASSERT_EQUALS(fread(&header, sizeof(header), 1, file), 1u);
+        fclose(file);
+        uint32_t key_frame = 1;
+        patch_file(filename, header.pos_key_frames_offset, &key_frame, sizeof(key_frame));
+        clip = new ClipFile("clip", filename);
+        TS_ASSERT(!clip->is_valid());
+        clip = NULL;
+
+        // key frames past the end of the clip
+        key_frame = 0;
+        patch_file(filename, header.pos_key_frames_offset, &key_frame, sizeof(key_frame));
+        key_frame = 100;
+        patch_file(
+            filename, header.pos_key_frames_offset + (header.num_pos_keys - 1) * 4,
+            &key_frame, sizeof(key_frame));
+        clip = new ClipFile("clip", filename);
+        TS_ASSERT(!clip->is_valid());
+        clip = NULL;
+
+        // truncated file
+        TS_ASSERT(ClipFile::write(animation, filename));
+        TS_ASSERT_EQUALS(truncate(filename.to_os_specific().c_str(), header.quat_keys_offset), 0);
+        clip = new ClipFile("clip", filename);
+        TS_ASSERT(!clip->is_valid());
+        clip = NULL;
+
+        // corrupt header
+        TS_ASSERT_EQUALS(truncate(filename.to_os_specific().c_str(), sizeof(header) - 1), 0);
+        clip = new ClipFile("clip", filename);
+        TS_ASSERT(!clip->is_valid());
+        clip = NULL;
+
+        filename.unlink();
+    }
+
+    void test_animation_cache_evict(void) {
+        Filename filename_a = Filename::temporary("", "kphys_test_", ".kclip");
+        Filename filename_b = Filename::temporary("", "kphys_test_", ".kclip");
+        TS_ASSERT(ClipFile::write(make_clip(), filename_a));
+        TS_ASSERT(ClipFile::write(make_clip(), filename_b));
+
+        AnimationCache* cache = AnimationCache::get_global_ptr();
+        size_t budget = cache->get_budget();
+        cache->clear();
+        cache->set_budget(1);
+
+        // used animations are kept over the budget
+        PointerTo<Animation> animation_a = cache->load(filename_a);
+        PointerTo<Animation> animation_b = cache->load(filename_b);
+        TS_ASSERT(animation_a != NULL && animation_b != NULL);
+        TS_ASSERT_EQUALS(cache->load(filename_a), animation_a);
+        TS_ASSERT_EQUALS(cache->get_num_animations(), 2u);
+        size_t size_b = cache->get_animation_size(filename_b);
+        TS_ASSERT_EQUALS(
+            cache->get_resident_size(), cache->get_animation_size(filename_a) + size_b);
+
+        // unused animation is evicted
+        animation_a = NULL;
+        cache->evict();
+        TS_ASSERT_EQUALS(cache->get_num_animations(), 1u);
+        TS_ASSERT(!cache->has_animation(filename_a));
+        TS_ASSERT(cache->has_animation(filename_b));
+        TS_ASSERT_EQUALS(cache->get_resident_size(), size_b);
+
+        animation_b = NULL;
+        cache->set_budget(budget);
+        cache->clear();
+        TS_ASSERT_EQUALS(cache->get_num_animations(), 0u);
+        TS_ASSERT_EQUALS(cache->get_resident_size(), 0u);
+        filename_a.unlink();
+        filename_b.unlink();
+    }
+
+    void test_bvhq_parse(void) {
+        // second frame misses the rotation values, third frame is truncated
+        const char* text =
+            "HIERARCHY\n"
+            "ROOT root\n"
+            "{\n"
+            "    OFFSET 0 0 0\n"
+            "    CHANNELS 6 Xposition Yposition Zposition Xrotation Yrotation Zrotation\n"
+            "    JOINT child\n"
+            "    {\n"
+            "        OFFSET 0 0 1\n"
+            "        CHANNELS 4 Irotation Jrotation Krotation Rrotation\n"
+            "    }\n"
+            "}\n"
+            "MOTION\n"
+            "Frames: 3\n"
+            "Frame Time: 0.1\n"
+            "1 2 3 90 0 0 0 0 0.7071068 0.7071068\n"
+            "4 5 6 0 0 0 0 0\n";
+        Filename filename = Filename::temporary("", "kphys_test_", ".bvhq");
+        FILE* file = fopen(filename.to_os_specific().c_str(), "wb");
+        fwrite(text, 1, strlen(text), file);
+        fclose(file);
+
+        PointerTo<BVHQ> bvhq = new BVHQ("bvhq", filename);
+        filename.unlink();
+        TS_ASSERT(bvhq->is_valid());
+        TS_ASSERT_EQUALS(bvhq->get_num_bones(), 2u);
+        TS_ASSERT_EQUALS(bvhq->get_num_frames(), 2ul);
+
+        // HPR and quaternion channels
+        PointerTo<Frame> frame = bvhq->get_frame(0);
+        ConstPointerTo<TransformState> root = frame->get_transform("root");
+        ConstPointerTo<TransformState> child = frame->get_transform("child");
+        TS_ASSERT(root->get_pos().almost_equal(LVecBase3(1, 2, 3), 0.001));
+        TS_ASSERT(root->get_hpr().almost_equal(LVecBase3(90, 0, 0), 0.01));
+        TS_ASSERT(child->get_hpr().almost_equal(LVecBase3(90, 0, 0), 0.01));
+
+        // missing values are identities
+        frame = bvhq->get_frame(1);
+        root = frame->get_transform("root");
+        child = frame->get_transform("child");
+        TS_ASSERT(root->get_pos().almost_equal(LVecBase3(4, 5, 6), 0.001));
+        TS_ASSERT(root->get_hpr().almost_equal(LVecBase3(0, 0, 0), 0.01));
+        TS_ASSERT(child->get_quat().almost_equal(LQuaternion::ident_quat(), 0.001));
+    }
+
+    void test_pose_blend_mask(void) {
+        PointerTo<BoneLayout> layout = new BoneLayout();
+        layout->add_bone("spine");
+        layout->add_bone("leg");
+        layout->add_bone("arm");
+
+        PointerTo<Pose> pose = new Pose(layout);
+        PointerTo<Pose> layer = new Pose(layout);
+        LQuaternion quat = LQuaternion::ident_quat();
+        pose->set_transform(0, LVecBase3(0, 0, 0), quat, TRANSFORM_POS);
+        pose->set_transform(1, LVecBase3(0, 0, 0), quat, TRANSFORM_POS);
+        layer->set_transform(0, LVecBase3(2, 0, 0), quat, TRANSFORM_POS);
+        layer->set_transform(1, LVecBase3(2, 0, 0), quat, TRANSFORM_POS);
+        layer->set_transform(2, LVecBase3(2, 0, 0), quat, TRANSFORM_POS);
+
+        // upper body layer
+        PointerTo<BoneMask> mask = new BoneMask();
+        mask->exclude_bone("leg");
+        pose->blend(*layer, 0.5, BLEND_NLERP, mask->get_bits(layout));
+
+        TS_ASSERT_EQUALS(pose->get_pos(0), LVecBase3(1, 0, 0));  // blended
+        TS_ASSERT_EQUALS(pose->get_pos(1), LVecBase3(0, 0, 0));  // masked out
+        TS_ASSERT_EQUALS(pose->get_pos(2), LVecBase3(2, 0, 0));  // missing, copied
+
+        // partial weight scales the layer factor
+        mask->set_bone_weight("spine", 0.5);
+        TS_ASSERT_EQUALS(mask->get_bone_weight("spine"), 0.5f);
+        TS_ASSERT_EQUALS(mask->get_bone_weight("leg"), 0.0f);
+        pose->set_transform(0, LVecBase3(0, 0, 0), quat, TRANSFORM_POS);
+        pose->blend(*layer, 0.5, BLEND_NLERP, mask->get_bits(layout), mask->get_weights(layout));
+        TS_ASSERT_EQUALS(pose->get_pos(0), LVecBase3(0.5, 0, 0));
+        TS_ASSERT_EQUALS(pose->get_pos(1), LVecBase3(0, 0, 0));
+    }
+
+    void test_bone_mask_cache(void) {
+        PointerTo<BoneLayout> layout = new BoneLayout();
+        layout->add_bone("spine");
+        layout->add_bone("leg");
+
+        PointerTo<BoneMask> mask = new BoneMask();
+        mask->exclude_bone("leg");
+        PointerTo<CompiledBoneMask> cache;
+        CompiledBoneMask* compiled = mask->get_compiled(layout, cache);
+        TS_ASSERT(compiled->get_bits() != NULL);
+        TS_ASSERT(!is_bone_in_mask(compiled->get_bits(), 1));
+        TS_ASSERT(compiled->get_weights() == NULL);
+        TS_ASSERT_EQUALS(mask->get_compiled(layout, cache), compiled);  // cached
+
+        // changed lists refill the cache
+        mask->include_bone("leg");
+        compiled = mask->get_compiled(layout, cache);
+        TS_ASSERT(compiled->get_bits() == NULL);
+
+        // other layout gets its own mask
+        PointerTo<BoneLayout> other = new BoneLayout();
+        other->add_bone("leg");
+        mask->set_bone_weight("leg", 0.25);
+        compiled = mask->get_compiled(other, cache);
+        TS_ASSERT_EQUALS(compiled->get_weights()[0], 0.25f);
+    }
+
+    void test_bone_commands(void) {
+        pvector<std::string> log;
+        PointerTo<PandaNode> parent = new OrderNode("parent", &log);
+        PointerTo<PandaNode> child = new OrderNode("child", &log);
+
+        PointerTo<BoneCommandBuffer> commands = new BoneCommandBuffer();
+        commands->set_transform(child, 1, TransformState::make_pos(LVecBase3(1, 0, 0)));
+        commands->set_transform(parent, 0, TransformState::make_pos(LVecBase3(2, 0, 0)));
+        commands->set_transform(child, 1, TransformState::make_pos(LVecBase3(3, 0, 0)));
+        TS_ASSERT_EQUALS(commands->get_num_commands(), 3u);
+
+        // parents go first, only the last write of the node is applied
+        TS_ASSERT_EQUALS(commands->commit(), 2u);
+        TS_ASSERT_EQUALS(log.size(), 2u);
+        TS_ASSERT_EQUALS(log[0], "parent");
+        TS_ASSERT_EQUALS(log[1], "child");
+        TS_ASSERT_EQUALS(parent->get_transform()->get_pos(), LVecBase3(2, 0, 0));
+        TS_ASSERT_EQUALS(child->get_transform()->get_pos(), LVecBase3(3, 0, 0));
+        TS_ASSERT_EQUALS(commands->get_num_commands(), 0u);
+    }
+
+    void test_bone_palette_untouched_block(void) {
+        PointerTo<BonePalette> palette = new BonePalette("palette", BONE_FORMAT_MAT4, false, 4);
+        unsigned int offset_a = palette->allocate(2);
+        unsigned int offset_b = palette->allocate(2);
+        unsigned int bone_size = get_bone_size(BONE_FORMAT_MAT4, false);
+
+        float* cur = (float*) palette->get_data(true);
+        cur[offset_a * bone_size / 4] = 1.0f;
+        cur[offset_b * bone_size / 4] = 2.0f;
+        palette->mark_modified(offset_a, 2);
+        palette->mark_modified(offset_b, 2);
+        palette->update();
+
+        // only the block A is written, B keeps its last transforms
+        cur = (float*) palette->get_data(true);
+        cur[offset_a * bone_size / 4] = 3.0f;
+        palette->mark_modified(offset_a, 2);
+        palette->update();
+
+        const float* uploaded = (const float*) palette->get_data(false);
+        const float* previous = (const float*) palette->get_data(true);
+        TS_ASSERT_EQUALS(uploaded[offset_a * bone_size / 4], 3.0f);
+        TS_ASSERT_EQUALS(uploaded[offset_b * bone_size / 4], 2.0f);
+        TS_ASSERT_EQUALS(previous[offset_b * bone_size / 4], 2.0f);
+    }
+
+    void test_armature_direct_pose(void) {
+        PointerTo<ArmatureNode> armature = new ArmatureNode("armature");
+        NodePath armature_np(armature);
+        NodePath bone_np = armature_np.attach_new_node(new BoneNode("bone1", 0));
+        armature->rebuild_bind_pose();
+        PointerTo<BonePalette> palette = new BonePalette("palette", BONE_FORMAT_MAT4, false, 4);
+        armature->set_palette(palette);
+        armature->set_direct_pose(true);
+        armature->prepare();
+
+        PointerTo<Pose> pose = new Pose(armature->get_bone_layout());
+        pose->set_transform(0, LVecBase3(1, 0, 0), LQuaternion::ident_quat(), TRANSFORM_POS);
+        armature->apply(pose);
+        TS_ASSERT(bone_np.get_pos().almost_equal(LVecBase3(0, 0, 0)));
+
+        // the pose is kept by the following updates
+        unsigned int offset = armature->get_bone_offset() * get_bone_size(BONE_FORMAT_MAT4, false) / 4;
+        for (unsigned int i = 0; i < 2; i++) {
+            armature->update_shader_inputs();
+            const float* data = (const float*) palette->get_data(true) + offset;
+            TS_ASSERT_DELTA(data[12], 1.0f, 0.0001f);  // translation row
+        }
+
+        // bone written after the pose keeps the node transform
+        bone_np.set_pos(2, 0, 0);
+        armature->update_shader_inputs();
+        const float* data = (const float*) palette->get_data(true) + offset;
+        TS_ASSERT_DELTA(data[12], 2.0f, 0.0001f);
+    }
+
+    void test_armature_effectors(void) {
+        PointerTo<ArmatureNode> armature_a = new ArmatureNode("a");
+        PointerTo<ArmatureNode> armature_b = new ArmatureNode("b");
+        NodePath np_a(armature_a);
+        NodePath np_b(armature_b);
+        NodePath bone_np = np_a.attach_new_node(new BoneNode("bone1", 0));
+        TS_ASSERT_EQUALS(armature_a->get_num_effectors(), 0u);
+        TS_ASSERT_EQUALS(armature_b->get_num_effectors(), 0u);
+
+        // attached and removed effectors are tracked by their armature
+        NodePath effector_np = bone_np.attach_new_node(new EffectorNode("effector"));
+        TS_ASSERT_EQUALS(armature_a->get_num_effectors(), 1u);
+        TS_ASSERT_EQUALS(armature_b->get_num_effectors(), 0u);
+        effector_np.reparent_to(np_b);
+        TS_ASSERT_EQUALS(armature_a->get_num_effectors(), 0u);
+        TS_ASSERT_EQUALS(armature_b->get_num_effectors(), 1u);
+        effector_np.detach_node();
+        TS_ASSERT_EQUALS(armature_b->get_num_effectors(), 0u);
+    }
+
+    void test_armature_recorded_bones(void) {
+        PointerTo<ArmatureNode> armature = new ArmatureNode("armature");
+        NodePath armature_np(armature);
+        NodePath bone1_np = armature_np.attach_new_node(new BoneNode("bone1", 0));
+        NodePath bone2_np = bone1_np.attach_new_node(new BoneNode("bone2", 1));
+        bone2_np.set_pos(0, 1, 0);
+        armature->rebuild_bind_pose();
+        armature->set_deferred(true);
+        armature->prepare();
+
+        PointerTo<Pose> pose = new Pose(armature->get_bone_layout());
+        int slot = armature->get_bone_layout()->find_bone("bone1");
+        pose->set_transform(slot, LVecBase3(1, 0, 0), LQuaternion::ident_quat(), TRANSFORM_POS);
+        armature->apply(pose);
+        TS_ASSERT(bone1_np.get_pos().almost_equal(LVecBase3(0, 0, 0)));
+
+        // reads see the recorded pose, writes are recorded on top of it
+        CPT(TransformState) transform = armature->get_bone_transform(bone2_np, armature_np);
+        TS_ASSERT(transform->get_pos().almost_equal(LVecBase3(1, 1, 0)));
+        armature->set_bone_pos(bone2_np, armature_np, LVecBase3(5, 0, 0));
+        TS_ASSERT(bone2_np.get_pos().almost_equal(LVecBase3(0, 1, 0)));
+
+        TS_ASSERT_EQUALS(armature->commit(), 2u);
+        TS_ASSERT(bone1_np.get_pos().almost_equal(LVecBase3(1, 0, 0)));
+        TS_ASSERT(bone2_np.get_pos().almost_equal(LVecBase3(4, 0, 0)));
+    }
+
+    static PointerTo<Animation> make_still_clip(const std::string name, double x) {
+        PointerTo<Animation> animation = new Animation(name);
+        for (unsigned int i = 0; i < 2; i++) {
+            PointerTo<Frame> frame = new Frame();
+            frame->set_transform(
+                "bone1", TransformState::make_pos(LVecBase3(x, 0, 0)), TRANSFORM_POS);
+            animation->add_frame(frame);
+        }
+        animation->set_frame_time(1.0 / 30);
+        return animation;
+    }
+
+    void test_clip_blend_node_reverse(void) {
+        PointerTo<Animation> animation = make_clip();
+        animation->set_frame_time(1.0 / 30);
+        PointerTo<ClipBlendNode> node = new ClipBlendNode("clip", animation);
+        node->set_speed(-1.0);
+
+        // looping clip wraps around to the end
+        node->set_frame_index(1.0);
+        node->update(2.0 / 30);
+        TS_ASSERT_DELTA(node->get_frame_index(), 99.0, 0.0001);
+        node->update(1.0 / 30);
+        TS_ASSERT_DELTA(node->get_frame_index(), 98.0, 0.0001);
+
+        // other clips stop at the first frame
+        animation->set_loop(false);
+        node->set_frame_index(1.0);
+        node->update(2.0 / 30);
+        TS_ASSERT_DELTA(node->get_frame_index(), 0.0, 0.0001);
+    }
+
+    void test_channel_inertialize(void) {
+        PointerTo<BoneLayout> layout = new BoneLayout();
+        layout->add_bone("bone1");
+        Pose pose(layout);
+
+        PointerTo<Channel> channel = new Channel("channel");
+        channel->set_transition_mode(TRANSITION_INERTIALIZE);
+        channel->set_blending_time(1.0);
+        channel->push_animation(make_still_clip("source", 0.0));
+        channel->switch_animation();
+
+        // the output of slot A is recorded while nothing is pushed
+        for (unsigned int i = 0; i < 2; i++) {
+            channel->update(0.1);
+            pose.reset();
+            TS_ASSERT(channel->save_pose(pose, channel->get_output_slot()));
+            channel->inertialize(pose);
+        }
+
+        // the transition starts at the source pose
+        channel->push_animation(make_still_clip("target", 10.0));
+        TS_ASSERT_EQUALS(channel->get_output_slot(), SLOT_B);
+        pose.reset();
+        TS_ASSERT(channel->save_pose(pose, SLOT_B));
+        channel->inertialize(pose);
+        TS_ASSERT_DELTA(pose.get_pos(0).get_x(), 0.0, 0.001);
+
+        // quintic decay, 3/16 of the offset is left halfway
+        channel->update(0.5);
+        pose.reset();
+        TS_ASSERT(channel->save_pose(pose, SLOT_B));
+        channel->inertialize(pose);
+        TS_ASSERT_DELTA(pose.get_pos(0).get_x(), 8.125, 0.001);
+
+        // the offset fades out before the end, there is no step
+        channel->update(0.45);
+        pose.reset();
+        TS_ASSERT(channel->save_pose(pose, SLOT_B));
+        channel->inertialize(pose);
+        TS_ASSERT_DELTA(pose.get_pos(0).get_x(), 10.0, 0.001);
+
+        // and ends at the target pose
+        channel->update(0.05);
+        pose.reset();
+        TS_ASSERT(channel->save_pose(pose, SLOT_B));
+        channel->inertialize(pose);
+        TS_ASSERT_DELTA(pose.get_pos(0).get_x(), 10.0, 0.001);
+    }
 };
@@ -8,6 +8,11 @@ in vec4 p3d_Vertex;
 in vec4 transform_weight;
 in uvec4 transform_index;
 uniform samplerBuffer bone_transform_tex;
+uniform int bone_offset;
+#ifdef BONE_INSTANCED
+// BonePalette.allocate_instances(), instances follow each other
+uniform int num_bones;
+#endif
 
 uniform mat4 p3d_ModelMatrix;
 uniform mat4 p3d_ViewProjectionMatrix;
@@ -18,14 +23,60 @@ out vec3 vert_normal;
 out vec3 vert_position;
 
 
+// ArmatureNode.set_bone_format(), half float textures need no changes
+#define BONE_FORMAT_MAT4 0
+#define BONE_FORMAT_MAT3X4 1
+#define BONE_FORMAT_DUAL_QUAT 2
+#ifndef BONE_FORMAT
+#define BONE_FORMAT BONE_FORMAT_MAT4
+#endif
+
+
+int get_bone_index(int bone_id) {
+#ifdef BONE_INSTANCED
+    return bone_offset + gl_InstanceID * num_bones + bone_id;
+#else
+    return bone_offset + bone_id;
+#endif
+}
+
+
+#if BONE_FORMAT == BONE_FORMAT_MAT3X4
+mat4 get_transform_matrix(int bone_id) {
+    int index = get_bone_index(bone_id) * 3;
+    vec4 col0 = texelFetch(bone_transform_tex, index);
+    vec4 col1 = texelFetch(bone_transform_tex, index + 1);
+    vec4 col2 = texelFetch(bone_transform_tex, index + 2);
+    return transpose(mat4(col0, col1, col2, vec4(0, 0, 0, 1)));
+}
+
+#elif BONE_FORMAT == BONE_FORMAT_DUAL_QUAT
+mat4 get_transform_matrix(int bone_id) {
+    int index = get_bone_index(bone_id) * 2;
+    vec4 real = texelFetch(bone_transform_tex, index);
+    vec4 dual = texelFetch(bone_transform_tex, index + 1);
+
+    // translation = 2 * dual * conjugate(real)
+    vec3 t = 2 * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+
+    float x = real.x, y = real.y, z = real.z, w = real.w;
+    return mat4(
+        1 - 2 * (y * y + z * z), 2 * (x * y + w * z), 2 * (x * z - w * y), 0,
+        2 * (x * y - w * z), 1 - 2 * (x * x + z * z), 2 * (y * z + w * x), 0,
+        2 * (x * z + w * y), 2 * (y * z - w * x), 1 - 2 * (x * x + y * y), 0,
+        t.x, t.y, t.z, 1);
+}
+
+#else  // BONE_FORMAT_MAT4
 mat4 get_transform_matrix(int bone_id) {
-    int index = bone_id * 4;
+    int index = get_bone_index(bone_id) * 4;
     vec4 row0 = texelFetch(bone_transform_tex, index);
     vec4 row1 = texelFetch(bone_transform_tex, index + 1);
     vec4 row2 = texelFetch(bone_transform_tex, index + 2);
     vec4 row3 = texelFetch(bone_transform_tex, index + 3);
     return mat4(row0, row1, row2, row3);
 }
+#endif
 
 void main() {
     vert_texcoord = p3d_MultiTexCoord0;